@@ -0,0 +1,153 @@
+/*
+ * 距离 / margin kernel 的 microbenchmark (Google Benchmark)
+ *
+ * 覆盖 distance.h 中的 serial_dot / dot / euclidean_distance / Euclidean::margin (按 CPU 选择的实现),
+ * 以及 simd.h 中 scalar / avx2 / avx512 各自的 dot / l2 / margin (当前 CPU 不支持的跳过)。
+ * 参数: 维度 f (32 ~ 1024, 包含不是 32 倍数的维度), 是否 64 字节对齐, 是否冷 cache:
+ *   hot : 每次迭代计算同一对向量, 数据一直在 L1 中
+ *   cold: 在 COLD_BYTES 大小的向量池中按随机顺序轮流取向量, 每次迭代基本都要从内存读取
+ * 除了 time/iteration 之外输出 cycles/elem (TSC 周期数 / (迭代次数 * f)), kernel 的性能回退直接体现在这一列。
+ * TSC 以固定频率计数, 与开启睿频时的实际核心周期不完全一致, 对比时固定频率或在同一台机器上比较。
+ *
+ * make bench && ./bench/kernels [--benchmark_filter=avx512] [--benchmark_format=json]
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <x86intrin.h>
+#include <benchmark/benchmark.h>
+
+#include "distance.h"
+
+static const size_t COLD_BYTES = 256 << 20;  // 远大于 LLC
+static const int DIMS[] = {32, 33, 64, 100, 128, 200, 256, 257, 384, 512, 777, 1000, 1024};
+
+// 所有 benchmark 共用的一块随机数据, 只生成一次
+const float* shared_data() {
+  static std::vector<float> data = [] {
+    std::vector<float> d(COLD_BYTES / sizeof(float) + 16);
+    std::mt19937 generator(1313);
+    std::uniform_real_distribution<float> distribution(-1.0, 1.0);
+    for (auto& x : d) {
+      x = distribution(generator);
+    }
+    return d;
+  }();
+  return data.data();
+}
+
+// 一组向量对: hot 时只有一对, cold 时铺满 COLD_BYTES, 按随机排列访问
+class VectorPool {
+ public:
+  VectorPool(int f, bool aligned, bool cold) {
+    // 每个向量占整数个 cache line, 不对齐时整体偏移 4 字节
+    stride_ = (f * sizeof(float) + 64 + 63) / 64 * 64 / sizeof(float);
+    const size_t n = cold ? COLD_BYTES / (2 * stride_ * sizeof(float)) - 1 : 1;
+    const float* data = shared_data();
+    const float* first_line = reinterpret_cast<const float*>((reinterpret_cast<uintptr_t>(data) + 63) / 64 * 64);
+    base_ = first_line + (aligned ? 0 : 1);
+    order_.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      order_[i] = i;
+    }
+    std::shuffle(order_.begin(), order_.end(), std::mt19937(f));
+  }
+
+  size_t size() const {
+    return order_.size();
+  }
+
+  const float* x(size_t i) const {
+    return base_ + 2 * order_[i] * stride_;
+  }
+
+  const float* y(size_t i) const {
+    return x(i) + stride_;
+  }
+
+ private:
+  const float* base_;
+  size_t stride_;
+  std::vector<size_t> order_;
+};
+
+// kernel 以模板参数传入, 计时循环中没有 std::function 之类的额外间接调用
+template <typename Kernel>
+void run_kernel(benchmark::State& state, const Kernel& kernel) {
+  const int f = state.range(0);
+  const bool aligned = state.range(1);
+  const bool cold = state.range(2);
+  VectorPool pool(f, aligned, cold);
+  const size_t n = pool.size();
+
+  size_t i = 0;
+  const uint64_t tsc_start = __rdtsc();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(kernel(pool.x(i), pool.y(i), f));
+    if (++i == n) {
+      i = 0;
+    }
+  }
+  const uint64_t tsc_end = __rdtsc();
+
+  const double elems = (double)state.iterations() * f;
+  state.counters["cycles/elem"] = benchmark::Counter((tsc_end - tsc_start) / elems);
+  state.SetItemsProcessed(state.iterations() * f);
+  state.SetLabel(string(aligned ? "aligned" : "unaligned") + (cold ? "/cold" : "/hot"));
+}
+
+template <typename Kernel>
+void register_kernel(const string& name, Kernel kernel) {
+  auto* b = benchmark::RegisterBenchmark(name.c_str(), [kernel](benchmark::State& state) { run_kernel(state, kernel); });
+  b->ArgNames({"f", "aligned", "cold"});
+  for (int cold : {0, 1}) {
+    for (int aligned : {1, 0}) {
+      for (int f : DIMS) {
+        b->Args({f, aligned, cold});
+      }
+    }
+  }
+}
+
+void register_table(const DistanceKernels& k) {
+  const string prefix = string(k.name) + "/";
+  auto dot_fn = k.dot;
+  auto l2_fn = k.l2;
+  auto margin_fn = k.margin;
+  register_kernel(prefix + "dot", [dot_fn](const float* x, const float* y, int f) { return dot_fn(x, y, f); });
+  register_kernel(prefix + "l2", [l2_fn](const float* x, const float* y, int f) { return l2_fn(x, y, f); });
+  register_kernel(prefix + "margin", [margin_fn](const float* x, const float* y, int f) { return margin_fn(x, 0.5f, y, f); });
+}
+
+int main(int argc, char** argv) {
+  // distance.h 中的入口, 与索引中实际调用的一致
+  register_kernel("serial_dot", [](const float* x, const float* y, int f) { return serial_dot(x, y, f); });
+  register_kernel("dot", [](const float* x, const float* y, int f) { return dot(x, y, f); });
+  register_kernel("euclidean_distance", [](const float* x, const float* y, int f) { return euclidean_distance(x, y, f); });
+  register_kernel("Euclidean::margin", [](const float* x, const float* y, int f) {
+    Node node;
+    node.alpha = 0.5f;
+    return Euclidean::margin(&node, x, y, f);
+  });
+
+  // 各个 SIMD 实现
+  register_table(scalar_kernels());
+  if (cpu_has_avx2()) {
+    register_table(avx2_kernels());
+  }
+  if (cpu_has_avx512()) {
+    register_table(avx512_kernels());
+  }
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::AddCustomContext("kernels", distance_kernels().name);
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
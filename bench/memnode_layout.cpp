@@ -0,0 +1,188 @@
+/*
+ * 内存树节点布局的 microbenchmark
+ *
+ * split : 旧布局, 节点数组中存 float* v, 向量在另一块数组中, 每层两次相互依赖的访存
+ * packed: 新布局, 32 字节头部后紧跟向量, 按 cache line 对齐连续存放
+ *
+ * 两种布局都是同一棵按 BFS 编号的满二叉树, 随机 query 从根下降到叶子,
+ * 统计每个 query 的耗时以及 cache miss / dTLB miss (perf_event_open, 不可用时输出 n/a)
+ *
+ * ./memnode_layout [--features f] [--levels L] [--queries n]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "simd.h"
+
+struct SplitNode {
+  int origin;
+  int left;
+  int right;
+  float* v;
+  float alpha;
+};
+
+struct alignas(32) PackedNode {
+  int origin;
+  int left;
+  int right;
+  float alpha;
+  float scale;
+  float l1;
+  const float* v() const { return reinterpret_cast<const float*>(this + 1); }
+};
+
+class PerfCounter {
+ public:
+  PerfCounter(uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  ~PerfCounter() {
+    if (fd_ >= 0) close(fd_);
+  }
+  bool ok() const { return fd_ >= 0; }
+  void start() {
+    if (fd_ < 0) return;
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  long long stop() {
+    if (fd_ < 0) return -1;
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    long long count = 0;
+    if (read(fd_, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+  }
+
+ private:
+  int fd_;
+};
+
+static const uint64_t DTLB_READ_MISS = PERF_COUNT_HW_CACHE_DTLB |
+                                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+template <typename Descend>
+void run(const char* name, int n_queries, Descend descend) {
+  PerfCounter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  PerfCounter tlb(PERF_TYPE_HW_CACHE, DTLB_READ_MISS);
+  long long checksum = 0;
+  misses.start();
+  tlb.start();
+  auto t_start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < n_queries; i++) {
+    checksum += descend(i);
+  }
+  auto t_end = std::chrono::high_resolution_clock::now();
+  long long n_tlb = tlb.stop();
+  long long n_miss = misses.stop();
+  double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t_end - t_start).count();
+
+  std::cout << std::left << std::setw(8) << name << std::fixed << std::setprecision(1)
+            << "\tns/query: " << ns / n_queries << "\tcache-miss/query: ";
+  if (n_miss >= 0) std::cout << (double)n_miss / n_queries;
+  else std::cout << "n/a";
+  std::cout << "\tdTLB-miss/query: ";
+  if (n_tlb >= 0) std::cout << (double)n_tlb / n_queries;
+  else std::cout << "n/a";
+  std::cout << "\t(checksum " << checksum << ")" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  int f = 256;
+  int levels = 18;
+  int n_queries = 200000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--features") == 0) f = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--levels") == 0) levels = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--queries") == 0) n_queries = std::stoi(argv[++i]);
+    else {
+      std::cout << "./memnode_layout [--features f] [--levels L] [--queries n]" << std::endl;
+      return 1;
+    }
+  }
+
+  const int n_nodes = (1 << levels) - 1;
+  const int n_internal = (1 << (levels - 1)) - 1;
+  std::cout << "kernels: " << distance_kernels().name << "\tfeatures: " << f
+            << "\tlevels: " << levels << "\tnodes: " << n_nodes << std::endl;
+
+  std::mt19937 generator(1313);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> queries((size_t)1024 * f);
+  for (auto& x : queries) x = distribution(generator);
+
+  // 两种布局使用相同的 hyperplane, 下降路径相同, checksum 也相同
+  auto fill = [&](int i, float* v, float& alpha) {
+    std::mt19937 g(i);
+    std::normal_distribution<float> d(0.0, 1.0);
+    for (int z = 0; z < f; z++) v[z] = d(g);
+    alpha = 0;
+  };
+  auto child = [&](int i, int side) { return i < n_internal ? 2 * i + 1 + side : -1; };
+
+  {
+    std::vector<SplitNode> nodes(n_nodes);
+    std::vector<float> vecs((size_t)n_nodes * f);
+    for (int i = 0; i < n_nodes; i++) {
+      nodes[i].origin = i;
+      nodes[i].left = child(i, 0);
+      nodes[i].right = child(i, 1);
+      nodes[i].v = vecs.data() + (size_t)i * f;
+      fill(i, nodes[i].v, nodes[i].alpha);
+    }
+    run("split", n_queries, [&](int q) {
+      const float* y = queries.data() + (size_t)(q & 1023) * f;
+      const SplitNode* nd = nodes.data();
+      while (nd->left != -1) {
+        float margin = distance_kernels().margin(nd->v, nd->alpha, y, f);
+        nd = nodes.data() + (margin <= 0 ? nd->left : nd->right);
+      }
+      return nd->origin;
+    });
+  }
+
+  {
+    const size_t stride = (sizeof(PackedNode) + sizeof(float) * f + 63) / 64 * 64;
+    const size_t slab_size = (size_t)n_nodes * stride;
+    char* slab = (char*)aligned_alloc(64, slab_size);
+    madvise(slab, slab_size, MADV_HUGEPAGE);
+    for (int i = 0; i < n_nodes; i++) {
+      PackedNode* nd = reinterpret_cast<PackedNode*>(slab + i * stride);
+      nd->origin = i;
+      nd->left = child(i, 0);
+      nd->right = child(i, 1);
+      fill(i, const_cast<float*>(nd->v()), nd->alpha);
+    }
+    run("packed", n_queries, [&](int q) {
+      const float* y = queries.data() + (size_t)(q & 1023) * f;
+      const PackedNode* nd = reinterpret_cast<const PackedNode*>(slab);
+      while (nd->left != -1) {
+        float margin = distance_kernels().margin(nd->v(), nd->alpha, y, f);
+        nd = reinterpret_cast<const PackedNode*>(slab + (margin <= 0 ? nd->left : nd->right) * stride);
+      }
+      return nd->origin;
+    });
+    free(slab);
+  }
+  return 0;
+}
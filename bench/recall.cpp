@@ -0,0 +1,236 @@
+/*
+ * 召回率与延迟的 benchmark
+ *
+ * 用 --load 的数据集建索引(索引已经建好时直接打开), 用 --queries 中的向量查询,
+ * 与 ground truth 比较得到 recall@1 (search_top1) 和 recall@k (search_topk)。
+ * ground truth 从 --groundtruth 读取(ivecs), 没有时对数据集做一次多线程 SIMD 暴力搜索求出,
+ * 可以用 --save_groundtruth 写成 ivecs 下次直接读取。
+ * 每个 query 单独计时(ns), 输出 QPS 以及 p50/p90/p99/p999 延迟, --json 时同时写成 JSON 方便跟踪回归。
+ *
+ * ./recall --path index.mmap --load base.fvecs [--queries query.fvecs] [--groundtruth gt.ivecs]
+ *          [--save_groundtruth gt.ivecs] [--k 10] [--search_k n] [--test_count n] [--thread n]
+ *          [--trees n] [--build_threads n] [--mem_levels L] [--mem_budget MB] [--hot_budget MB] [--cache_capacity n] [--storage pmem/mmap]
+ *          [--raw_dim d] [--json out.json]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include "index_impl.h"
+
+struct LatencyStats {
+  double qps = 0;
+  double recall = 0;
+  double mean_ns = 0;
+  double p50_ns = 0;
+  double p90_ns = 0;
+  double p99_ns = 0;
+  double p999_ns = 0;
+};
+
+// latency 会被排序
+LatencyStats summarize(std::vector<double>& latency, double wall_secs, double recall) {
+  LatencyStats s;
+  const size_t n = latency.size();
+  if (n == 0) return s;
+  std::sort(latency.begin(), latency.end());
+  auto pct = [&](double p) { return latency[std::min(n - 1, (size_t)(p * n))]; };
+  double sum = 0;
+  for (double x : latency) sum += x;
+  s.qps = n / wall_secs;
+  s.recall = recall;
+  s.mean_ns = sum / n;
+  s.p50_ns = pct(0.50);
+  s.p90_ns = pct(0.90);
+  s.p99_ns = pct(0.99);
+  s.p999_ns = pct(0.999);
+  return s;
+}
+
+void print_stats(const char* name, const LatencyStats& s) {
+  std::cout << name << "\trecall: " << std::fixed << std::setprecision(4) << s.recall
+            << "\tquery/s: " << std::setprecision(1) << s.qps
+            << "\tmean: " << s.mean_ns << " ns\tp50: " << s.p50_ns << "\tp90: " << s.p90_ns
+            << "\tp99: " << s.p99_ns << "\tp999: " << s.p999_ns << std::endl;
+}
+
+void json_stats(FILE* fp, const char* name, const LatencyStats& s) {
+  fprintf(fp, "  \"%s\": {\"recall\": %.6f, \"qps\": %.1f, \"latency_ns\": "
+          "{\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f}}",
+          name, s.recall, s.qps, s.mean_ns, s.p50_ns, s.p90_ns, s.p99_ns, s.p999_ns);
+}
+
+// 多线程依次对每个 query 调用 search(q), 记录每个 query 的耗时(ns), 返回总的墙钟时间(秒)
+template <typename Search>
+double timed_run(int n_queries, int thread_num, std::vector<double>& latency, Search search) {
+  latency.assign(n_queries, 0);
+  auto t_start = std::chrono::steady_clock::now();
+#pragma omp parallel for num_threads(thread_num) schedule(static)
+  for (int q = 0; q < n_queries; q++) {
+    auto q_start = std::chrono::steady_clock::now();
+    search(q);
+    auto q_end = std::chrono::steady_clock::now();
+    latency[q] = std::chrono::duration_cast<std::chrono::nanoseconds>(q_end - q_start).count();
+  }
+  auto t_end = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(t_end - t_start).count() * 1e-09;
+}
+
+int main(int argc, char** argv) {
+  string path, load_path, query_path, gt_path, save_gt_path, json_path;
+  int k = 10, search_k = 0, n_queries = 10000, thread_num = 1, raw_dim = 0;
+  IndexOptions options;
+  options.result_cache_capacity = 0;  // 默认不用结果缓存, 测的是搜索本身
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--path") == 0) path = argv[++i];
+    else if (strcmp(argv[i], "--load") == 0) load_path = argv[++i];
+    else if (strcmp(argv[i], "--queries") == 0) query_path = argv[++i];
+    else if (strcmp(argv[i], "--groundtruth") == 0) gt_path = argv[++i];
+    else if (strcmp(argv[i], "--save_groundtruth") == 0) save_gt_path = argv[++i];
+    else if (strcmp(argv[i], "--json") == 0) json_path = argv[++i];
+    else if (strcmp(argv[i], "--k") == 0) k = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--search_k") == 0) search_k = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--test_count") == 0) n_queries = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--thread") == 0) thread_num = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--raw_dim") == 0) raw_dim = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--trees") == 0) options.n_trees = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--build_threads") == 0) options.build_threads = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--mem_levels") == 0) options.mem_tree_levels = std::stoi(argv[++i]);
+    else if (strcmp(argv[i], "--mem_budget") == 0) options.mem_tree_budget = std::stoull(argv[++i]) << 20;
+    else if (strcmp(argv[i], "--hot_budget") == 0) options.hot_cache_budget = std::stoull(argv[++i]) << 20;
+    else if (strcmp(argv[i], "--cache_capacity") == 0) options.result_cache_capacity = std::stoull(argv[++i]);
+    else if (strcmp(argv[i], "--storage") == 0) {
+      string backend = argv[++i];
+      options.storage = backend == "mmap" ? StorageBackend::Mmap : backend == "pmem" ? StorageBackend::Pmem : StorageBackend::Auto;
+    } else {
+      std::cout << "./recall --path index --load base.fvecs [--queries query.fvecs] [--groundtruth gt.ivecs] "
+                   "[--save_groundtruth gt.ivecs] [--k 10] [--search_k n] [--test_count n] [--thread n] "
+                   "[--trees n] [--build_threads n] [--mem_levels L] [--mem_budget MB] [--hot_budget MB] [--cache_capacity n] [--storage pmem/mmap] "
+                   "[--raw_dim d] [--json out.json]" << std::endl;
+      return 1;
+    }
+  }
+  if (path.empty() || load_path.empty() || k <= 0) {
+    std::cout << "--path and --load are required" << std::endl;
+    return 1;
+  }
+
+  VecFile base;
+  if (!base.open(load_path, VecFormat::Auto, raw_dim)) return 1;
+  const int f = base.dim();
+  std::cout << "kernels: " << distance_kernels().name << "\tdataset: " << load_path
+            << "\tvectors: " << base.count() << "\tdim: " << f << std::endl;
+
+  VectorIndex t(path, f, options);
+  if (!t.is_built()) {
+    auto t_start = std::chrono::steady_clock::now();
+    if (!load_vectors(t, base, base.count()) || !t.build_index()) return 1;
+    auto t_end = std::chrono::steady_clock::now();
+    std::cout << "Build done in " << std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count() / 1000.0
+              << " secs." << std::endl;
+  }
+  const int n_items = t.get_n_items();
+
+  // query: 指定了文件时取前 test_count 个, 否则随机取数据集中的向量加一点扰动
+  std::vector<float> queries;
+  if (!query_path.empty()) {
+    VecFile qfile;
+    if (!qfile.open(query_path, VecFormat::Auto, raw_dim) || qfile.dim() != f) {
+      std::cout << "Query file " << query_path << " does not match the dataset dimension " << f << std::endl;
+      return 1;
+    }
+    if (n_queries <= 0 || n_queries > (int)qfile.count()) n_queries = qfile.count();
+    queries.resize((size_t)n_queries * f);
+    if (!qfile.read(0, n_queries, queries.data())) return 1;
+  } else {
+    std::mt19937 generator(1313);
+    std::normal_distribution<float> noise(0.0, 0.01);
+    queries.resize((size_t)n_queries * f);
+    for (int q = 0; q < n_queries; q++) {
+      float* v = queries.data() + (size_t)q * f;
+      t.get_item(generator() % n_items, v);
+      for (int z = 0; z < f; z++) v[z] += noise(generator);
+    }
+  }
+
+  // ground truth: 每个 query 前 gt_k 个近邻
+  std::vector<int32_t> truth;
+  int gt_k = k;
+  if (!gt_path.empty()) {
+    VecFile gfile;
+    if (!gfile.open(gt_path) || gfile.format() != VecFormat::Ivecs || gfile.count() < (size_t)n_queries) {
+      std::cout << "Bad ground truth file " << gt_path << std::endl;
+      return 1;
+    }
+    gt_k = gfile.dim();
+    truth.resize((size_t)n_queries * gt_k);
+    gfile.read_ints(0, n_queries, truth.data());
+  } else {
+    auto t_start = std::chrono::steady_clock::now();
+    BruteForceKnn knn(queries.data(), n_queries, f, k);
+    base.stream(0, std::min<size_t>(n_items, base.count()), 1 << 16, [&](size_t first, size_t cnt, const float* data) {
+      knn.scan(first, cnt, data, thread_num);
+      return true;
+    });
+    truth = knn.all_ids();
+    auto t_end = std::chrono::steady_clock::now();
+    std::cout << "Ground truth done in " << std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count() / 1000.0
+              << " secs." << std::endl;
+    if (!save_gt_path.empty() && !write_ivecs(save_gt_path, truth.data(), n_queries, k)) return 1;
+  }
+  if (gt_k < k) {
+    std::cout << "Ground truth has only " << gt_k << " neighbors per query, using k = " << gt_k << std::endl;
+    k = gt_k;
+  }
+
+  std::vector<double> latency;
+
+  // top1
+  std::vector<int> top1(n_queries);
+  double wall = timed_run(n_queries, thread_num, latency, [&](int q) {
+    top1[q] = t.search_top1(queries.data() + (size_t)q * f);
+  });
+  int hit = 0;
+  for (int q = 0; q < n_queries; q++) hit += top1[q] == truth[(size_t)q * gt_k];
+  LatencyStats top1_stats = summarize(latency, wall, (double)hit / n_queries);
+
+  // topk
+  std::vector<int> topk((size_t)n_queries * k, -1);
+  wall = timed_run(n_queries, thread_num, latency, [&](int q) {
+    t.search_topk(queries.data() + (size_t)q * f, k, search_k, topk.data() + (size_t)q * k, nullptr);
+  });
+  long long found = 0;
+  for (int q = 0; q < n_queries; q++) {
+    const int32_t* gt = truth.data() + (size_t)q * gt_k;
+    for (int j = 0; j < k; j++) {
+      found += std::find(gt, gt + k, topk[(size_t)q * k + j]) != gt + k;
+    }
+  }
+  LatencyStats topk_stats = summarize(latency, wall, (double)found / ((double)n_queries * k));
+
+  std::cout << "queries: " << n_queries << "\tthreads: " << thread_num << "\tk: " << k << "\tsearch_k: " << search_k << std::endl;
+  print_stats("top1", top1_stats);
+  print_stats("topk", topk_stats);
+
+  if (!json_path.empty()) {
+    FILE* fp = fopen(json_path.c_str(), "w");
+    if (fp == nullptr) {
+      std::cout << "Failed to create " << json_path << std::endl;
+      return 1;
+    }
+    fprintf(fp, "{\n  \"dataset\": \"%s\",\n  \"n_items\": %d,\n  \"dim\": %d,\n  \"n_queries\": %d,\n"
+            "  \"threads\": %d,\n  \"kernels\": \"%s\",\n  \"n_trees\": %d,\n  \"k\": %d,\n  \"search_k\": %d,\n",
+            load_path.c_str(), n_items, f, n_queries, thread_num, distance_kernels().name, t.get_n_trees(), k, search_k);
+    json_stats(fp, "top1", top1_stats);
+    fprintf(fp, ",\n");
+    json_stats(fp, "topk", topk_stats);
+    fprintf(fp, "\n}\n");
+    fclose(fp);
+  }
+  return 0;
+}
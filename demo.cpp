@@ -9,7 +9,7 @@
 
 #include "index_impl.h"
 
-int precision(const string &path, int f, int n, int prec_n, bool verbose, bool populate, int thread_num, bool random_test, double random_prop)
+int precision(const string &path, int f, int n, int prec_n, bool verbose, bool populate, int thread_num, bool random_test, double random_prop, const IndexOptions &options)
 {
   std::chrono::high_resolution_clock::time_point t_start, t_end;
 
@@ -19,7 +19,7 @@ int precision(const string &path, int f, int n, int prec_n, bool verbose, bool p
   //******************************************************
   // Building the tree
   t_start = std::chrono::high_resolution_clock::now();
-  VectorIndex t(path, f);
+  VectorIndex t(path, f, options);
   t_end = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
   std::cout << "Load done in " << (duration / 1000.0) << " secs." << std::endl;
@@ -44,19 +44,21 @@ int precision(const string &path, int f, int n, int prec_n, bool verbose, bool p
 
     t_start = std::chrono::high_resolution_clock::now();
     std::cout << "Adding items [" << t.get_n_items() << " to " << n << ")" << std::endl;
-    float *vec = (float *)alloc_stack(f * sizeof(float));
-    for (int i = t.get_n_items(); i < n; ++i)
+    // 每次生成一批向量, 用 add_items 一次写入
+    const int add_batch = 4096;
+    std::vector<float> vecs((size_t)add_batch * f);
+    for (int first = t.get_n_items(); first < n; first += add_batch)
     {
-
-      for (int z = 0; z < f; ++z)
+      const int cnt = std::min(add_batch, n - first);
+      for (size_t z = 0; z < (size_t)cnt * f; ++z)
       {
-        vec[z] = distribution(generator);
+        vecs[z] = distribution(generator);
       }
 
-      t.add_item(i, vec);
+      t.add_items(first, cnt, vecs.data());
 
       if (verbose)
-        std::cout << "Loading objects ...\t object: " << i + 1 << "\tProgress:" << std::fixed << std::setprecision(2) << (double)i / (double)(n + 1) * 100 << "%\r";
+        std::cout << "Loading objects ...\t object: " << first + cnt << "\tProgress:" << std::fixed << std::setprecision(2) << (double)(first + cnt) / (double)(n + 1) * 100 << "%\r";
     }
 
     t_end = std::chrono::high_resolution_clock::now();
@@ -68,6 +70,7 @@ int precision(const string &path, int f, int n, int prec_n, bool verbose, bool p
     t_end = std::chrono::high_resolution_clock::now();
     duration = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
     std::cout << "Build done in " << (duration / 1000.0) << " secs." << std::endl;
+    std::cout << "Peak RSS: " << get_peak_rss_kb() / 1024.0 << " MB" << std::endl;
   }
 
   //******************************************************
@@ -158,7 +161,7 @@ int precision(const string &path, int f, int n, int prec_n, bool verbose, bool p
   return 0;
 }
 
-int speed_test(const string &path, int f, int n, int prec_n, bool verbose, bool populate, int thread_num, bool random_test, double random_prop)
+int speed_test(const string &path, int f, int n, int prec_n, bool verbose, bool populate, int thread_num, bool random_test, double random_prop, int batch_size, int interleave, const IndexOptions &options)
 {
   std::chrono::high_resolution_clock::time_point t_start, t_end;
 
@@ -168,7 +171,7 @@ int speed_test(const string &path, int f, int n, int prec_n, bool verbose, bool
   //******************************************************
   // Building the tree
   t_start = std::chrono::high_resolution_clock::now();
-  VectorIndex t(path, f);
+  VectorIndex t(path, f, options);
   t_end = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
   std::cout << "Load done in " << (duration / 1000.0) << " secs." << std::endl;
@@ -194,19 +197,21 @@ int speed_test(const string &path, int f, int n, int prec_n, bool verbose, bool
 
     t_start = std::chrono::high_resolution_clock::now();
     std::cout << "Adding items [" << t.get_n_items() << " to " << n << ")" << std::endl;
-    float *vec = (float *)alloc_stack(f * sizeof(float));
-    for (int i = t.get_n_items(); i < n; ++i)
+    // 每次生成一批向量, 用 add_items 一次写入
+    const int add_batch = 4096;
+    std::vector<float> vecs((size_t)add_batch * f);
+    for (int first = t.get_n_items(); first < n; first += add_batch)
     {
-
-      for (int z = 0; z < f; ++z)
+      const int cnt = std::min(add_batch, n - first);
+      for (size_t z = 0; z < (size_t)cnt * f; ++z)
       {
-        vec[z] = distribution(generator);
+        vecs[z] = distribution(generator);
       }
 
-      t.add_item(i, vec);
+      t.add_items(first, cnt, vecs.data());
 
       if (verbose)
-        std::cout << "Loading objects ...\t object: " << i + 1 << "\tProgress:" << std::fixed << std::setprecision(2) << (double)i / (double)(n + 1) * 100 << "%\r";
+        std::cout << "Loading objects ...\t object: " << first + cnt << "\tProgress:" << std::fixed << std::setprecision(2) << (double)(first + cnt) / (double)(n + 1) * 100 << "%\r";
     }
 
     t_end = std::chrono::high_resolution_clock::now();
@@ -218,6 +223,7 @@ int speed_test(const string &path, int f, int n, int prec_n, bool verbose, bool
     t_end = std::chrono::high_resolution_clock::now();
     duration = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
     std::cout << "Build done in " << (duration / 1000.0) << " secs." << std::endl;
+    std::cout << "Peak RSS: " << get_peak_rss_kb() / 1024.0 << " MB" << std::endl;
   }
 
   //******************************************************
@@ -235,58 +241,244 @@ int speed_test(const string &path, int f, int n, int prec_n, bool verbose, bool
     float *vec = (float *)alloc_stack(vec_size);
     float *vec2 = (float *)alloc_stack(vec_size);
 
-    for (int i = 0; i < prec_n; ++i)
+    if (batch_size > 1)
     {
-      // select a random node
-      int j = random.rand() % n;
-      if (j == 0) continue;
-      if (verbose)
-        std::cout << "finding nbs for " << j << std::endl;
-
-      if (random_test && ((double)random.index(1000) / 1000) <= random_prop)
+      // 批量查询: 每次攒 batch_size 个 query 调用 search_top1_batch,
+      // interleave > 0 时改为调用 search_top1_interleaved, 同时推进 interleave 个 query
+      std::vector<float> batch((size_t)batch_size * f);
+      std::vector<int> result(batch_size);
+      for (int i = 0; i < prec_n; i += batch_size)
       {
-        for (int z = 0; z < f; ++z)
+        int cnt = std::min(batch_size, prec_n - i);
+        for (int b = 0; b < cnt; ++b)
         {
-          // for (int z = 0; z < f; ++z)
-          // {
-          //   vec[z] = distribution(generator);
-          // }
-          t.get_item(j, vec);
-          vec[129] += 0.01;
-          vec[233] -= 0.02;
+          int j = random.rand() % n;
+          float *q = batch.data() + (size_t)b * f;
+          t.get_item(j, q);
+          if (random_test && ((double)random.index(1000) / 1000) <= random_prop)
+          {
+            q[129] += 0.01;
+            q[233] -= 0.02;
+          }
         }
+
+        t_start = std::chrono::high_resolution_clock::now();
+        if (interleave > 0)
+          t.search_top1_interleaved(batch.data(), cnt, result.data(), interleave);
+        else
+          t.search_top1_batch(batch.data(), cnt, result.data());
+        t_end = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t_end - t_start).count();
+        time_sum += duration;
       }
+      std::lock_guard<std::mutex> lock(print_mutex);
+      if (interleave > 0)
+        std::cout << "\nTop1 interleaved(" << interleave << ", batch " << batch_size << "): ";
       else
+        std::cout << "\nTop1 batch(" << batch_size << "): ";
+      std::cout << "\tTime: "
+                << (time_sum / (prec_n)) * 1e-03 << " ms"
+                << "\tquery/s: " << (prec_n) / (time_sum * 1e-06) << std::endl;
+    }
+    else
+    {
+      for (int i = 0; i < prec_n; ++i)
       {
-        t.get_item(j, vec);
-      }
+        // select a random node
+        int j = random.rand() % n;
+        if (j == 0) continue;
+        if (verbose)
+          std::cout << "finding nbs for " << j << std::endl;
 
-      t_start = std::chrono::high_resolution_clock::now();
-      int top = t.search_top1(vec);
-      t_end = std::chrono::high_resolution_clock::now();
-      auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t_end - t_start).count();
+        if (random_test && ((double)random.index(1000) / 1000) <= random_prop)
+        {
+          for (int z = 0; z < f; ++z)
+          {
+            // for (int z = 0; z < f; ++z)
+            // {
+            //   vec[z] = distribution(generator);
+            // }
+            t.get_item(j, vec);
+            vec[129] += 0.01;
+            vec[233] -= 0.02;
+          }
+        }
+        else
+        {
+          t.get_item(j, vec);
+        }
 
-      time_sum += duration;
+        t_start = std::chrono::high_resolution_clock::now();
+        int top = t.search_top1(vec);
+        t_end = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t_end - t_start).count();
 
-      // print resulting metrics
-      if (verbose)
+        time_sum += duration;
+
+        // print resulting metrics
+        if (verbose)
+        {
+          std::cout << "Top1: "
+                    << "\tTime: " << std::fixed << std::setprecision(2)
+                    << (time_sum / (i + 1)) * 1e-03 << " ms"
+                    << "\tquery/s: " << (i + 1) / (time_sum * 1e-06) << std::endl;
+        }
+      }
       {
-        std::cout << "Top1: "
-                  << "\tTime: " << std::fixed << std::setprecision(2)
-                  << (time_sum / (i + 1)) * 1e-03 << " ms"
-                  << "\tquery/s: " << (i + 1) / (time_sum * 1e-06) << std::endl;
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "\nTop1: "
+                  << "\tTime: "
+                  << (time_sum / (prec_n)) * 1e-03 << " ms"
+                  << "\tquery/s: " << (prec_n) / (time_sum * 1e-06) << std::endl;
+        // std::cout << "Go Tree:" << t.go_tree_ << std::endl;
+        // std::cout << "Coliision num:" << t.collision_num << std::endl;
       }
     }
+  }
+  return 0;
+}
+
+// 在真实数据集上测试: 从 load_path 导入向量建索引, 用 query_path 中的向量查询
+// 给出 groundtruth (ivecs, 每个 query 的近邻 id 按距离升序) 时统计 recall@1,
+// 没有 groundtruth 但指定了 --precision 时用暴力搜索求真实的最近邻;
+// 没有 query 文件时随机取索引中的向量作为 query
+int dataset_test(const string &path, int f, long long n, int prec_n, bool verbose, bool populate, bool precision_test, int thread_num, const string &load_path, const string &query_path, const string &gt_path, int raw_dim, const IndexOptions &options)
+{
+  std::chrono::high_resolution_clock::time_point t_start, t_end;
+
+  VecFile base;
+  if (!load_path.empty())
+  {
+    if (!base.open(load_path, VecFormat::Auto, raw_dim))
+      return EXIT_FAILURE;
+    f = base.dim();
+    if (n <= 0 || n > (long long)base.count())
+      n = base.count();
+    std::cout << "Dataset " << load_path << ": " << base.count() << " vectors, dim " << f << std::endl;
+  }
+
+  t_start = std::chrono::high_resolution_clock::now();
+  VectorIndex t(path, f, options);
+  t_end = std::chrono::high_resolution_clock::now();
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
+  std::cout << "Load done in " << (duration / 1000.0) << " secs." << std::endl;
+
+  if (populate && !load_path.empty() && !t.is_built())
+  {
+    t_start = std::chrono::high_resolution_clock::now();
+    std::cout << "Adding items [" << t.get_n_items() << " to " << n << ")" << std::endl;
+    if (!load_vectors(t, base, n))
+      return EXIT_FAILURE;
+    t_end = std::chrono::high_resolution_clock::now();
+    duration = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
+    std::cout << "Add items done in " << (duration / 1000.0) << " secs." << std::endl;
+
+    t_start = std::chrono::high_resolution_clock::now();
+    t.build_index();
+    t_end = std::chrono::high_resolution_clock::now();
+    duration = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
+    std::cout << "Build done in " << (duration / 1000.0) << " secs." << std::endl;
+    std::cout << "Peak RSS: " << get_peak_rss_kb() / 1024.0 << " MB" << std::endl;
+  }
+  n = t.get_n_items();
+  if (n == 0)
+  {
+    std::cout << "Index is empty" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // 准备 query
+  std::vector<float> queries;
+  int n_queries = prec_n;
+  if (!query_path.empty())
+  {
+    VecFile qfile;
+    if (!qfile.open(query_path, VecFormat::Auto, raw_dim) || qfile.dim() != f)
     {
-      std::lock_guard<std::mutex> lock(print_mutex);
-      std::cout << "\nTop1: "
-                << "\tTime: "
-                << (time_sum / (prec_n)) * 1e-03 << " ms"
-                << "\tquery/s: " << (prec_n) / (time_sum * 1e-06) << std::endl;
-      // std::cout << "Go Tree:" << t.go_tree_ << std::endl;
-      // std::cout << "Coliision num:" << t.collision_num << std::endl;
+      std::cout << "Query file " << query_path << " does not match the index dimension " << f << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (n_queries <= 0 || n_queries > (int)qfile.count())
+      n_queries = qfile.count();
+    queries.resize((size_t)n_queries * f);
+    qfile.read(0, n_queries, queries.data());
+  }
+  else
+  {
+    Random random;
+    queries.resize((size_t)n_queries * f);
+    for (int i = 0; i < n_queries; i++)
+      t.get_item(random.rand() % n, queries.data() + (size_t)i * f);
+  }
+
+  std::vector<int> truth;
+  if (!gt_path.empty())
+  {
+    VecFile gfile;
+    if (!gfile.open(gt_path) || gfile.format() != VecFormat::Ivecs || gfile.count() < (size_t)n_queries)
+    {
+      std::cout << "Bad ground truth file " << gt_path << std::endl;
+      return EXIT_FAILURE;
     }
+    std::vector<int32_t> gt((size_t)n_queries * gfile.dim());
+    gfile.read_ints(0, n_queries, gt.data());
+    truth.resize(n_queries);
+    for (int i = 0; i < n_queries; i++)
+      truth[i] = gt[(size_t)i * gfile.dim()];
+  }
+  else if (precision_test)
+  {
+    std::cout << "Computing ground truth by brute force ..." << std::endl;
+    truth.resize(n_queries);
+#pragma omp parallel num_threads(thread_num)
+    {
+      std::vector<float> item(f);
+#pragma omp for schedule(dynamic, 16)
+      for (int i = 0; i < n_queries; i++)
+      {
+        float min_dist = std::numeric_limits<float>::max();
+        for (int k = 0; k < n; k++)
+        {
+          t.get_item(k, item.data());
+          float dist = Distance::distance(item.data(), queries.data() + (size_t)i * f, f);
+          if (dist < min_dist)
+          {
+            min_dist = dist;
+            truth[i] = k;
+          }
+        }
+      }
+    }
+  }
+
+  //******************************************************
+  std::vector<int> result(n_queries);
+  double time_sum = 0;
+  t_start = std::chrono::high_resolution_clock::now();
+#pragma omp parallel for num_threads(thread_num) schedule(static) reduction(+:time_sum)
+  for (int i = 0; i < n_queries; i++)
+  {
+    auto q_start = std::chrono::high_resolution_clock::now();
+    result[i] = t.search_top1(queries.data() + (size_t)i * f);
+    auto q_end = std::chrono::high_resolution_clock::now();
+    time_sum += std::chrono::duration_cast<std::chrono::nanoseconds>(q_end - q_start).count();
+    if (verbose)
+      std::cout << "query " << i << " -> " << result[i] << std::endl;
+  }
+  t_end = std::chrono::high_resolution_clock::now();
+  double wall = std::chrono::duration_cast<std::chrono::nanoseconds>(t_end - t_start).count() * 1e-09;
+
+  std::cout << "\nTop1: "
+            << "\tqueries: " << n_queries;
+  if (!truth.empty())
+  {
+    int hit = 0;
+    for (int i = 0; i < n_queries; i++)
+      hit += result[i] == truth[i];
+    std::cout << "\trecall@1: " << std::fixed << std::setprecision(2) << (100.0 * hit / n_queries) << "%";
   }
+  std::cout << "\tavg. time: " << std::fixed << std::setprecision(8) << (time_sum / n_queries) * 1e-06 << " ms"
+            << "\tquery/s: " << n_queries / wall << std::endl;
   return 0;
 }
 
@@ -294,11 +486,11 @@ void help()
 {
   std::cout << "Vector Demo C++ example" << std::endl;
   std::cout << "Usage:" << std::endl;
-  std::cout << "./precision [--features num_features] [--nodes num_nodes] [--path index_path] [--test_count num_of_tests] [--populate true/false] [--verbose]" << std::endl;
+  std::cout << "./precision [--features num_features] [--nodes num_nodes] [--path index_path] [--test_count num_of_tests] [--populate true/false] [--verbose] [--batch batch_size] [--trees num_trees] [--build_threads num_threads] [--quantize] [--prefetch lines] [--mem_levels levels] [--mem_budget MB] [--hot_budget MB] [--delta_threshold items] [--interleave group] [--cache_capacity entries] [--persist_cache] [--storage pmem/mmap] [--load base.fvecs/bvecs/raw] [--queries query.fvecs] [--groundtruth gt.ivecs] [--raw_dim dim]" << std::endl;
   std::cout << std::endl;
 }
 
-void feedback(const string &path, int f, long long n, int prec_n, bool populate, int thread_num, bool random_test, double random_prop)
+void feedback(const string &path, int f, long long n, int prec_n, bool populate, int thread_num, bool random_test, double random_prop, int batch_size, int interleave, const string &load_path, const string &query_path, const string &gt_path, const IndexOptions &options)
 {
   std::cout << "Running demo with:" << std::endl;
   std::cout << "num. features: " << f << std::endl;
@@ -309,6 +501,25 @@ void feedback(const string &path, int f, long long n, int prec_n, bool populate,
   std::cout << "thread num: " << thread_num << std::endl;
   std::cout << "is random test: " << random_test << std::endl;
   std::cout << "random prop: " << random_prop << std::endl;
+  std::cout << "batch size: " << batch_size << std::endl;
+  std::cout << "interleave group: " << interleave << std::endl;
+  std::cout << "num. trees: " << options.n_trees << std::endl;
+  std::cout << "build threads: " << options.build_threads << std::endl;
+  std::cout << "quantize mem tree: " << options.quantize_mem_tree << std::endl;
+  std::cout << "prefetch lines: " << options.prefetch_lines << std::endl;
+  std::cout << "mem tree levels: " << options.mem_tree_levels << std::endl;
+  std::cout << "mem tree budget: " << (options.mem_tree_budget >> 20) << " MB" << std::endl;
+  std::cout << "hot subtree budget: " << (options.hot_cache_budget >> 20) << " MB" << std::endl;
+  std::cout << "delta merge threshold: " << options.delta_merge_threshold << std::endl;
+  std::cout << "result cache capacity: " << options.result_cache_capacity << std::endl;
+  std::cout << "persist result cache: " << options.persist_result_cache << std::endl;
+  std::cout << "storage: " << (options.storage == StorageBackend::Mmap ? "mmap" : options.storage == StorageBackend::Pmem ? "pmem" : "auto") << std::endl;
+  if (!load_path.empty())
+    std::cout << "load vectors: " << load_path << std::endl;
+  if (!query_path.empty())
+    std::cout << "query vectors: " << query_path << std::endl;
+  if (!gt_path.empty())
+    std::cout << "ground truth: " << gt_path << std::endl;
   std::cout << std::endl;
 }
 
@@ -323,6 +534,12 @@ int main(int argc, char **argv)
   int thread_num = 1;
   bool random_test = false;
   double random_prop = 0.2;
+  int batch_size = 1;
+  int interleave = 0;
+  bool nodes_set = false;
+  string load_path, query_path, gt_path;
+  int raw_dim = 0;
+  IndexOptions options;
   for (int i = 1; i < argc; i++)
   {
     if (strcmp(argv[i], "--features") == 0)
@@ -337,6 +554,7 @@ int main(int argc, char **argv)
     else if (strcmp(argv[i], "--nodes") == 0)
     {
       n = atoll(argv[++i]);
+      nodes_set = true;
     }
     else if (strcmp(argv[i], "--path") == 0)
     {
@@ -369,6 +587,75 @@ int main(int argc, char **argv)
     {
       random_prop = std::stod(argv[++i]);
     }
+    else if (strcmp(argv[i], "--batch") == 0)
+    {
+      batch_size = std::stoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--trees") == 0)
+    {
+      options.n_trees = std::stoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--build_threads") == 0)
+    {
+      options.build_threads = std::stoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--quantize") == 0)
+    {
+      options.quantize_mem_tree = true;
+    }
+    else if (strcmp(argv[i], "--interleave") == 0)
+    {
+      interleave = std::stoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--cache_capacity") == 0)
+    {
+      options.result_cache_capacity = std::stoull(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--persist_cache") == 0)
+    {
+      options.persist_result_cache = true;
+    }
+    else if (strcmp(argv[i], "--prefetch") == 0)
+    {
+      options.prefetch_lines = std::stoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--mem_levels") == 0)
+    {
+      options.mem_tree_levels = std::stoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--mem_budget") == 0)
+    {
+      options.mem_tree_budget = std::stoull(argv[++i]) << 20;
+    }
+    else if (strcmp(argv[i], "--hot_budget") == 0)
+    {
+      options.hot_cache_budget = std::stoull(argv[++i]) << 20;
+    }
+    else if (strcmp(argv[i], "--delta_threshold") == 0)
+    {
+      options.delta_merge_threshold = std::stoull(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--storage") == 0)
+    {
+      string backend = argv[++i];
+      options.storage = backend == "mmap" ? StorageBackend::Mmap : backend == "pmem" ? StorageBackend::Pmem : StorageBackend::Auto;
+    }
+    else if (strcmp(argv[i], "--load") == 0)
+    {
+      load_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--queries") == 0)
+    {
+      query_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--groundtruth") == 0)
+    {
+      gt_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--raw_dim") == 0)
+    {
+      raw_dim = std::stoi(argv[++i]);
+    }
     else
     {
       // this is for pmreorder which provides the pmem data file as the single parameter
@@ -393,14 +680,22 @@ int main(int argc, char **argv)
     }
   }
 
-  feedback(path, f, n, prec_n, populate, thread_num, random_test, random_prop);
-  if (precision_test)
+  // 交错查询以批量的方式调用, 没有指定 batch 时每批 1024 个 query
+  if (interleave > 0 && batch_size <= 1)
+    batch_size = 1024;
+  feedback(path, f, n, prec_n, populate, thread_num, random_test, random_prop, batch_size, interleave, load_path, query_path, gt_path, options);
+  if (!load_path.empty() || !query_path.empty())
+  {
+    // 没有指定 --nodes 时导入整个数据文件
+    return dataset_test(path, f, nodes_set ? n : 0, prec_n, verbose, populate, precision_test, thread_num, load_path, query_path, gt_path, raw_dim, options);
+  }
+  else if (precision_test)
   {
-    precision(path, f, n, prec_n, verbose, populate, thread_num, random_test, random_prop);
+    precision(path, f, n, prec_n, verbose, populate, thread_num, random_test, random_prop, options);
   }
   else
   {
-    speed_test(path, f, n, prec_n, verbose, populate, thread_num, random_test, random_prop);
+    speed_test(path, f, n, prec_n, verbose, populate, thread_num, random_test, random_prop, batch_size, interleave, options);
   }
 
   return EXIT_SUCCESS;
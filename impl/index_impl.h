@@ -20,8 +20,15 @@
 #include <fstream>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
 #include <unistd.h>
 #include <queue>
+#include <array>
+#include <climits>
+#include <omp.h>
+#include <sys/mman.h>
 // #include <atomic>
 
 #include "index.h"
@@ -29,10 +36,22 @@
 #include "xxh3.h"
 // #include "xxhash64.h"
 #include "bytell_hash_map.h"
+#include "result_cache.h"
+#include "exact_table.h"
+#include "storage.h"
+#include "dataset.h"
+#include "epoch.h"
+#include "delta_buffer.h"
 
-#define POOLSIZE ((1024LL * 1024 * 1024 * 50))
-const uint32_t LEVEL = 22;
-const std::string LAYOUT = "";
+const uint32_t LEVEL = 22;  // 内存树层数的上限
+const uint32_t TREE_SEED = 123456789;  // 第 t 棵树使用 TREE_SEED + t 作为随机种子
+const size_t PARALLEL_BUILD_MIN = 2048;  // 子树的item数不小于该值时作为独立的任务建立
+const int INTERLEAVE_GROUP = 8;  // search_top1_interleaved 默认同时推进的 query 数
+const int HOT_SUBTREE_LEVELS = 8;  // 每个热点子树副本的层数
+const uint32_t VISIT_SAMPLE = 16;  // 离开内存树时每 VISIT_SAMPLE 次记录一次访问, 必须是 2 的幂
+const uint32_t HOT_MIN_VISITS = 4;  // 采样到的访问次数不少于该值的出口才会被提升
+const uint64_t MEM_IMAGE_MAGIC = 0x4d454d494d414745ULL;  // "MEMIMAGE"
+const uint32_t MEM_IMAGE_VERSION = 4;
 // uint64_t myseed = 1313;
 XXH64_hash_t seed = 1313;
 
@@ -52,6 +71,43 @@ XXH64_hash_t seed = 1313;
 //     std::atomic_flag flag;
 // };
 
+// 索引的可选配置
+// n_trees 只在 build_index 时生效, 建好的树数会持久化到 pool 中, 重新打开时以 pool 中的为准
+struct IndexOptions {
+  int n_trees = 1;  // 随机投影树的棵数, 取值 [1, MAX_TREES]
+  int build_threads = 0;  // 建树使用的线程数, 0 表示使用 OpenMP 的默认值; 建树结果与线程数无关
+  // 内存树的 hyperplane 以 int8 存放, DRAM 占用约为 fp32 的 1/4;
+  // margin 接近 0 的节点回到 pmem 中的 fp32 Node 重新计算, 下降路径与不量化时完全相同
+  bool quantize_mem_tree = false;
+  // 下降时计算当前节点的 margin 之前, 先预取两个子节点各 prefetch_lines 个 cache line
+  // (MemNode 为头部和向量, pmem 中为 Node 和向量的开头), 0 表示不预取
+  int prefetch_lines = 0;
+  int mem_tree_levels = 0;  // 内存树缓存的层数上限, 0 表示 LEVEL; 较小的值让更多层留在 pmem 中
+  // 内存树的 DRAM 预算(字节), 0 表示不限制; 在层数上限之内取前 L 层的节点放得下的最大 L (至少缓存根节点),
+  // 内存树只按选出的层实际的节点数分配
+  size_t mem_tree_budget = 0;
+  // 热点子树缓存的 DRAM 上限(字节), 0 表示关闭。下降离开内存树时按采样记录每个出口的访问次数,
+  // 后台线程定期把访问最多的出口下的 pmem 子树拷贝到 DRAM, 再把出口原子地改为指向副本, 见 promote_hot_subtrees
+  size_t hot_cache_budget = 0;
+  int hot_promote_interval_ms = 100;  // 后台提升的间隔, 0 表示不启动后台线程, 只在调用 promote_hot_subtrees 时提升
+  // 查询结果缓存的条目数上限, 超出后按 CLOCK 淘汰, 0 表示不缓存
+  size_t result_cache_capacity = 1 << 20;
+  // 结果缓存放在 pool 中, 重新打开后直接沿用上次运行学到的结果; 容量在第一次创建时确定
+  bool persist_result_cache = false;
+  // 建树后把内存树和 item 表的镜像写入 pool, 重新打开时整块读回, 不再逐个节点拷贝和逐个 item 计算 hash
+  bool persist_mem_image = true;
+  // 存储后端, 默认按 path 选择(见 StorageBackend); 两种后端的建树和查询结果完全相同
+  StorageBackend storage = StorageBackend::Auto;
+  // 新建 pmem pool (不是 pool.set) 时的大小, 节点记录在 pool 内按需分段分配
+  size_t pool_size = POOLSIZE;
+  // 普通文件后端对节点段的 madvise; 树的下降是随机访问, 默认关闭预读
+  int mmap_advice = MADV_RANDOM;
+  // 建树之后插入的 item 先放在 DRAM 的 delta 缓冲区中, 查询时与树的下降结果一起暴力比较;
+  // 缓冲区中达到 delta_merge_threshold 个时由后台线程合并进树, 0 表示只在缓冲区写满或调用 merge_delta 时合并
+  size_t delta_merge_threshold = 1024;
+  size_t delta_capacity = 1 << 14;  // 缓冲区的 item 数上限, 写满时插入先同步合并
+};
+
 class VectorIndex : public VectorIndexInterface {
   /*
    * We use random projection to build a forest of binary trees of all items.
@@ -66,187 +122,854 @@ class VectorIndex : public VectorIndexInterface {
   using VectorIndexInterface::f_;
   using VectorIndexInterface::path_;
 
-  // 需要修改成持久化结构
-  struct Tree {
-    int n_items;  // leaf num
-    bool built;
-    int root;
+  // 镜像的头部, 之后从 MEM_IMAGE_BODY 开始依次是 n_memnodes 个 MemNode (每个 stride 字节) 和 item 表的全部条目
+  // checksum 为头部(checksum 字段为 0)的 xxh3 作为 seed, 对 body 计算的 xxh3
+  struct MemImageHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t f;
+    uint64_t generation;
+    int32_t merged_items;  // 镜像中的树和 item 表包含的 item 数, 合并之后要重新写出才能沿用
+    uint32_t quantized;
+    int32_t mem_tree_level;
+    int32_t mem_tree_level_cap;
+    uint64_t mem_tree_budget;
+    uint64_t stride;
+    uint64_t n_memnodes;
+    int32_t n_trees;
+    int32_t memnode_roots[MAX_TREES];
+    uint64_t table_capacity;
+    uint64_t table_size;
+    int32_t table_shard_bits;
+    uint64_t checksum;
   };
+  static const size_t MEM_IMAGE_BODY = (sizeof(MemImageHeader) + 63) / 64 * 64;
 
-  struct root {
-    persistent_ptr<Tree> tree;
-    persistent_ptr<Node[]> node_array_space;
-    persistent_ptr<float[]> float_array_space;
-    p<int> node_total;
-  };
+  // 查询读取的全部内存结构: 内存树, item 表, 热点子树缓存和 delta 缓冲区, 以及建立它们时的树数和 item 数。
+  // 发布之后只读, 例外是 promote_hot_subtrees 原子地改写内存树的出口并追加副本, merge_delta 原子地把被分裂的叶子
+  // 链接到新节点并向 item 表追加, 以及插入向 delta 缓冲区追加。合并发布的快照与之前的快照共用这些结构(见 share_memory_index)。
+  // 查询进入时取得当前快照并一直使用它; 替换后旧快照在 epoch 宽限期之后释放
+  struct Snapshot {
+    uint64_t version = 0;
+    uint64_t generation = 0;  // 对应的建树次数
+    int n_items = 0;  // 建树时的 item 数, 记录 id 小于它的节点都是叶子
+    int merged_items = 0;  // 树中和 item 表中的 item 数
+    int n_trees = 0;
+    int mem_tree_level = 0;  // 每棵树缓存在内存中的层数
+    std::vector<int> memnode_roots;  // 每棵树的根在内存树中的下标
+    // 按 BFS 顺序连续存放的 MemNode, 每个占 memnode_stride 字节, 大小见 choose_mem_tree_level
+    std::shared_ptr<char> memnode_slab;
+    size_t memnode_stride = 0;
+    uint32_t n_memnodes = 0;
+    // item 向量的 hash -> item id
+    std::shared_ptr<ExactTable> items = std::make_shared<ExactTable>();
 
-  pool<root> pop;
-  Node* node_array_start;
-  float* float_array_start;
+    // 热点子树缓存: fp32 的 MemNode, 每个占 hot_stride 字节, 只追加不回收, 见 promote_hot_subtrees
+    std::shared_ptr<char> hot_slab;
+    size_t hot_stride = 0;
+    size_t hot_capacity = 0;  // 节点数上限
+    size_t hot_count = 0;
+    std::shared_ptr<std::atomic<uint32_t>[]> visits;  // visits[2 * i + side]: 内存树第 i 个节点的出口的采样访问次数
 
-  VectorIndex(const string& path, int f) :
-      VectorIndexInterface(path, f) {
+    // 尚未合并进树的 item [merged_items, ...), 重新加载镜像得到的快照沿用同一个缓冲区
+    std::shared_ptr<DeltaBuffer> delta;
 
-    mem_tree_level_ = LEVEL;
-    uint32_t element_num = 1 << mem_tree_level_;
-    std::cout << "mem_tree_level_ = " << mem_tree_level_ << std::endl;
-    std::cout << "element_num = " << element_num << std::endl;
-    memnode_array_space = new MemNode[element_num];
-    memfloat_array_space = new float[element_num * f_];
-    
-    if (path.find("pool.set") != string::npos) {
-      std::cout << "进入pool.set" << std::endl;
-      try {
-        pop = pool<root>::create(path, LAYOUT, 0, S_IRWXU);
-        proot = pop.root();
-        transaction::run(pop, [&] {
-          // 初始化时，开辟大块的pmem空间
-          proot->tree = make_persistent<Tree>();
-          proot->node_array_space = make_persistent<Node[]>(15LL * 1000 * 1000);
-          proot->float_array_space = make_persistent<float[]>(15LL * 1000 * 1000 * f);
-          node_array_start = proot->node_array_space.get();
-          float_array_start = proot->float_array_space.get();
-        });
-      } catch (const pmem::pool_error &e) {                                                                                                                                                                        
-        pop = pool<root>::open(path, LAYOUT);
-        proot = pop.root();
-        node_array_start = proot->node_array_space.get();
-        float_array_start = proot->float_array_space.get();
-        if (proot->tree->built) {
-          // node_cur_num = proot->tree->n_items;  // 让get函数通过内读取该数值 error
-          node_cur_num = proot->node_total;  // 让get函数通过内读取该数值
-          // 建立内存索引
-          // 建立hash表
-          build_tree_index_in_memory_and_relable_memnode();
-          build_hash_in_memory();
-        }
-      }   
+    Snapshot() = default;
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    MemNode* mem_node(size_t i) {
+      return reinterpret_cast<MemNode*>(memnode_slab.get() + i * memnode_stride);
+    }
+
+    const MemNode* mem_node(size_t i) const {
+      return reinterpret_cast<const MemNode*>(memnode_slab.get() + i * memnode_stride);
+    }
+
+    MemNode* hot_node(size_t i) {
+      return reinterpret_cast<MemNode*>(hot_slab.get() + i * hot_stride);
+    }
+
+    const MemNode* hot_node(size_t i) const {
+      return reinterpret_cast<const MemNode*>(hot_slab.get() + i * hot_stride);
+    }
+  };
+
+  VectorIndex(const string& path, int f, const IndexOptions& options = IndexOptions()) :
+      VectorIndexInterface(path, f), options_(options), result_cache_(options.result_cache_capacity) {
+
+    // 内存树在建树或打开已建好的索引时按实际的节点数分配, 见 alloc_memnode_slab
+    if (options_.quantize_mem_tree) {
+      fq_ = (f_ + QUANT_ALIGN - 1) / QUANT_ALIGN * QUANT_ALIGN;
+      memnode_stride_ = mem_node_stride(fq_);
     } else {
-      if (access(path.c_str(), F_OK) == 0) {
-        std::cout << "进入else if" << std::endl;
-        pop = pool<root>::open(path, LAYOUT);
-        proot = pop.root();
-        node_array_start = proot->node_array_space.get();
-        float_array_start = proot->float_array_space.get();
-        if (proot->tree->built) {
-          // node_cur_num = proot->tree->n_items;  // 让get函数通过内读取该数值 error
-          node_cur_num = proot->node_total;  // 让get函数通过内读取该数值
-          // 建立内存索引
-          // 建立hash表
-          build_tree_index_in_memory_and_relable_memnode();
-          build_hash_in_memory();
-        }
-      } else {
-        std::cout << "进入else else" << std::endl;
-        pop = pool<root>::create(path, LAYOUT, POOLSIZE, S_IRWXU);
-        proot = pop.root();
-        transaction::run(pop, [&] {
-          // 初始化时，开辟大块的pmem空间
-          proot->tree = make_persistent<Tree>();
-          proot->node_array_space = make_persistent<Node[]>(15LL * 1000 * 1000);
-          proot->float_array_space = make_persistent<float[]>(15LL * 1000 * 1000 * f);
-          node_array_start = proot->node_array_space.get();
-          float_array_start = proot->float_array_space.get();
-        });
-      }
+      memnode_stride_ = mem_node_stride(sizeof(float) * f_);
+    }
+    hot_stride_ = mem_node_stride(sizeof(float) * f_);
+
+    // 段表按上限一次分配, 之后追加段只写入新的项, 持有旧快照的查询和合并可以同时读取段表
+    segments_.reset(new float*[MAX_SEGMENTS]());
+    storage_ = open_storage(path, f, options_.storage, options_.pool_size, options_.mmap_advice);
+    meta_ = storage_->meta();
+    record_stride_ = node_record_stride(f_) / sizeof(float);
+    sync_segments();
+    std::cout << "storage: " << storage_->name() << std::endl;
+    if (storage_->existed() && meta_->built) {
+      // node_cur_num = meta_->n_items;  // 让get函数通过内读取该数值 error
+      node_cur_num = meta_->node_total;  // 让get函数通过内读取该数值
+      n_items_ = meta_->n_items;
+      init_record_layout();
+      // 建立内存索引
+      // 建立hash表
+      load_in_memory_index();
     }
+
+    if (options_.persist_result_cache) {
+      attach_result_cache();
+    }
+    start_promoter();
+    start_merger();
   }
 
+  // 调用者保证此时没有进行中的查询和插入; 合并之后还没有写出的镜像在这里写出, 等待宽限期之后旧快照全部释放
   ~VectorIndex() {
-    pop.close();
+    stop_merger();
+    stop_promoter();
+    if (image_stale_) {
+      save_mem_image();
+    }
+    retire_snapshot(snapshot_.exchange(nullptr, std::memory_order_acq_rel));
+    epoch_domain().synchronize();
   }
 
+  // 建树之后 item 必须按 id 顺序插入, 见 insert_items
   bool add_item(int item, const float* w) override {
-    if (proot->tree->built) {
-      log("You can't add an item to an already built index");
+    if (meta_->built) {
+      return insert_items(item, 1, w);
+    }
+    // 可以改写已有的 item, 但不能跳过 id: 跳过的记录没有初始化, 会被当作 item 建进树中
+    if (item < 0 || item > meta_->n_items) {
+      log("Items must be added in id order without gaps\n");
+      return false;
+    }
+    if (!ensure_capacity((size_t)item + 1)) {
+      log("Item id %d exceeds the storage capacity\n", item);
       return false;
     }
     // transaction::run(pop, [&] {
-      Node* n = get(item);
+      float* v = node_vec(item);
+      memcpy(v, w, sizeof(float) * f_);
+      Node* n = node_at(item);
       n->left = -1;
       n->right = -1;
-      
-      for (int z = 0; z < f_; z++)
-        n->v[z] = *(w + z);
+      storage_->persist(v, sizeof(float) * record_stride_);
 
-      if (item >= proot->tree->n_items)
-        proot->tree->n_items = item + 1;
+      // 新的 item 在提交中计入 n_items: pmem 上记录已经持久化, mmap 上 commit 先 fdatasync 记录再写元数据,
+      // 掉电后 n_items 不会包含没有落盘的记录。每个新 item 提交一次, 大量插入用 add_items
+      if (item >= meta_->n_items) {
+        if (item >= (int)node_cur_num) {
+          node_cur_num = item + 1;
+        }
+        storage_->commit([&](IndexMeta& meta) {
+          meta.n_items = item + 1;
+          meta.node_total = node_cur_num;
+        });
+      }
     // });
 
     return true;
   }
 
+  // 批量插入 [first_id, first_id + count) 的向量, data 中按 id 顺序连续存放
+  // 多个线程各自把整条记录(向量, Node, 补齐)按 cache line 用 non-temporal store 写入存储,
+  // 全部落盘之后才在一次提交中更新 n_items; 中途崩溃时 get_n_items 仍是之前的值, 重新插入即可
+  bool add_items(int first_id, int count, const float* data) {
+    if (meta_->built) {
+      return insert_items(first_id, count, data);
+    }
+    if (first_id < 0 || count < 0 || first_id > meta_->n_items) {
+      log("Items must be added in id order without gaps\n");
+      return false;
+    }
+    const size_t end = (size_t)first_id + count;
+    if (count == 0) {
+      return true;
+    }
+    if (!ensure_capacity(end)) {
+      log("Item id %lld exceeds the storage capacity\n", (long long)end - 1);
+      return false;
+    }
+
+    // 向量中整 cache line 的部分直接从 data 写入, 剩下的尾部与 Node 和补齐一起在栈上拼好再写入
+    const size_t record_bytes = sizeof(float) * record_stride_;
+    const size_t head_lines = sizeof(float) * f_ / 64;
+    const size_t tail_bytes = sizeof(float) * f_ - head_lines * 64;
+    const size_t tail_lines = record_bytes / 64 - head_lines;
+    const auto stream_lines = distance_kernels().stream_lines;
+    const int n_threads = options_.build_threads > 0 ? options_.build_threads : omp_get_max_threads();
+#pragma omp parallel num_threads(n_threads)
+    {
+      alignas(64) char tail[128];
+      Node node;
+      node.left = -1;
+      node.right = -1;
+      node.alpha = 0;
+      node.pad = 0;
+#pragma omp for schedule(static)
+      for (int i = 0; i < count; i++) {
+        const char* src = reinterpret_cast<const char*>(data + (size_t)i * f_);
+        char* dst = reinterpret_cast<char*>(node_vec(first_id + i));
+        stream_lines(dst, src, head_lines);
+        memset(tail, 0, tail_lines * 64);
+        memcpy(tail, src + head_lines * 64, tail_bytes);
+        memcpy(tail + tail_bytes, &node, sizeof(node));
+        stream_lines(dst + head_lines * 64, tail, tail_lines);
+      }
+      _mm_sfence();
+    }
+    storage_->drain();
+
+    if ((int)end > (int)node_cur_num) {
+      node_cur_num = end;
+    }
+    storage_->commit([&](IndexMeta& meta) {
+      meta.n_items = std::max<int>(meta.n_items, end);
+      meta.node_total = node_cur_num;
+    });
+    return true;
+  }
+
+  // 建树之后插入 [first_id, first_id + count), first_id 必须等于当前的 item 数。
+  // 记录按 record_of 追加在存储末尾并落盘, 提交 n_items 之后放入当前快照的 delta 缓冲区, 之后的查询立即可见;
+  // 缓冲区写满时先同步合并, 达到 delta_merge_threshold 时通知后台线程合并
+  bool insert_items(int first_id, int count, const float* data) {
+    std::unique_lock<std::mutex> lock(insert_mutex_);
+    if (count < 0 || first_id != meta_->n_items) {
+      log("Items must be added in id order without gaps\n");
+      return false;
+    }
+    int done = 0;
+    while (done < count) {
+      DeltaBuffer& delta = *snapshot_.load(std::memory_order_relaxed)->delta;
+      if (delta.full()) {
+        lock.unlock();
+        merge_delta();
+        lock.lock();
+        if (first_id + done != meta_->n_items) {
+          log("Items must be added in id order without gaps\n");
+          return false;
+        }
+        continue;
+      }
+      const int first = first_id + done;
+      const int n = std::min<int>(count - done, delta.capacity() - delta.size());
+      const long long end = (long long)record_of(first + n - 1) + record_step_;
+      if (end > MAX_NODES || !ensure_capacity(end)) {
+        log("Item id %d exceeds the storage capacity\n", first + n - 1);
+        return false;
+      }
+      for (int i = 0; i < n; i++) {
+        const int record = record_of(first + i);
+        memcpy(node_vec(record), data + (size_t)(done + i) * f_, sizeof(float) * f_);
+        Node* nd = node_at(record);
+        nd->left = -1;
+        nd->right = -1;
+        nd->alpha = 0;
+        nd->pad = 0;
+        storage_->persist(node_vec(record), sizeof(float) * record_stride_);
+      }
+      node_cur_num = end;
+      storage_->commit([&](IndexMeta& meta) {
+        meta.n_items = first + n;
+        meta.node_total = end;
+      });
+      for (int i = 0; i < n; i++) {
+        delta.append(data + (size_t)(done + i) * f_);
+      }
+      done += n;
+    }
+    const size_t pending = snapshot_.load(std::memory_order_relaxed)->delta->size();
+    lock.unlock();
+    if (options_.delta_merge_threshold > 0 && pending >= options_.delta_merge_threshold) {
+      request_merge();
+    }
+    return true;
+  }
+
+  // 把 delta 缓冲区中已有的 item 合并进每棵树(见 merge_item), 就地更新当前快照的内存树, 热点子树副本(见 relink_dram)和 item 表,
+  // 再发布与它共用这些结构、只换了 delta 缓冲区的新快照, 合并期间插入的 item 转入新快照的缓冲区。
+  // 旧快照可以一直使用: 新的链接指向写完的节点, item 表中的条目写完才可见, 它的缓冲区仍包含全部 item。
+  // 耗时与合并的 item 数成正比, 不重建快照; 持久化的镜像在 save_mem_image 或关闭时才重新写出
+  // 返回合并的 item 数
+  int merge_delta() {
+    std::lock_guard<std::mutex> merge_lock(merge_mutex_);
+    int begin, end;
+    {
+      std::lock_guard<std::mutex> lock(insert_mutex_);
+      if (!meta_->built) {
+        return 0;
+      }
+      begin = meta_->merged_items;
+      end = meta_->n_items;
+    }
+    // [begin, end) 的记录在提交 n_items 之前已经分配; 之后的插入追加段时不会移动它们(见 ensure_capacity),
+    // 因此下面读写记录时不需要持有 insert_mutex_
+    if (begin == end) {
+      return 0;
+    }
+
+    // 各棵树的节点互不相交, 每棵树由一个线程按 item 的顺序依次合并。
+    // 先写好全部新节点, 落盘之后再改写已提交节点中的链接: 崩溃之后磁盘上的链接引用的新节点一定是完整的
+    const int n_trees = meta_->n_trees;
+    std::vector<int> roots(meta_->roots, meta_->roots + n_trees);
+    std::vector<std::vector<PendingLink>> links(n_trees);
+    const int n_threads = options_.build_threads > 0 ? options_.build_threads : omp_get_max_threads();
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 1)
+    for (int t = 0; t < n_trees; t++) {
+      LinkOverlay overlay;
+      for (int item = begin; item < end; item++) {
+        merge_item(t, item, roots[t], overlay, links[t]);
+      }
+    }
+    storage_->barrier();
+
+    // 持有 merge_mutex_ 时快照只由合并替换
+    Snapshot* current = snapshot_.load(std::memory_order_acquire);
+    // item 表放得下时就地插入(单个写者, 与查询并发), 否则在副本上扩容, 随新快照一起发布
+    std::shared_ptr<ExactTable> items = current->items;
+    if (!items->has_room(end - begin)) {
+      items = std::make_shared<ExactTable>(*items);
+      items->reserve(end - begin);
+    }
+    for (int item = begin; item < end; item++) {
+      items->insert_if_absent(XXH3_64bits_withSeed(node_vec(record_of(item)), sizeof(float) * f_, seed), item);
+    }
+    {
+      // 提升也读取 pmem 中的链接并改写内存树的出口, 两者互斥
+      std::lock_guard<std::mutex> lock(promote_mutex_);
+      for (int t = 0; t < n_trees; t++) {
+        for (const PendingLink& l : links[t]) {
+          if (l.parent >= 0) {
+            int* link = l.right ? &node_at(l.parent)->right : &node_at(l.parent)->left;
+            __atomic_store_n(link, l.split, __ATOMIC_RELEASE);
+            storage_->persist(link, sizeof(int));
+          }
+          relink_dram(*current, t, l);
+        }
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(insert_mutex_);
+      storage_->commit([&](IndexMeta& meta) {
+        for (int t = 0; t < n_trees; t++) {
+          meta.roots[t] = roots[t];
+        }
+        meta.merged_items = end;
+      });
+    }
+    image_stale_ = options_.persist_mem_image;
+    // 结果缓存不受影响: 条目的 watermark 记录了它比较过的 item, 刚合并的 item 在命中时从存储中读出比较(见 lookup_hash)
+
+    std::unique_ptr<Snapshot> snapshot = new_snapshot();
+    share_memory_index(*snapshot, *current, std::move(items));
+    publish_snapshot(std::move(snapshot));
+    return end - begin;
+  }
+
+  // 合并时待改写的链接: parent 的右(right 为 true)或左子树从叶子 leaf 换成分裂它的新节点 split;
+  // parent 为 -1 时 leaf 是根, 新的根由提交写入
+  struct PendingLink {
+    int item;
+    int parent;
+    bool right;
+    int leaf;
+    int split;
+  };
+  // 本次合并中尚未写入的链接, 键为 parent * 2 + right, 值为新的子节点
+  typedef ska::bytell_hash_map<long long, int> LinkOverlay;
+
+  // 把 item 合并进第 t 棵树: 沿 pmem 中的树(叠加 overlay 中尚未写入的链接)下降到它落入的叶子,
+  // 用预留给它的内部节点以两者的垂直平分面把这个叶子分裂为原来的叶子和它自己。新节点在这里写好并持久化,
+  // 父节点中的链接记入 links, 由调用者在新节点全部落盘之后原子地改写, 同时下降的查询看到的要么是原来的叶子, 要么是完整的新节点;
+  // 根是叶子时改写 root, 由调用者提交。下降到达它自己的记录说明上次合并在提交之前中断而它已经合并过了
+  void merge_item(int t, int item, int& root, LinkOverlay& overlay, std::vector<PendingLink>& links) {
+    const int record = record_of(item);
+    const int split = record + 1 + t;
+    const float* v = node_vec(record);
+    int parent = -1;
+    bool right = false;
+    bool passed_split = false;
+    int node = root;
+    while (node_at(node)->left != -1) {
+      passed_split |= node == split;
+      right = node_margin(node, v) > 0;
+      parent = node;
+      auto it = overlay.find((long long)node * 2 + right);
+      if (it != overlay.end()) {
+        node = it->second;
+      } else {
+        node = right ? node_at(node)->right : node_at(node)->left;
+      }
+    }
+    if (node == record) {
+      return;
+    }
+    if (passed_split) {
+      // 预留的节点已经在树中却不能把 item 引到它自己的记录, 说明节点内容与链接不一致, 不再重复合并
+      log("Tree %d: split node %d of item %d is inconsistent, item skipped\n", t, split, item);
+      return;
+    }
+
+    // item 在右侧, 原来的叶子在左侧; 向量相同时没有分隔面, 退化为零向量并把 item 放在 margin 为 0 时走的左侧,
+    // 查询到达其中任何一个距离都相同, search_topk 中两侧的优先级也相同
+    float* w = node_vec(split);
+    float alpha;
+    const bool separable = Distance::bisector(v, node_vec(node), f_, w, alpha);
+    if (!separable) {
+      memset(w, 0, sizeof(float) * f_);
+      alpha = 0;
+    }
+    Node* nd = node_at(split);
+    nd->alpha = alpha;
+    nd->left = separable ? node : record;
+    nd->right = separable ? record : node;
+    nd->pad = 0;
+    storage_->persist(w, sizeof(float) * record_stride_);
+
+    if (parent < 0) {
+      root = split;
+    } else {
+      overlay[(long long)parent * 2 + right] = split;
+    }
+    links.push_back({item, parent, right, node, split});
+  }
+
+  // 合并把叶子 l.leaf 分裂为 l.split 之后, 同步快照中仍然引用这个叶子的 DRAM 链接, 调用者持有 promote_mutex_。
+  // 沿 item 的向量在内存树和热点子树副本中下降, margin 按 pmem 中的原节点计算, 路径与 merge_item 在 pmem 中的相同:
+  // 指向这个叶子的出口原子地改为 split; 到达叶子的副本时把它的 right 设为 split (见 leaf_exit);
+  // 路径上的副本已经转到 pmem 时, 叶子的父节点只在 pmem 中, 由调用者改写
+  void relink_dram(Snapshot& s, int t, const PendingLink& l) {
+    const float* v = node_vec(record_of(l.item));
+    MemNode* nd = s.mem_node(s.memnode_roots[t]);
+    for (int level = 1; nd->left != -1; level++) {
+      int* link = node_margin(nd->origin, v) > 0 ? &nd->right : &nd->left;
+      if (level < s.mem_tree_level) {
+        nd = s.mem_node(*link);
+        continue;
+      }
+      // 内存树的出口: 未提升时是 pmem node id, 已提升时在副本中继续下降, 副本最后一层的子节点也是 pmem node id
+      if (!is_hot_link(*link)) {
+        if (*link == l.leaf) {
+          __atomic_store_n(link, l.split, __ATOMIC_RELEASE);
+        }
+        return;
+      }
+      nd = s.hot_node(hot_index(*link));
+      for (int hot_level = 1; nd->left != -1; hot_level++) {
+        int* hot_link = node_margin(nd->origin, v) > 0 ? &nd->right : &nd->left;
+        if (hot_level == HOT_SUBTREE_LEVELS) {
+          if (*hot_link == l.leaf) {
+            __atomic_store_n(hot_link, l.split, __ATOMIC_RELEASE);
+          }
+          return;
+        }
+        nd = s.hot_node(*hot_link);
+      }
+      break;
+    }
+    if (nd->origin == l.leaf && nd->right == -1) {
+      __atomic_store_n(&nd->right, l.split, __ATOMIC_RELEASE);
+    }
+  }
+
+  // 启动后台合并线程, 由 request_merge 唤醒
+  void start_merger() {
+    if (options_.delta_merge_threshold == 0) {
+      return;
+    }
+    merger_stop_ = false;
+    merger_ = std::thread([this] {
+      std::unique_lock<std::mutex> lock(merger_mutex_);
+      while (true) {
+        merger_cv_.wait(lock, [this] { return merger_stop_ || merge_requested_; });
+        if (merger_stop_) {
+          break;
+        }
+        merge_requested_ = false;
+        lock.unlock();
+        merge_delta();
+        lock.lock();
+      }
+    });
+  }
+
+  void request_merge() {
+    {
+      std::lock_guard<std::mutex> lock(merger_mutex_);
+      merge_requested_ = true;
+    }
+    merger_cv_.notify_one();
+  }
+
+  void stop_merger() {
+    if (merger_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(merger_mutex_);
+        merger_stop_ = true;
+      }
+      merger_cv_.notify_all();
+      merger_.join();
+    }
+  }
+
+  // 建树之后的记录布局: 建树时的 item 仍是记录 [0, built_items), 之后插入的第 u 个 item 占用从 built_nodes + u * step 开始的
+  // step = n_trees + 1 条记录, 第一条是它自己(叶子), 第 1 + t 条预留给合并时在第 t 棵树中分裂叶子的内部节点
+  void init_record_layout() {
+    built_items_ = meta_->built_items;
+    built_nodes_ = meta_->built_nodes;
+    record_step_ = meta_->n_trees + 1;
+  }
+
+  int record_of(int item) const {
+    return item < built_items_ ? item : built_nodes_ + (item - built_items_) * record_step_;
+  }
+
+  int item_of(int record) const {
+    return record < built_items_ ? record : built_items_ + (record - built_nodes_) / record_step_;
+  }
+
   bool build_index() override {
-    if (proot->tree->built) {
+    if (meta_->built) {
       log("You can't build a built index\n");
       return false;
     }
-    if (proot->tree->n_items == 0){
+    if (meta_->n_items == 0){
       log("Tree is empty\n");
       return false;
     }
 
-    n_nodes_ = proot->tree->n_items;
-    node_cur_num = proot->node_total;
+    const int n_trees = std::max(1, std::min(options_.n_trees, MAX_TREES));
+    n_items_ = meta_->n_items;
+    node_cur_num = meta_->node_total;
 
-    std::vector<int> indices;
-    for (int i = 0; i < proot->tree->n_items; i++) {
-      indices.push_back(i);
+    // 每棵树恰好有 n_items - 1 个内部节点, 预先为每棵树划出独立的 node id 区间,
+    // 这样各棵树可以在不同的线程上同时建立
+    const int n_internal = n_items_ - 1;
+    if (n_items_ + (long long)n_trees * n_internal > MAX_NODES) {
+      log("Too many nodes for %d trees of %d items\n", n_trees, n_items_);
+      return false;
     }
-    transaction::run(pop, [&] {
-      proot->tree->root = make_tree(indices);
-      proot->tree->built = true;
+    n_nodes_ = n_items_ + n_trees * n_internal;
+    if (!ensure_capacity(n_nodes_)) {
+      log("Failed to allocate %d nodes\n", n_nodes_);
+      return false;
+    }
+    reserve_nodes(n_nodes_);
+
+    // 每棵树作为一个任务, 树内较大的子树再继续拆成任务, 由 OpenMP 的任务调度在线程间均衡
+    // 整个建树过程只使用这一块 index 数组, 每棵树占其中一段, 子树在各自的区间内原地划分
+    std::vector<int> roots(n_trees);
+    std::vector<int> indices((size_t)n_trees * n_items_);
+    const int n_threads = options_.build_threads > 0 ? options_.build_threads : omp_get_max_threads();
+#pragma omp parallel num_threads(n_threads)
+#pragma omp single
+    for (int t = 0; t < n_trees; t++) {
+#pragma omp task firstprivate(t) shared(roots, indices)
+      {
+        int* tree_indices = indices.data() + (size_t)t * n_items_;
+        for (int i = 0; i < n_items_; i++) {
+          tree_indices[i] = i;
+        }
+        roots[t] = make_tree(tree_indices, n_items_, TREE_SEED + t, n_items_ + t * n_internal);
+      }
+    }
+
+    persist_nodes(n_items_, n_nodes_);
+    storage_->commit([&](IndexMeta& meta) {
+      meta.n_trees = n_trees;
+      for (int t = 0; t < n_trees; t++) {
+        meta.roots[t] = roots[t];
+      }
+      meta.built_items = n_items_;
+      meta.built_nodes = n_nodes_;
+      meta.merged_items = n_items_;
+      meta.built = true;
+      meta.generation = meta.generation + 1;
     });
+    init_record_layout();
+    // 重建后旧的查询结果全部作废
+    result_cache_.set_generation(meta_->generation);
     // log("num of total nodes = %ld\n", n_nodes_);
 
-    if (proot->tree->built) {
-      build_tree_index_in_memory_and_relable_memnode();
-      build_hash_in_memory();
-    }
+    // 内存树和 item 表在新快照中建好之后才发布, 查询在此之前返回 -1
+    std::unique_ptr<Snapshot> snapshot = new_snapshot();
+    build_in_memory_index(*snapshot);
+    publish_snapshot(std::move(snapshot));
 
     return true;
   }
   
-  void build_hash_in_memory() {
-    // uint32_t leaf_num = (proot->tree->n_items + 1) / 2;
-    uint32_t leaf_num = proot->tree->n_items;
-    for (uint32_t i = 0; i < leaf_num; i++) {
-      Node* n = get(i);
-      // uint64_t result = XXHash64::hash(n->v.get(), sizeof(float) * f_, myseed);
-      XXH64_hash_t result = XXH3_64bits_withSeed(n->v.get(), sizeof(float) * f_, seed);
-      auto it = hashret_item_map.find(result);
-      if (it == hashret_item_map.end()) {
-        hashret_item_map.insert({result, i});
-      }
+  // 打开已建好的索引: 优先从 pool 中的镜像恢复内存树和 item 表, 镜像不存在或校验失败时重新构建
+  void load_in_memory_index() {
+    std::unique_ptr<Snapshot> snapshot = new_snapshot();
+    if (!load_mem_image(*snapshot)) {
+      build_in_memory_index(*snapshot);
+    }
+    publish_snapshot(std::move(snapshot));
+  }
+
+  // 从 pmem 中的树和 item 构建快照的内存树和 item 表, 并写出镜像
+  void build_in_memory_index(Snapshot& snapshot) {
+    build_tree_index_in_memory_and_relable_memnode(snapshot);
+    build_hash_in_memory(snapshot);
+    if (options_.persist_mem_image) {
+      save_mem_image(snapshot);
+    }
+  }
+
+  // 把当前快照的内存树和 item 表写成持久化的镜像。合并只就地更新 DRAM 中的结构, 镜像在这里或关闭时才重新写出
+  bool save_mem_image() {
+    std::lock_guard<std::mutex> merge_lock(merge_mutex_);
+    std::lock_guard<std::mutex> lock(promote_mutex_);
+    const Snapshot* s = snapshot_.load(std::memory_order_acquire);
+    if (s == nullptr || !options_.persist_mem_image) {
+      return false;
+    }
+    save_mem_image(*s);
+    image_stale_ = false;
+    return true;
+  }
+
+  // 重新读取持久化的镜像并发布为新的快照, 正在进行的查询继续使用旧快照
+  bool load_mem_image() {
+    std::lock_guard<std::mutex> merge_lock(merge_mutex_);
+    std::unique_ptr<Snapshot> snapshot = new_snapshot();
+    if (!load_mem_image(*snapshot)) {
+      return false;
     }
+    publish_snapshot(std::move(snapshot));
+    return true;
+  }
+
+  // 先并行计算树中所有 item 的 hash, 再由 ExactTable::build 按 hash 的高位分 shard 并发建表
+  // 相同的向量保留 id 最小的, 结果与线程数无关
+  void build_hash_in_memory(Snapshot& snapshot) {
+    // uint32_t leaf_num = (meta_->n_items + 1) / 2;
+    const long leaf_num = snapshot.merged_items;
+    std::vector<uint64_t> hashes(leaf_num);
+    const int n_threads = options_.build_threads > 0 ? options_.build_threads : omp_get_max_threads();
+#pragma omp parallel for num_threads(n_threads) schedule(static)
+    for (long i = 0; i < leaf_num; i++) {
+      // uint64_t result = XXHash64::hash(node_vec(i), sizeof(float) * f_, myseed);
+      hashes[i] = XXH3_64bits_withSeed(node_vec(record_of(i)), sizeof(float) * f_, seed);
+    }
+    snapshot.items->build(hashes.data(), leaf_num, n_threads);
     std::cout << "build_hash_in_memory..." << std::endl;
   }
 
-  int build_tree_index_in_memory_and_relable_memnode() {
-    if (!proot->tree->built) {
+  // 把快照的内存树和 item 表写成持久化的镜像, 旧的镜像被替换。热点子树缓存不写入镜像, 已提升的出口换回 pmem node id;
+  // 调用者保证期间没有提升和合并改写快照
+  void save_mem_image(const Snapshot& snapshot) {
+    const ExactTable& items = *snapshot.items;
+    const size_t slab_bytes = (size_t)snapshot.n_memnodes * memnode_stride_;
+    const size_t table_bytes = items.capacity() * sizeof(ExactTable::Entry);
+    const size_t total = MEM_IMAGE_BODY + slab_bytes + table_bytes;
+    char* image = storage_->reset_mem_image(total);
+    char* slab = image + MEM_IMAGE_BODY;
+    memcpy(slab, snapshot.memnode_slab.get(), slab_bytes);
+    for (uint32_t i = 0; i < snapshot.n_memnodes; i++) {
+      MemNode* mem_nd = reinterpret_cast<MemNode*>(slab + (size_t)i * memnode_stride_);
+      mem_nd->left = pmem_link(snapshot, mem_nd->left);
+      mem_nd->right = pmem_link(snapshot, mem_nd->right);
+    }
+    storage_->persist(slab, slab_bytes);
+    storage_->memcpy_persist(slab + slab_bytes, items.data(), table_bytes);
+
+    // 头部最后写入, 写到一半时崩溃会因为 magic 或 checksum 不对而被丢弃
+    MemImageHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = MEM_IMAGE_MAGIC;
+    h.version = MEM_IMAGE_VERSION;
+    h.f = f_;
+    h.generation = meta_->generation;
+    h.merged_items = snapshot.merged_items;
+    h.quantized = options_.quantize_mem_tree;
+    h.mem_tree_level = snapshot.mem_tree_level;
+    h.mem_tree_level_cap = mem_tree_level_cap(snapshot.n_trees);
+    h.mem_tree_budget = options_.mem_tree_budget;
+    h.stride = memnode_stride_;
+    h.n_memnodes = snapshot.n_memnodes;
+    h.n_trees = snapshot.n_trees;
+    for (int t = 0; t < snapshot.n_trees; t++) {
+      h.memnode_roots[t] = snapshot.memnode_roots[t];
+    }
+    h.table_capacity = items.capacity();
+    h.table_size = items.size();
+    h.table_shard_bits = items.shard_bits();
+    h.checksum = mem_image_checksum(h, slab, slab_bytes, slab + slab_bytes, table_bytes);
+    storage_->memcpy_persist(image, &h, sizeof(h));
+    storage_->release(image, total);
+    std::cout << "save_mem_image..." << total / (1024 * 1024) << " MB" << std::endl;
+  }
+
+  // 从持久化的镜像恢复快照的内存树和 item 表; 镜像与当前的索引或选项不符, 或者校验失败时返回 false
+  bool load_mem_image(Snapshot& snapshot) {
+    if (!options_.persist_mem_image) {
+      return false;
+    }
+    size_t image_size;
+    const char* image = storage_->mem_image(image_size);
+    if (image == nullptr) {
+      return false;
+    }
+    MemImageHeader h;
+    memcpy(&h, image, sizeof(h));
+    const int n_trees = meta_->n_trees;
+    if (h.magic != MEM_IMAGE_MAGIC || h.version != MEM_IMAGE_VERSION || h.f != (uint32_t)f_ ||
+        h.generation != meta_->generation || h.merged_items != meta_->merged_items || h.quantized != (uint32_t)options_.quantize_mem_tree ||
+        h.stride != memnode_stride_ || h.mem_tree_level_cap != mem_tree_level_cap(n_trees) ||
+        h.mem_tree_budget != options_.mem_tree_budget ||
+        h.mem_tree_level < 1 || h.mem_tree_level > h.mem_tree_level_cap ||
+        h.n_trees != n_trees || h.n_memnodes < (uint64_t)n_trees || h.n_memnodes > (uint64_t)n_trees * 2 * meta_->n_items ||
+        h.table_capacity == 0 || (h.table_capacity & (h.table_capacity - 1)) != 0 ||
+        h.table_shard_bits < 0 || h.table_shard_bits > ExactTable::MAX_SHARD_BITS ||
+        (h.table_capacity >> h.table_shard_bits) == 0) {
+      std::cout << "load_mem_image...mismatch, rebuild" << std::endl;
+      return false;
+    }
+    const size_t slab_bytes = h.n_memnodes * h.stride;
+    const size_t table_bytes = h.table_capacity * sizeof(ExactTable::Entry);
+    if (MEM_IMAGE_BODY + slab_bytes + table_bytes != image_size) {
+      std::cout << "load_mem_image...bad size, rebuild" << std::endl;
+      return false;
+    }
+
+    // 多个线程各自顺序读取一大段, 充分利用 pmem 的读带宽; 校验在 DRAM 中的拷贝上进行
+    alloc_memnode_slab(snapshot, h.n_memnodes);
+    const char* body = image + MEM_IMAGE_BODY;
+    const size_t chunk = 64 << 20;
+    const long n_chunks = (slab_bytes + chunk - 1) / chunk;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (long c = 0; c < n_chunks; c++) {
+      const size_t begin = c * chunk;
+      memcpy(snapshot.memnode_slab.get() + begin, body + begin, std::min(chunk, slab_bytes - begin));
+    }
+    snapshot.items->load(reinterpret_cast<const ExactTable::Entry*>(body + slab_bytes), h.table_capacity, h.table_shard_bits, h.table_size);
+    storage_->release(image, image_size);
+
+    if (mem_image_checksum(h, snapshot.memnode_slab.get(), slab_bytes, snapshot.items->data(), table_bytes) != h.checksum) {
+      std::cout << "load_mem_image...checksum mismatch, rebuild" << std::endl;
+      snapshot.items->reset(0);
+      return false;
+    }
+
+    snapshot.mem_tree_level = h.mem_tree_level;
+    snapshot.n_memnodes = h.n_memnodes;
+    snapshot.memnode_roots.assign(h.memnode_roots, h.memnode_roots + n_trees);
+    std::cout << "load_mem_image..." << h.n_memnodes << " mem nodes, " << h.table_size << " items" << std::endl;
+    return true;
+  }
+
+  static uint64_t mem_image_checksum(MemImageHeader h, const void* slab, size_t slab_bytes, const void* table, size_t table_bytes) {
+    h.checksum = 0;
+    XXH3_state_t state;
+    XXH3_64bits_reset_withSeed(&state, XXH3_64bits(&h, sizeof(h)));
+    XXH3_64bits_update(&state, slab, slab_bytes);
+    XXH3_64bits_update(&state, table, table_bytes);
+    return XXH3_64bits_digest(&state);
+  }
+
+  // n_trees 棵树时内存树缓存的层数上限: 多棵树平分内存中的节点空间, 每棵树缓存的层数相应减少
+  int mem_tree_level_cap(int n_trees) const {
+    int shift = 0;
+    while ((1 << shift) < n_trees) {
+      shift++;
+    }
+    int level = LEVEL - shift;
+    if (options_.mem_tree_levels > 0) {
+      level = std::min(level, options_.mem_tree_levels);
+    }
+    return level;
+  }
+
+  int build_tree_index_in_memory_and_relable_memnode(Snapshot& snapshot) {
+    if (!meta_->built) {
       return 0;
     }
 
-    int node = proot->tree->root;
+    size_t n_memnodes;
+    snapshot.mem_tree_level = choose_mem_tree_level(snapshot.n_trees, n_memnodes);
+    alloc_memnode_slab(snapshot, n_memnodes);
+
+    int level = 0;
+    snapshot.memnode_roots.clear();
+    for (int t = 0; t < snapshot.n_trees; t++) {
+      snapshot.memnode_roots.push_back(snapshot.n_memnodes);
+      level = copy_tree_to_memory(snapshot, meta_->roots[t]);
+    }
+    std::cout << "build_tree_index_in_memory_and_relable_memnode...level is " << level << std::endl;
+    return level;
+  }
+
+  // 按 mem_tree_budget 选择内存树的层数: 所有树一起逐层向下统计节点数,
+  // 取前 L 层总大小不超过预算的最大 L, 不超过 mem_tree_level_cap, 且至少为 1 (只缓存根节点);
+  // 树比上限浅时停在最深的一层。n_memnodes 为前 L 层的节点总数, 与 copy_tree_to_memory 拷贝的节点数相同
+  int choose_mem_tree_level(int n_trees, size_t& n_memnodes) const {
+    const int cap = mem_tree_level_cap(n_trees);
+    const size_t budget_nodes = options_.mem_tree_budget > 0 ? options_.mem_tree_budget / memnode_stride_ : SIZE_MAX;
+    std::vector<int> level_nodes(meta_->roots, meta_->roots + n_trees);
+    std::vector<int> next;
+    n_memnodes = level_nodes.size();
+    int level = 1;
+    while (level < cap) {
+      next.clear();
+      for (int node : level_nodes) {
+        const Node* nd = get(node);
+        if (nd->left != -1) {
+          next.push_back(nd->left);
+        }
+        if (nd->right != -1) {
+          next.push_back(nd->right);
+        }
+      }
+      if (next.empty() || n_memnodes + next.size() > budget_nodes) {
+        break;
+      }
+      n_memnodes += next.size();
+      level_nodes.swap(next);
+      level++;
+    }
+    std::cout << "choose_mem_tree_level..." << level << " levels, " << n_memnodes << " mem nodes, "
+              << n_memnodes * memnode_stride_ / (1024 * 1024) << " MB" << std::endl;
+    return level;
+  }
+
+  // 为尚未发布的快照分配放得下 n 个 MemNode 的内存树
+  void alloc_memnode_slab(Snapshot& snapshot, size_t n) {
+    // 上层节点集中在 slab 的开头, 使用大页减少 TLB miss
+    const size_t slab_size = std::max<size_t>(n, 1) * memnode_stride_;
+    snapshot.memnode_slab.reset((char*)aligned_alloc(64, slab_size), free);
+    madvise(snapshot.memnode_slab.get(), slab_size, MADV_HUGEPAGE);
+    snapshot.n_memnodes = 0;
+  }
+
+  // 按BFS顺序把以 node 为根的树的前 mem_tree_level 层拷贝到快照的内存树末尾, 并重新编号
+  int copy_tree_to_memory(Snapshot& snapshot, int node) {
     Node* nd = get(node);
 
-    uint32_t cur_loc = 0;
-    MemNode* mem_nd = get_mem_node(cur_loc);
+    uint32_t cur_loc = snapshot.n_memnodes;
+    MemNode* mem_nd = snapshot.mem_node(cur_loc);
     // node_arrayidx_hash_map[node] = cur_loc;
     cur_loc++;
 
-    memnode_root = 0;
-    memcpy(mem_nd->v, nd->v.get(), sizeof(float) * f_);
     mem_nd->origin = node;
-    mem_nd->left = nd->left;
-    mem_nd->right = nd->right;
-    mem_nd->alpha = nd->alpha;
+    fill_mem_node(mem_nd, node);
     
     std::queue <MemNode*> q;
     q.push(mem_nd);
 
     int currentLevel = 1;
-    while (!q.empty() && currentLevel < mem_tree_level_) {
+    while (!q.empty() && currentLevel < snapshot.mem_tree_level) {
       int currentLevelSize = q.size();
       for (int i = 0; i < currentLevelSize; ++i) {
         auto node = q.front();
@@ -254,115 +977,988 @@ class VectorIndex : public VectorIndexInterface {
         if (node->left != -1) {
           nd = get(node->left);
 
-          mem_nd = get_mem_node(cur_loc);
+          mem_nd = snapshot.mem_node(cur_loc);
           // node_arrayidx_hash_map[node->left] = cur_loc;
           mem_nd->origin = node->left;  // save origin pmem_node id
           node->left = cur_loc;
           cur_loc++;
 
-          memcpy(mem_nd->v, nd->v.get(), sizeof(float) * f_);
-          mem_nd->left = nd->left;
-          mem_nd->right = nd->right;
-          mem_nd->alpha = nd->alpha;
+          fill_mem_node(mem_nd, mem_nd->origin);
           q.push(mem_nd);
         }
         if (node->right != -1) {
           nd = get(node->right);
 
-          mem_nd = get_mem_node(cur_loc);
+          mem_nd = snapshot.mem_node(cur_loc);
           // node_arrayidx_hash_map[node->right] = cur_loc;
           mem_nd->origin = node->right;  // save origin pmem_node id
           node->right = cur_loc;
           cur_loc++;
 
-          memcpy(mem_nd->v, nd->v.get(), sizeof(float) * f_);
-          mem_nd->left = nd->left;
-          mem_nd->right = nd->right;
-          mem_nd->alpha = nd->alpha;
+          fill_mem_node(mem_nd, mem_nd->origin);
           q.push(mem_nd);
         }
       }
       currentLevel++;
     }
-    std::cout << "build_tree_index_in_memory_and_relable_memnode...level is " << currentLevel << std::endl;
+    snapshot.n_memnodes = cur_loc;
     return currentLevel;
   }
 
+  // 拷贝 pmem 节点的 hyperplane 和子节点, 量化模式下同时计算 int8 编码
+  void fill_mem_node(MemNode* mem_nd, int node) {
+    const Node* nd = get(node);
+    mem_nd->left = nd->left;
+    mem_nd->right = nd->right;
+    mem_nd->alpha = nd->alpha;
+    if (options_.quantize_mem_tree) {
+      int8_t* qv = mem_nd->qv();
+      mem_nd->scale = quantize(node_vec(node), f_, fq_, qv);
+      int l1 = 0;
+      for (int z = 0; z < f_; z++) {
+        l1 += std::abs((int)qv[z]);
+      }
+      mem_nd->l1 = mem_nd->scale * l1;
+    } else {
+      mem_nd->scale = 0;
+      mem_nd->l1 = 0;
+      memcpy(mem_nd->v(), node_vec(node), sizeof(float) * f_);
+    }
+  }
+
+  // 查询期间固定使用进入时的快照, 不会等待或看到正在进行的建树; 还没有快照时返回 -1
   int search_top1(const float* target) override {
+    EpochGuard guard;
+    const Snapshot* snapshot = snapshot_.load(std::memory_order_acquire);
+    if (snapshot == nullptr) {
+      return -1;
+    }
+    const Snapshot& s = *snapshot;
+
     /*************** search in hash ***************/
     // uint64_t result = XXHash64::hash(target, sizeof(float) * f_, myseed);
     XXH64_hash_t result = XXH3_64bits_withSeed(target, sizeof(float) * f_, seed);
-    auto it = hashret_item_map.find(result);
-    if (it != hashret_item_map.end()) {
+    int cached;
+    if (lookup_hash(s, result, target, cached)) {
       // go_hash++;
-      return it->second;
+      return cached;
     }
 
-    /********* search in mem tree index *********/
+    /************** search in trees **************/
     // go_tree++;
-    int node = memnode_root;
+    QuantQuery qq;
+    const QuantQuery* qtarget = nullptr;
+    if (options_.quantize_mem_tree) {
+      quantize_query(target, f_, fq_, (int8_t*)alloc_stack(fq_), qq);
+      qtarget = &qq;
+    }
+    int node;
+    if (s.n_trees == 1) {
+      node = descend(s, 0, target, qtarget);
+    } else {
+      // 每棵树给出一个候选叶子, 按真实距离选出最近的一个
+      int* candidates = (int*)alloc_stack(sizeof(int) * s.n_trees);
+      for (int t = 0; t < s.n_trees; t++) {
+        candidates[t] = descend(s, t, target, qtarget);
+      }
+      node = nearest_candidate(candidates, s.n_trees, target);
+    }
+    int watermark;
+    node = nearest_delta(s, target, item_of(node), watermark);
+
+    /************** add to cache **************/
+    result_cache_.insert(result, node, watermark);
+    return node;
+  }
+
+  // 使用存储中的区域作为结果缓存, 第一次使用时按 result_cache_capacity 分配
+  void attach_result_cache() {
+    uint64_t capacity = options_.result_cache_capacity;
+    char* space = storage_->cache_region(ResultCache::region_size(capacity) + 64, capacity);
+    if (space == nullptr) {
+      return;
+    }
+    // 区域在存储中的偏移不变, 对齐后的地址每次打开都相同
+    char* region = (char*)(((uintptr_t)space + 63) & ~(uintptr_t)63);
+    bool reused = result_cache_.attach(region, capacity, meta_->generation, persist_range, this);
+    std::cout << "attach_result_cache..." << (reused ? "reused " : "new ") << result_cache_.size()
+              << " entries, capacity " << result_cache_.capacity() << std::endl;
+  }
+
+  static void persist_range(void* ctx, const void* addr, size_t len) {
+    static_cast<VectorIndex*>(ctx)->storage_->persist(addr, len);
+  }
+
+  // 先查快照中的 item 表, 再查结果缓存;
+  // 缓存的结果只与 id 小于它的 watermark 的 item 比较过, 之后插入的 item (可能已经合并进树)逐个比较后返回最近的,
+  // 并以新的 watermark 写回。相差的 item 超过一个 delta 缓冲区时当作未命中, 重新搜索
+  bool lookup_hash(const Snapshot& s, XXH64_hash_t h, const float* target, int& item) {
+    if (s.items->find(h, item)) {
+      return true;
+    }
+    int watermark;
+    if (!result_cache_.find(h, item, watermark)) {
+      return false;
+    }
+    const DeltaBuffer& delta = *s.delta;
+    const size_t n = delta.size();
+    const int first = delta.first_item();
+    const int visible = first + (int)n;
+    if (watermark >= visible) {
+      return true;
+    }
+    if ((size_t)(visible - watermark) > delta.capacity()) {
+      return false;
+    }
+    float best_dist = Distance::distance(node_vec(record_of(item)), target, f_);
+    for (int i = watermark; i < first; i++) {
+      const float d = Distance::distance(node_vec(record_of(i)), target, f_);
+      if (d < best_dist) {
+        best_dist = d;
+        item = i;
+      }
+    }
+    const int d = delta.nearest(target, std::max(watermark - first, 0), n, best_dist);
+    if (d >= 0) {
+      item = d;
+    }
+    result_cache_.insert(h, item, visible);
+    return true;
+  }
+
+  // 树给出的 item 与 delta 缓冲区中尚未合并的 item 比较, 返回与 target 距离最近的, 距离相同时保留 item;
+  // watermark 为比较过的 item 数: 树中的加上读到的缓冲区大小
+  int nearest_delta(const Snapshot& s, const float* target, int item, int& watermark) const {
+    const size_t n = s.delta->size();
+    watermark = s.delta->first_item() + (int)n;
+    if (n == 0) {
+      return item;
+    }
+    float best_dist = Distance::distance(node_vec(record_of(item)), target, f_);
+    const int d = s.delta->nearest(target, 0, n, best_dist);
+    return d >= 0 ? d : item;
+  }
+
+  // 内存树节点的 margin; qtarget 不为空时先用 int8 近似,
+  // 近似值落在误差范围内(可能判错方向)时再用 pmem 中的 fp32 Node 计算
+  float mem_margin(const MemNode* mem_nd, const float* target, const QuantQuery* qtarget) const {
+    if (qtarget == nullptr) {
+      return dist_.margin_mem(mem_nd, target, f_);
+    }
+    float bound;
+    float margin = Distance::margin_mem_quant(mem_nd, *qtarget, f_, fq_, bound);
+    if (std::fabs(margin) <= bound) {
+      margin = node_margin(mem_nd->origin, target);
+    }
+    return margin;
+  }
+
+  // 在第 t 棵树中从根下降到叶子, 返回叶子的记录 id (见 item_of)
+  int descend(const Snapshot& s, int t, const float* target, const QuantQuery* qtarget = nullptr) const {
+    /********* search in mem tree index *********/
+    int node = s.memnode_roots[t];
     // MemNode* mem_nd = get_mem_node(node);
-    MemNode* mem_nd = memnode_array_space;
-    int currentLevel = 1;
-    float margin;
+    const MemNode* mem_nd = s.mem_node(node);
 
-    while (mem_nd->left != -1) {
-      margin = dist_.margin_mem(mem_nd, target, f_);
+    // 前 mem_tree_level - 1 层内部节点的子节点是 MemNode 下标, 发布之后不再改变
+    for (int currentLevel = 1; currentLevel < s.mem_tree_level; currentLevel++) {
+      if (mem_nd->left == -1) {
+        /*** 如果是target在内存索引树中，直接返回 ***/
+        return leaf_exit(s, mem_nd, target);
+      }
+      if (options_.prefetch_lines > 0) {
+        prefetch_mem_node(s, mem_nd->left, options_.prefetch_lines);
+        prefetch_mem_node(s, mem_nd->right, options_.prefetch_lines);
+      }
+      float margin = mem_margin(mem_nd, target, qtarget);
       if (margin <= 0) {
         node = mem_nd->left;
       } else {
         node = mem_nd->right;
       }
-      ++currentLevel;
-      if (currentLevel > mem_tree_level_) {
-        break;
-      }
       // mem_nd = get_mem_node(node);
-      mem_nd = memnode_array_space + node;
+      mem_nd = s.mem_node(node);
     }
 
-    /*** 如果是target在内存索引树中，加入hash ***/
-    if (currentLevel <= mem_tree_level_) {
-      std::lock_guard<std::mutex> latch(mutex_[0]);
-      hashret_item_map.insert({result, mem_nd->origin});
-      return mem_nd->origin;
+    // 最后一层的出口可能正被提升或合并原子地改写; 叶子的 left 一直是 -1
+    const int left = __atomic_load_n(&mem_nd->left, __ATOMIC_ACQUIRE);
+    if (left == -1) {
+      return leaf_exit(s, mem_nd, target);
+    }
+    if (options_.prefetch_lines > 0) {
+      prefetch_pmem_node(s, left, options_.prefetch_lines);
+      prefetch_pmem_node(s, __atomic_load_n(&mem_nd->right, __ATOMIC_ACQUIRE), options_.prefetch_lines);
     }
+    float margin = mem_margin(mem_nd, target, qtarget);
 
-    /******* search in pmem tree index *******/
+    /******* search in hot subtree / pmem tree index *******/
+    return descend_deep(s, mem_nd, margin > 0, target);
+  }
+
+  // 从内存树最后一层的 mem_nd 的出口(side 为 0 时是左子树)继续下降:
+  // 出口已被提升时在 DRAM 的副本中下降, 否则记录一次访问并在 pmem 中下降
+  int descend_deep(const Snapshot& s, const MemNode* mem_nd, int side, const float* target) const {
+    const int link = __atomic_load_n(side ? &mem_nd->right : &mem_nd->left, __ATOMIC_ACQUIRE);
+    if (is_hot_link(link)) {
+      return descend_hot(s, hot_index(link), target);
+    }
+    if (s.visits != nullptr && link >= s.n_items) {
+      record_visit(s, mem_nd, side);
+    }
+    return descend_pmem(s, link, target);
+  }
+
+  // 从热点子树副本中的第 i 个节点下降, 副本的最后一层之下回到 pmem;
+  // 副本是 pmem 节点的 fp32 拷贝, margin 与 node_margin 逐位相同
+  int descend_hot(const Snapshot& s, int i, const float* target) const {
+    const MemNode* nd = s.hot_node(i);
+    for (int level = 1; level < HOT_SUBTREE_LEVELS; level++) {
+      if (nd->left == -1) {
+        return leaf_exit(s, nd, target);
+      }
+      nd = s.hot_node(dist_.margin_mem(nd, target, f_) <= 0 ? nd->left : nd->right);
+    }
+    // 最后一层的子节点是 pmem node id, 合并可能正在原子地改写它们
+    const int left = __atomic_load_n(&nd->left, __ATOMIC_ACQUIRE);
+    if (left == -1) {
+      return leaf_exit(s, nd, target);
+    }
+    const int right = __atomic_load_n(&nd->right, __ATOMIC_ACQUIRE);
+    return descend_pmem(s, dist_.margin_mem(nd, target, f_) <= 0 ? left : right, target);
+  }
+
+  // 内存树或热点子树副本中的叶子: 合并分裂了这个叶子之后 right 是 pmem 中分裂它的节点, 从那里继续下降
+  int leaf_exit(const Snapshot& s, const MemNode* leaf, const float* target) const {
+    const int split = __atomic_load_n(&leaf->right, __ATOMIC_ACQUIRE);
+    return split == -1 ? leaf->origin : descend_pmem(s, split, target);
+  }
+
+  // 从 pmem 中的 node 开始下降到叶子
+  int descend_pmem(const Snapshot& s, int node, const float* target) const {
     // Node* nd = get(node);
-    Node* nd = node_array_start + node;
-    while (nd->left != -1) {
-      margin = dist_.margin(nd, target, f_);
+    const Node* nd = get(node);
+    // 链接可能正被 merge_item 换成新的内部节点, 以 acquire 读取, 与 release 写入配对
+    while (__atomic_load_n(&nd->left, __ATOMIC_ACQUIRE) != -1) {
+      if (options_.prefetch_lines > 0) {
+        prefetch_pmem_node(s, __atomic_load_n(&nd->left, __ATOMIC_ACQUIRE), options_.prefetch_lines);
+        prefetch_pmem_node(s, __atomic_load_n(&nd->right, __ATOMIC_ACQUIRE), options_.prefetch_lines);
+      }
+      float margin = node_margin(node, target);
       if (margin <= 0) {
-        node = nd->left;
+        node = __atomic_load_n(&nd->left, __ATOMIC_ACQUIRE);
       } else {
-        node = nd->right;
+        node = __atomic_load_n(&nd->right, __ATOMIC_ACQUIRE);
       }
-      // node为叶子节点，即可返回
-      if (node < n_nodes_) {
+      // node为叶子节点，即可返回; 合并进来的 item 的记录在后面, 由 left == -1 判断
+      if (node < s.n_items) {
         break;
       }
-      // nd = get(node);
-      nd = node_array_start + node;
+      nd = get(node);
     }
-
-    /************** add to hash **************/
-    std::lock_guard<std::mutex> latch(mutex_[1]);
-    hashret_item_map.insert({result, node});
     return node;
   }
 
+  void prefetch_mem_node(const Snapshot& s, int i, int lines) const {
+    const char* p = reinterpret_cast<const char*>(s.mem_node(i));
+    for (int l = 0; l < lines; l++) {
+      __builtin_prefetch(p + l * 64);
+    }
+  }
+
+  // pmem 节点记录的地址由 id 直接算出, 预取向量开头的 lines 个 cache line 以及记录末尾的 Node;
+  // item 是叶子, 下降到它时不再读取, 因此不预取
+  void prefetch_pmem_node(const Snapshot& s, int i, int lines) const {
+    if (i < s.n_items) {
+      return;
+    }
+    const char* p = reinterpret_cast<const char*>(node_vec(i));
+    for (int l = 0; l < lines; l++) {
+      __builtin_prefetch(p + l * 64);
+    }
+    __builtin_prefetch(get(i));
+  }
+
+  // 内存树出口中的热点子树链接: -2 - i 表示副本中的第 i 个节点, 与 -1 (没有子节点) 和 node id 都不冲突
+  static bool is_hot_link(int link) {
+    return link <= -2;
+  }
+
+  static int hot_index(int link) {
+    return -2 - link;
+  }
+
+  // 热点子树链接换回子树根的 pmem node id, 其它链接原样返回
+  static int pmem_link(const Snapshot& s, int link) {
+    return is_hot_link(link) ? s.hot_node(hot_index(link))->origin : link;
+  }
+
+  // 离开内存树时按采样记录出口的访问次数, 每个线程每 VISIT_SAMPLE 次记录一次
+  static void record_visit(const Snapshot& s, const MemNode* mem_nd, int side) {
+    static thread_local uint32_t tick = 0;
+    if ((++tick & (VISIT_SAMPLE - 1)) != 0) {
+      return;
+    }
+    const size_t i = (reinterpret_cast<const char*>(mem_nd) - s.memnode_slab.get()) / s.memnode_stride;
+    s.visits[2 * i + side].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // 把以 pmem 节点 node 为根的子树的前 HOT_SUBTREE_LEVELS 层按 BFS 顺序拷贝到热点子树缓存的末尾,
+  // 副本内的子节点改为副本中的下标, 最后一层的子节点仍是 pmem node id
+  // 返回副本中根的下标, 缓存放不下时返回 -1
+  int copy_hot_subtree(Snapshot& s, int node) {
+    std::vector<int> level_nodes{node}, next;
+    size_t total = 1;
+    for (int level = 1; level < HOT_SUBTREE_LEVELS; level++) {
+      next.clear();
+      for (int n : level_nodes) {
+        const Node* nd = get(n);
+        if (nd->left != -1) {
+          next.push_back(nd->left);
+        }
+        if (nd->right != -1) {
+          next.push_back(nd->right);
+        }
+      }
+      total += next.size();
+      level_nodes.swap(next);
+    }
+    if (s.hot_count + total > s.hot_capacity) {
+      return -1;
+    }
+
+    const size_t root = s.hot_count;
+    size_t tail = root;
+    fill_hot_node(s, tail++, node);
+    size_t i = root;
+    for (int level = 1; level < HOT_SUBTREE_LEVELS; level++) {
+      const size_t level_end = tail;
+      for (; i < level_end; i++) {
+        MemNode* h = s.hot_node(i);
+        if (h->left != -1) {
+          fill_hot_node(s, tail, h->left);
+          h->left = tail++;
+        }
+        if (h->right != -1) {
+          fill_hot_node(s, tail, h->right);
+          h->right = tail++;
+        }
+      }
+    }
+    s.hot_count = tail;
+    return root;
+  }
+
+  void fill_hot_node(Snapshot& s, size_t i, int node) {
+    MemNode* h = s.hot_node(i);
+    const Node* nd = get(node);
+    h->origin = node;
+    h->left = nd->left;
+    h->right = nd->right;
+    h->alpha = nd->alpha;
+    h->scale = 0;
+    h->l1 = 0;
+    memcpy(h->v(), node_vec(node), sizeof(float) * f_);
+  }
+
+  // 为尚未发布的快照分配热点子树缓存和访问计数; 副本属于快照, 随快照一起释放
+  void init_hot_cache(Snapshot& s) const {
+    if (options_.hot_cache_budget == 0 || s.n_memnodes == 0) {
+      return;
+    }
+    s.hot_stride = hot_stride_;
+    s.hot_capacity = options_.hot_cache_budget / hot_stride_;
+    s.hot_count = 0;
+    s.hot_slab.reset((char*)aligned_alloc(64, std::max<size_t>(s.hot_capacity, 1) * hot_stride_), free);
+    const size_t n_exits = 2 * (size_t)s.n_memnodes;
+    s.visits.reset(new std::atomic<uint32_t>[n_exits]);
+    for (size_t e = 0; e < n_exits; e++) {
+      s.visits[e].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // 启动后台提升线程, 每轮对当时发布的快照调用 promote_hot_subtrees
+  void start_promoter() {
+    if (options_.hot_cache_budget == 0 || options_.hot_promote_interval_ms <= 0) {
+      return;
+    }
+    promoter_stop_ = false;
+    promoter_ = std::thread([this] {
+      std::unique_lock<std::mutex> lock(promoter_mutex_);
+      while (!promoter_cv_.wait_for(lock, std::chrono::milliseconds(options_.hot_promote_interval_ms),
+                                    [this] { return promoter_stop_; })) {
+        lock.unlock();
+        promote_hot_subtrees();
+        lock.lock();
+      }
+    });
+  }
+
+  void stop_promoter() {
+    if (promoter_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(promoter_mutex_);
+        promoter_stop_ = true;
+      }
+      promoter_cv_.notify_all();
+      promoter_.join();
+    }
+  }
+
+  // 建好的快照的读取部分不再修改, 还没有热点子树缓存时为它分配, 之后原子地替换当前快照;
+  // 替换与插入和 promote_hot_subtrees 互斥, 插入和提升只写当前快照。旧快照交给 epoch 回收,
+  // 进入查询时拿到它的线程全部离开之后才释放, 查询从不等待
+  void publish_snapshot(std::unique_ptr<Snapshot> next) {
+    if (next->hot_slab == nullptr) {
+      init_hot_cache(*next);
+    }
+    Snapshot* old;
+    {
+      std::lock_guard<std::mutex> insert_lock(insert_mutex_);
+      next->delta = delta_for(next->merged_items);
+      std::lock_guard<std::mutex> lock(promote_mutex_);
+      const Snapshot* current = snapshot_.load(std::memory_order_relaxed);
+      if (current != nullptr && next->hot_slab != nullptr && next->hot_slab == current->hot_slab) {
+        // 共用热点子树缓存时接着当前快照已经追加的副本
+        next->hot_count = current->hot_count;
+      }
+      next->version = ++snapshot_version_;
+      old = snapshot_.exchange(next.release(), std::memory_order_acq_rel);
+    }
+    retire_snapshot(old);
+  }
+
+  // 树中已有前 merged_items 个 item 时的 delta 缓冲区, 调用者持有 insert_mutex_:
+  // 与当前快照的缓冲区起点相同时沿用它, 否则新建一个, 从存储中的记录读入之后插入的 item
+  std::shared_ptr<DeltaBuffer> delta_for(int merged_items) const {
+    const Snapshot* current = snapshot_.load(std::memory_order_relaxed);
+    if (current != nullptr && current->delta->first_item() == merged_items) {
+      return current->delta;
+    }
+    const int n = meta_->n_items - merged_items;
+    std::shared_ptr<DeltaBuffer> delta = std::make_shared<DeltaBuffer>(f_, merged_items, std::max<size_t>(options_.delta_capacity, n));
+    for (int i = 0; i < n; i++) {
+      delta->append(node_vec(record_of(merged_items + i)));
+    }
+    return delta;
+  }
+
+  static void retire_snapshot(Snapshot* s) {
+    if (s != nullptr) {
+      epoch_domain().retire([s] { delete s; });
+    }
+  }
+
+  // 合并之后的快照与 from 共用内存树, 热点子树缓存和访问计数(合并已经就地更新了它们), item 表换为 items;
+  // 热点子树缓存已经使用的部分在发布时取得, 见 publish_snapshot
+  static void share_memory_index(Snapshot& next, const Snapshot& from, std::shared_ptr<ExactTable> items) {
+    next.mem_tree_level = from.mem_tree_level;
+    next.memnode_roots = from.memnode_roots;
+    next.memnode_slab = from.memnode_slab;
+    next.n_memnodes = from.n_memnodes;
+    next.items = std::move(items);
+    next.hot_slab = from.hot_slab;
+    next.hot_stride = from.hot_stride;
+    next.hot_capacity = from.hot_capacity;
+    next.visits = from.visits;
+  }
+
+  // 以当前 pool 中的索引为准的空快照, 内存树和 item 表由调用者填充
+  std::unique_ptr<Snapshot> new_snapshot() const {
+    std::unique_ptr<Snapshot> s(new Snapshot);
+    s->generation = meta_->generation;
+    s->n_items = meta_->built_items;
+    s->merged_items = meta_->merged_items;
+    s->n_trees = meta_->n_trees;
+    s->memnode_stride = memnode_stride_;
+    return s;
+  }
+
+  // 从 n 个候选 item 中选出与 target 距离最近的一个, 距离相同时取靠前的
+  int nearest_candidate(const int* candidates, int n, const float* target) const {
+    int best = candidates[0];
+    float best_dist = Distance::distance(node_vec(best), target, f_);
+    for (int i = 1; i < n; i++) {
+      if (candidates[i] == best) {
+        continue;
+      }
+      float d = Distance::distance(node_vec(candidates[i]), target, f_);
+      if (d < best_dist) {
+        best_dist = d;
+        best = candidates[i];
+      }
+    }
+    return best;
+  }
+
+  // 批量查询: 结果与逐个调用 search_top1 相同
+  // 内存树部分按层推进, 同一层落在同一个 MemNode 上的 query 归为一组,
+  // hyperplane 只加载一次, 在寄存器里同时与组内多个 query 做点积
+  void search_top1_batch(const float* queries, int n, int* out) {
+    search_pending(queries, n, out, [this](const Snapshot& s, int t, const float* queries, const std::vector<int>& pending, int* out) {
+      descend_batch(s, t, queries, pending, out);
+    });
+  }
+
+  // 交错查询: 结果与逐个调用 search_top1 相同
+  // 单个线程同时推进 group 个 query 的下降过程(手写的状态机): 每个 query 走一层后预取下一个节点,
+  // 随即切换到下一个 query, 等轮回来时节点大概率已在 cache 中, 以此掩盖逐层相互依赖的访存延迟
+  void search_top1_interleaved(const float* queries, int n, int* out, int group = INTERLEAVE_GROUP) {
+    group = std::max(1, group);
+    search_pending(queries, n, out, [this, group](const Snapshot& s, int t, const float* queries, const std::vector<int>& pending, int* out) {
+      descend_interleaved(s, t, queries, pending, out, group);
+    });
+  }
+
+  // 批量查询的公共部分: 先查 hash, 未命中的 query 交给 descend_fn(s, t, queries, pending, out) 在每棵树上下降,
+  // 多棵树时按真实距离从各棵树的候选中选出最近的, 再与 delta 缓冲区比较, 最后把结果写回 hash
+  // 整批 query 使用同一个快照; 还没有快照时结果全部为 -1
+  template <typename DescendFn>
+  void search_pending(const float* queries, int n, int* out, DescendFn descend_fn) {
+    if (n <= 0) {
+      return;
+    }
+    EpochGuard guard;
+    const Snapshot* snapshot = snapshot_.load(std::memory_order_acquire);
+    if (snapshot == nullptr) {
+      std::fill(out, out + n, -1);
+      return;
+    }
+    const Snapshot& s = *snapshot;
+
+    /*************** search in hash ***************/
+    std::vector<XXH64_hash_t> hashes(n);
+    std::vector<int> pending;  // 未命中hash的query下标
+    pending.reserve(n);
+    for (int i = 0; i < n; i++) {
+      hashes[i] = XXH3_64bits_withSeed(queries + (size_t)i * f_, sizeof(float) * f_, seed);
+      if (!lookup_hash(s, hashes[i], queries + (size_t)i * f_, out[i])) {
+        pending.push_back(i);
+      }
+    }
+    if (pending.empty()) {
+      return;
+    }
+
+    /************** search in trees **************/
+    if (s.n_trees == 1) {
+      descend_fn(s, 0, queries, pending, out);
+    } else {
+      // candidates[t * n + i]: 第 t 棵树给 query i 的候选叶子
+      std::vector<int> candidates((size_t)s.n_trees * n);
+      for (int t = 0; t < s.n_trees; t++) {
+        descend_fn(s, t, queries, pending, candidates.data() + (size_t)t * n);
+      }
+      int* cand = (int*)alloc_stack(sizeof(int) * s.n_trees);
+      for (int i : pending) {
+        for (int t = 0; t < s.n_trees; t++) {
+          cand[t] = candidates[(size_t)t * n + i];
+        }
+        out[i] = nearest_candidate(cand, s.n_trees, queries + (size_t)i * f_);
+      }
+    }
+    std::vector<int> watermarks(n);
+    for (int i : pending) {
+      out[i] = nearest_delta(s, queries + (size_t)i * f_, item_of(out[i]), watermarks[i]);
+    }
+
+    /************** add to cache **************/
+    for (int i : pending) {
+      result_cache_.insert(hashes[i], out[i], watermarks[i]);
+    }
+  }
+
+  // search_top1_interleaved 在第 t 棵树上的下降过程, 结果写入 out[q], q 属于 pending
+  void descend_interleaved(const Snapshot& s, int t, const float* queries, const std::vector<int>& pending, int* out, int group) const {
+    // 每个槽位是一个正在下降的 query; level <= s.mem_tree_level 时 node 为 MemNode 下标, 否则为 pmem node id
+    struct Cursor {
+      int q;  // -1 表示槽位空闲
+      int node;
+      int level;
+      const float* target;
+      QuantQuery qq;
+    };
+    const int n_slots = std::min<int>(group, pending.size());
+    std::vector<Cursor> slots(n_slots);
+    std::vector<int8_t> qbuf(options_.quantize_mem_tree ? (size_t)n_slots * fq_ : 0);
+    // 没有指定 prefetch_lines 时预取整个节点, 切换到别的 query 的时间足够把它读进来
+    const int mem_lines = options_.prefetch_lines > 0 ? options_.prefetch_lines : (int)(memnode_stride_ / 64);
+    const int pmem_lines = options_.prefetch_lines > 0 ? options_.prefetch_lines : (int)(record_stride_ * sizeof(float) / 64);
+
+    size_t next = 0;
+    auto start = [&](int slot) {
+      Cursor& c = slots[slot];
+      if (next == pending.size()) {
+        c.q = -1;
+        return false;
+      }
+      c.q = pending[next++];
+      c.node = s.memnode_roots[t];
+      c.level = 1;
+      c.target = queries + (size_t)c.q * f_;
+      if (options_.quantize_mem_tree) {
+        quantize_query(c.target, f_, fq_, qbuf.data() + (size_t)slot * fq_, c.qq);
+      }
+      prefetch_mem_node(s, c.node, mem_lines);
+      return true;
+    };
+
+    // 前进一层; 到达叶子时返回 true, 此时 c.node 为 item id
+    auto step = [&](Cursor& c) {
+      int child;
+      if (c.level <= s.mem_tree_level) {
+        const MemNode* mem_nd = s.mem_node(c.node);
+        // 最后一层的出口可能正被提升或合并原子地改写; 叶子的 left 一直是 -1
+        if (__atomic_load_n(&mem_nd->left, __ATOMIC_ACQUIRE) == -1) {
+          const int split = __atomic_load_n(&mem_nd->right, __ATOMIC_ACQUIRE);
+          if (split == -1) {
+            c.node = mem_nd->origin;
+            return true;
+          }
+          // 合并分裂了这个叶子, 与 leaf_exit 一样从分裂它的节点在 pmem 中继续下降
+          c.node = split;
+          c.level = s.mem_tree_level + 1;
+          prefetch_pmem_node(s, split, pmem_lines);
+          return false;
+        }
+        float margin = mem_margin(mem_nd, c.target, options_.quantize_mem_tree ? &c.qq : nullptr);
+        c.level++;
+        if (c.level <= s.mem_tree_level) {
+          child = margin <= 0 ? mem_nd->left : mem_nd->right;
+          c.node = child;
+          prefetch_mem_node(s, child, mem_lines);
+          return false;
+        }
+        // 离开内存树: 出口已被提升时直接在 DRAM 的副本中下降到底
+        child = __atomic_load_n(margin <= 0 ? &mem_nd->left : &mem_nd->right, __ATOMIC_ACQUIRE);
+        if (is_hot_link(child)) {
+          c.node = descend_hot(s, hot_index(child), c.target);
+          return true;
+        }
+        if (s.visits != nullptr && child >= s.n_items) {
+          record_visit(s, mem_nd, margin > 0);
+        }
+      } else {
+        const Node* nd = get(c.node);
+        const int left = __atomic_load_n(&nd->left, __ATOMIC_ACQUIRE);
+        if (left == -1) {
+          return true;
+        }
+        const int right = __atomic_load_n(&nd->right, __ATOMIC_ACQUIRE);
+        float margin = node_margin(c.node, c.target);
+        child = margin <= 0 ? left : right;
+        c.level++;
+      }
+      // 进入或位于 pmem 部分, 与 descend_pmem 一致: item 即为叶子
+      c.node = child;
+      if (child < s.n_items) {
+        return true;
+      }
+      prefetch_pmem_node(s, child, pmem_lines);
+      return false;
+    };
+
+    int active = 0;
+    for (int slot = 0; slot < n_slots; slot++) {
+      active += start(slot);
+    }
+    while (active > 0) {
+      for (int slot = 0; slot < n_slots; slot++) {
+        Cursor& c = slots[slot];
+        if (c.q < 0 || !step(c)) {
+          continue;
+        }
+        out[c.q] = c.node;
+        if (!start(slot)) {
+          active--;
+        }
+      }
+    }
+  }
+
+  // search_top1_batch 在第 t 棵树上的下降过程, 结果写入 out[q], q 属于 pending
+  void descend_batch(const Snapshot& s, int t, const float* queries, const std::vector<int>& pending, int* out) const {
+    /********* search in mem tree index *********/
+    // 同一层中落在同一 MemNode 上的 query 在 group 中连续存放, segs 记录 (node, begin, end)
+    // 每个分组按 margin 拆成左右两个子分组, 不需要排序
+    std::vector<int> group(pending), next_group(pending.size());
+    std::vector<std::array<int, 3>> segs, next_segs;
+    std::vector<int> pmem_queries;  // 离开内存树的query
+    std::vector<std::pair<const MemNode*, int>> exits;  // pmem_queries 中每个 query 离开内存树的节点和出口
+    std::vector<const float*> group_queries(pending.size());
+    std::vector<float> margins(pending.size());
+    segs.push_back({s.memnode_roots[t], 0, (int)group.size()});
+
+    // 量化模式下每个 query 只量化一次, qqueries[k] 对应 pending[k]
+    std::vector<int8_t> qbuf;
+    std::vector<QuantQuery> qqueries;
+    std::vector<int> slot;  // query 下标 -> pending 中的位置
+    if (options_.quantize_mem_tree) {
+      qbuf.resize(pending.size() * fq_);
+      qqueries.resize(pending.size());
+      slot.resize(pending.empty() ? 0 : *std::max_element(pending.begin(), pending.end()) + 1);
+      for (size_t k = 0; k < pending.size(); k++) {
+        quantize_query(queries + (size_t)pending[k] * f_, f_, fq_, qbuf.data() + k * fq_, qqueries[k]);
+        slot[pending[k]] = k;
+      }
+    }
+
+    int currentLevel = 1;
+    while (!segs.empty()) {
+      next_segs.clear();
+      const bool to_pmem = currentLevel + 1 > s.mem_tree_level;
+      for (const auto& seg : segs) {
+        const MemNode* mem_nd = s.mem_node(seg[0]);
+        const int begin = seg[1], end = seg[2];
+        // 最后一层的出口可能正被提升或合并原子地改写; 叶子的 left 一直是 -1
+        if (__atomic_load_n(&mem_nd->left, __ATOMIC_ACQUIRE) == -1) {
+          // 叶子节点, 直接得到结果(被合并分裂过时在 pmem 中继续下降)
+          for (int k = begin; k < end; k++) {
+            out[group[k]] = leaf_exit(s, mem_nd, queries + (size_t)group[k] * f_);
+          }
+          continue;
+        }
+        if (options_.quantize_mem_tree) {
+          for (int k = begin; k < end; k++) {
+            margins[k] = mem_margin(mem_nd, queries + (size_t)group[k] * f_, &qqueries[slot[group[k]]]);
+          }
+        } else {
+          for (int k = begin; k < end; k++) {
+            group_queries[k] = queries + (size_t)group[k] * f_;
+          }
+          Distance::margin_mem_batch(mem_nd, group_queries.data() + begin, end - begin, f_, margins.data() + begin);
+        }
+        // 左子树的query从前往后放, 右子树的从后往前放
+        int l = begin, r = end;
+        for (int k = begin; k < end; k++) {
+          if (margins[k] <= 0) {
+            next_group[l++] = group[k];
+          } else {
+            next_group[--r] = group[k];
+          }
+        }
+        if (to_pmem) {
+          for (int k = begin; k < end; k++) {
+            pmem_queries.push_back(next_group[k]);
+            exits.emplace_back(mem_nd, k < l ? 0 : 1);
+          }
+          continue;
+        }
+        if (l > begin) next_segs.push_back({mem_nd->left, begin, l});
+        if (end > l) next_segs.push_back({mem_nd->right, l, end});
+      }
+      group.swap(next_group);
+      segs.swap(next_segs);
+      ++currentLevel;
+    }
+
+    /******* search in pmem tree index *******/
+    // 深层节点几乎不再被多个query共享, 逐个query下降即可
+    for (size_t k = 0; k < pmem_queries.size(); k++) {
+      const int q = pmem_queries[k];
+      out[q] = descend_deep(s, exits[k].first, exits[k].second, queries + (size_t)q * f_);
+    }
+  }
+
+  // Annoy风格的top-k搜索: 以 margin 为优先级的大顶堆同时展开多条分支,
+  // 收集至少 search_k 个叶子(search_k <= 0 时取 k), 再按 Euclidean::distance 精排
+  // out_dists 可以为 nullptr, 否则写入对应的 Euclidean::distance
+  // 返回: 实际写出的结果数 (<= k)
+  int search_topk(const float* target, int k, int search_k, int* out_ids, float* out_dists) {
+    if (k <= 0) {
+      return 0;
+    }
+    EpochGuard guard;
+    const Snapshot* snapshot = snapshot_.load(std::memory_order_acquire);
+    if (snapshot == nullptr) {
+      return 0;
+    }
+    const Snapshot& snap = *snapshot;
+    if (search_k <= 0) {
+      search_k = k;
+    }
+
+    TopkScratch& s = topk_scratch();
+    s.heap.clear();
+    s.candidates.clear();
+
+    QuantQuery qq;
+    const QuantQuery* qtarget = nullptr;
+    if (options_.quantize_mem_tree) {
+      quantize_query(target, f_, fq_, (int8_t*)alloc_stack(fq_), qq);
+      qtarget = &qq;
+    }
+
+    auto push = [&s](float d, int node, int level) {
+      s.heap.push_back({d, node, level});
+      std::push_heap(s.heap.begin(), s.heap.end());
+    };
+    for (int t = 0; t < snap.n_trees; t++) {
+      push(std::numeric_limits<float>::infinity(), snap.memnode_roots[t], 1);
+    }
+
+    while (!s.heap.empty() && (int)s.candidates.size() < search_k) {
+      std::pop_heap(s.heap.begin(), s.heap.end());
+      const HeapEntry top = s.heap.back();
+      s.heap.pop_back();
+
+      int left, right;
+      float margin;
+      if (top.level <= snap.mem_tree_level) {
+        const MemNode* mem_nd = snap.mem_node(top.node);
+        if (__atomic_load_n(&mem_nd->left, __ATOMIC_ACQUIRE) == -1) {
+          // 被合并分裂过的叶子从分裂它的 pmem 节点继续展开
+          const int split = __atomic_load_n(&mem_nd->right, __ATOMIC_ACQUIRE);
+          if (split == -1) {
+            s.candidates.push_back(mem_nd->origin);
+          } else {
+            push(top.d, split, snap.mem_tree_level + 1);
+          }
+          continue;
+        }
+        // 已提升的出口换回原来的 pmem node id, 之后按 pmem 中的树展开
+        left = pmem_link(snap, __atomic_load_n(&mem_nd->left, __ATOMIC_ACQUIRE));
+        right = pmem_link(snap, __atomic_load_n(&mem_nd->right, __ATOMIC_ACQUIRE));
+        margin = mem_margin(mem_nd, target, qtarget);
+      } else {
+        if (top.node < snap.n_items) {
+          s.candidates.push_back(top.node);
+          continue;
+        }
+        const Node* nd = get(top.node);
+        left = __atomic_load_n(&nd->left, __ATOMIC_ACQUIRE);
+        if (left == -1) {
+          s.candidates.push_back(top.node);
+          continue;
+        }
+        right = __atomic_load_n(&nd->right, __ATOMIC_ACQUIRE);
+        margin = node_margin(top.node, target);
+      }
+      // margin <= 0 走左子树, 与 search_top1 一致
+      if (right != -1) {
+        push(std::min(top.d, margin), right, top.level + 1);
+      }
+      if (left != -1) {
+        push(std::min(top.d, -margin), left, top.level + 1);
+      }
+    }
+
+    std::sort(s.candidates.begin(), s.candidates.end());
+    s.candidates.erase(std::unique(s.candidates.begin(), s.candidates.end()), s.candidates.end());
+
+    // 候选是叶子的记录 id; 正在合并的 item 可能同时出现在树中和旧快照的缓冲区中, 只取缓冲区中的
+    const DeltaBuffer& delta = *snap.delta;
+    s.ranked.clear();
+    for (int record : s.candidates) {
+      const int item = item_of(record);
+      if (item < delta.first_item()) {
+        s.ranked.emplace_back(Distance::distance(node_vec(record), target, f_), item);
+      }
+    }
+    for (size_t i = 0, n = delta.size(); i < n; i++) {
+      s.ranked.emplace_back(Distance::distance(delta.vec(i), target, f_), delta.first_item() + (int)i);
+    }
+    const int m = std::min<int>(k, s.ranked.size());
+    std::partial_sort(s.ranked.begin(), s.ranked.begin() + m, s.ranked.end());
+    for (int i = 0; i < m; i++) {
+      out_ids[i] = s.ranked[i].second;
+      if (out_dists != nullptr) {
+        out_dists[i] = s.ranked[i].first;
+      }
+    }
+    return m;
+  }
+
   int get_n_items() const override {
-    return proot->tree->n_items;
+    return meta_->n_items;
   }
 
   void get_item(int item, float* v) override {
-    Node* m = get(item);
-    memcpy(v, m->v.get(), (f_) * sizeof(float));
+    memcpy(v, node_vec(record_of(item)), (f_) * sizeof(float));
   }
 
   bool is_built() const {
-    return proot->tree->built;
+    return meta_->built;
+  }
+
+  // 建好的树的棵数, 未建树时为 0
+  int get_n_trees() const {
+    return meta_->built ? meta_->n_trees : 0;
+  }
+
+  // 当前快照的内存树缓存的层数以及占用的 DRAM (字节)
+  int mem_tree_level() const {
+    EpochGuard guard;
+    const Snapshot* s = snapshot_.load(std::memory_order_acquire);
+    return s != nullptr ? s->mem_tree_level : 0;
+  }
+
+  size_t mem_tree_bytes() const {
+    EpochGuard guard;
+    const Snapshot* s = snapshot_.load(std::memory_order_acquire);
+    return s != nullptr ? (size_t)s->n_memnodes * memnode_stride_ : 0;
+  }
+
+  // 当前快照的热点子树缓存已经使用的 DRAM (字节)
+  size_t hot_cache_bytes() const {
+    std::lock_guard<std::mutex> lock(promote_mutex_);
+    const Snapshot* s = snapshot_.load(std::memory_order_acquire);
+    return s != nullptr ? s->hot_count * hot_stride_ : 0;
+  }
+
+  // 结果缓存中的条目数, 只用于统计
+  size_t result_cache_size() const {
+    return result_cache_.size();
+  }
+
+  // 当前快照的版本号, 每发布一个快照加一, 还没有快照时为 0
+  uint64_t snapshot_version() const {
+    EpochGuard guard;
+    const Snapshot* s = snapshot_.load(std::memory_order_acquire);
+    return s != nullptr ? s->version : 0;
+  }
+
+  // 把采样访问次数最多的出口下的 pmem 子树的前 HOT_SUBTREE_LEVELS 层拷贝到热点子树缓存,
+  // 写完副本之后再原子地把出口改为指向副本: 查询看到的要么是原来的 pmem node id, 要么是写完的副本, 下降结果相同。
+  // 副本只追加不回收, 缓存满了之后不再提升; 每轮之后访问次数减半, 让后来变热的出口也能被选中
+  // 返回本轮提升的子树数
+  int promote_hot_subtrees() {
+    // 持有 promote_mutex_ 期间快照不会被替换, 也就不会被回收
+    std::lock_guard<std::mutex> lock(promote_mutex_);
+    Snapshot* s = snapshot_.load(std::memory_order_acquire);
+    if (s == nullptr || s->hot_slab == nullptr) {
+      return 0;
+    }
+    std::vector<std::pair<uint32_t, size_t>> hot;  // (访问次数, 出口)
+    for (size_t e = 0; e < 2 * (size_t)s->n_memnodes; e++) {
+      const uint32_t v = s->visits[e].load(std::memory_order_relaxed);
+      if (v >= HOT_MIN_VISITS) {
+        hot.emplace_back(v, e);
+      }
+      s->visits[e].fetch_sub(v - v / 2, std::memory_order_relaxed);
+    }
+    std::sort(hot.begin(), hot.end(), std::greater<std::pair<uint32_t, size_t>>());
+
+    int promoted = 0;
+    for (const auto& h : hot) {
+      MemNode* mem_nd = s->mem_node(h.second / 2);
+      int* link = (h.second & 1) ? &mem_nd->right : &mem_nd->left;
+      const int node = __atomic_load_n(link, __ATOMIC_RELAXED);
+      if (is_hot_link(node) || node < s->n_items || node_at(node)->left == -1) {
+        continue;
+      }
+      const int root = copy_hot_subtree(*s, node);
+      if (root < 0) {
+        break;
+      }
+      __atomic_store_n(link, -2 - root, __ATOMIC_RELEASE);
+      promoted++;
+    }
+    return promoted;
+  }
+
+  // 建树的次数, 查询结果缓存以它区分新旧
+  uint64_t generation() const {
+    return meta_->generation;
   }
   
   void print_hit_status() {
@@ -373,21 +1969,68 @@ class VectorIndex : public VectorIndexInterface {
 
  private:
   int n_nodes_ = 0;
+  int n_items_ = 0;  // 叶子数, 即 item id 的上界
   Distance dist_;
-  pmem::obj::persistent_ptr<VectorIndex::root> proot;
+  std::unique_ptr<IndexStorage> storage_;
+  IndexMeta* meta_;
+  std::unique_ptr<float*[]> segments_;  // 存储中各个节点段的地址, 每段 SEGMENT_NODES 条记录, 格式见 VNode
+  size_t n_segments_ = 0;  // 只由持有 insert_mutex_ 的写者(或建树)修改
+  size_t record_stride_;  // 记录长度, 以 float 计
   uint32_t node_cur_num = 0;
 
-  // MemTree
-  MemNode* memnode_array_space;
-  float* memfloat_array_space;
-  uint32_t memnode_cur_num = 0;
-  int mem_tree_level_ = 0;
-  int memnode_root = 0;
+  // MemTree, 内容在快照中
+  size_t memnode_stride_;
+  int fq_ = 0;  // 量化向量按 QUANT_ALIGN 补齐后的长度
+  size_t hot_stride_ = 0;
+  IndexOptions options_;
+
+  // 查询使用的快照, 见 publish_snapshot; 写者之间以及与提升线程之间由 promote_mutex_ 互斥
+  std::atomic<Snapshot*> snapshot_{nullptr};
+  uint64_t snapshot_version_ = 0;
+  mutable std::mutex promote_mutex_;
+  // 建树之后的记录布局, 见 init_record_layout; 建树之前记录 id 即 item id
+  int built_items_ = INT_MAX;
+  int built_nodes_ = 0;
+  int record_step_ = 1;
+  // insert_mutex_ 保护插入和对 n_items 等元数据的提交; merge_mutex_ 让合并与重新加载、写出镜像依次进行,
+  // 两者都持有时先取 merge_mutex_
+  std::mutex insert_mutex_;
+  std::mutex merge_mutex_;
+  bool image_stale_ = false;  // 合并之后镜像还没有重新写出, 由 merge_mutex_ 保护
+  std::thread merger_;
+  std::mutex merger_mutex_;
+  std::condition_variable merger_cv_;
+  bool merger_stop_ = false;
+  bool merge_requested_ = false;
+  std::thread promoter_;
+  std::mutex promoter_mutex_;
+  std::condition_variable promoter_cv_;
+  bool promoter_stop_ = false;
 
   // ska::bytell_hash_map<int, uint32_t> node_arrayidx_hash_map;  // relable后, 就不需要查表, node可以直接作为array idx
-  ska::bytell_hash_map<uint64_t, int> hashret_item_map;
+  // 查询得到的结果, 容量固定, 可以被多个线程同时读写
+  ResultCache result_cache_;
+
+  // search_topk 的优先队列元素, level <= mem_tree_level 时 node 为 MemNode 下标, 否则为 pmem node id
+  struct HeapEntry {
+    float d;
+    int node;
+    int level;
+    bool operator<(const HeapEntry& o) const { return d < o.d; }
+  };
+
+  // search_topk 的线程私有缓冲区, 容量只增不减, 热路径上不再分配内存
+  struct TopkScratch {
+    std::vector<HeapEntry> heap;
+    std::vector<int> candidates;
+    std::vector<std::pair<float, int>> ranked;
+  };
+
+  static TopkScratch& topk_scratch() {
+    static thread_local TopkScratch scratch;
+    return scratch;
+  }
 
-  std::mutex mutex_[2];  // 互斥锁
   // spin_lock splock[2];  // 自旋锁
 
   // debug
@@ -400,87 +2043,152 @@ public:
   // 需要在持久内存上新建节点
   Node* get(const int i) {
     if (i < node_cur_num) {
-      return node_array_start + i;
+      return node_at(i);
     }
     else {
-      Node* node = node_array_start + node_cur_num;
-      node->v = float_array_start + (uint32_t)node_cur_num * f_;  // 注意 boundary error
-      // proot->tree->n_items++;  // no need, n_item is leaf num.
-      proot->node_total++;
+      Node* node = node_at(node_cur_num);
+      // meta_->n_items++;  // no need, n_item is leaf num.
+      meta_->node_total++;
       node_cur_num++;
       return node;
     }
   }
 
-  Node* get(const int i) const {
-    return node_array_start + i;
+  const Node* get(const int i) const {
+    return node_at(i);
   }
 
-  MemNode* get_mem_node(const int i) {
-    if (i < memnode_cur_num) {
-      return memnode_array_space + i;
-    }
-    else {
-      MemNode* n = memnode_array_space + memnode_cur_num;
-      n->v = memfloat_array_space + memnode_cur_num * f_;
-      memnode_cur_num++;
-      return n;
-    }
+  // 第 i 条节点记录: 向量在前, Node 紧随其后
+  float* node_vec(const int i) {
+    return segments_[i >> SEGMENT_BITS] + (size_t)(i & (SEGMENT_NODES - 1)) * record_stride_;
   }
 
-  MemNode* get_mem_node(const int i) const {
-    return memnode_array_space + i;
+  const float* node_vec(const int i) const {
+    return segments_[i >> SEGMENT_BITS] + (size_t)(i & (SEGMENT_NODES - 1)) * record_stride_;
   }
 
-  int make_tree(const std::vector<int >& indices) {
-    if (indices.size() == 1)
-      return indices[0];
+  Node* node_at(const int i) {
+    return reinterpret_cast<Node*>(node_vec(i) + f_);
+  }
+
+  const Node* node_at(const int i) const {
+    return reinterpret_cast<const Node*>(node_vec(i) + f_);
+  }
 
-    std::vector<Node*> children;
-    for (size_t i = 0; i < indices.size(); i++) {
-      int j = indices[i];
-      Node* n = get(j);
-      if (n)
-        children.push_back(n);
+  // 持久化存储中节点 i 的 margin
+  float node_margin(const int i, const float* y) const {
+    return dist_.margin(node_at(i), node_vec(i), y, f_);
+  }
+
+  // 保证前 n 个节点的记录已经分配, 不足时由存储按段追加。
+  // 存储保证已有段的地址不变(见 IndexStorage::reserve), 已有的记录不会移动, 追加可以与查询和合并并发
+  bool ensure_capacity(size_t n) {
+    if (n <= n_segments_ * SEGMENT_NODES) {
+      return true;
     }
+    const bool ok = storage_->reserve(n);
+    sync_segments();
+    return ok;
+  }
 
-    std::vector<int> children_indices[2];
-    VNode m;
-    m.v = make_persistent<float[]>(f_);  // should free
-    dist_.create_hyperplane(children, f_, &m);
-    
-    for (size_t i = 0; i < indices.size(); i++) {
-      int j = indices[i];
-      Node* n = get(j);
-      if (n) {
-        bool side = dist_.side(&m, n->v.get(), f_);
-        children_indices[side].push_back(j);
-      } else {
-        log("No node for index %d?\n", j);
+  // 只追加新段的地址, 已有的项不变, 合并和查询可以同时读取; 存储移动了已有的段时抛出异常
+  void sync_segments() {
+    for (size_t s = 0; s < n_segments_; s++) {
+      if (reinterpret_cast<float*>(storage_->segment(s)) != segments_[s]) {
+        throw std::runtime_error("storage moved node segment " + std::to_string(s));
       }
     }
+    for (size_t s = n_segments_; s < storage_->n_segments(); s++) {
+      segments_[s] = reinterpret_cast<float*>(storage_->segment(s));
+    }
+    n_segments_ = storage_->n_segments();
+  }
 
-    // to be simple, we do not consider randomize this case
-    if (children_indices[0].size() == 0 || children_indices[1].size() == 0) {
-      log("trees not balanced. left children num. = %ld, right children num. = %ld\n", children_indices[0].size(), children_indices[1].size());
+  // 逐段持久化 [begin, end) 的节点记录
+  void persist_nodes(int begin, int end) {
+    while (begin < end) {
+      const int seg_end = std::min<int>(end, (begin | (SEGMENT_NODES - 1)) + 1);
+      storage_->persist(node_vec(begin), sizeof(float) * record_stride_ * (seg_end - begin));
+      begin = seg_end;
     }
+  }
 
-    if (children_indices[0].size() > 0) {
-      m.left = make_tree(children_indices[0]);
+  // 一次性占用 [node_cur_num, total) 的节点, 之后这些节点可以被多个线程并发写入
+  void reserve_nodes(int total) {
+    if (total > (int)node_cur_num) {
+      meta_->node_total = total;
+      node_cur_num = total;
     }
+  }
+
+  // 以 base 为根, 对 indices[0..n) 建立子树, 子树的内部节点按先序占用 [base, base + n - 1) 的 node id
+  // indices 按快速排序的方式原地划分为左右两段, 分别交给左右子树, 整个建树过程不再分配 index 数组;
+  // hyperplane 先在栈上的 DRAM 空间中算好, 再一次性写入预留好的节点
+  // 左右子树的随机种子由当前节点的随机流派生, 与线程数和任务的调度顺序无关, 同一 seed 建出的树完全相同
+  int make_tree(int* indices, size_t n, uint32_t seed, int base) {
+    if (n == 1)
+      return indices[0];
+
+    Distance dist(seed);
+    float* v = (float*)alloc_stack(f_ * sizeof(float));
+    float alpha;
+    dist.create_hyperplane([this](int i) { return node_vec(i); }, indices, n, f_, v, alpha);
+
+    // [0, mid) 落在左侧, [mid, n) 落在右侧
+    auto partition = [&]() {
+      size_t mid = 0, hi = n;
+      while (mid < hi) {
+        if (dist.side(v, alpha, node_vec(indices[mid]), f_)) {
+          std::swap(indices[mid], indices[--hi]);
+        } else {
+          mid++;
+        }
+      }
+      return mid;
+    };
+    size_t mid = partition();
 
-    if (children_indices[1].size() > 0) {
-      m.right = make_tree(children_indices[1]);
+    // 所有点都落在同一侧时(two_means 的两个中心重合), 改用第一个点与第一个不同的点的垂直平分面,
+    // 这两个点一定分在两侧, 查询仍能到达每一侧
+    if (mid == 0 || mid == n) {
+      const float* first = node_vec(indices[0]);
+      for (size_t k = 1; k < n; k++) {
+        if (Distance::bisector(node_vec(indices[k]), first, f_, v, alpha)) {
+          mid = partition();
+          break;
+        }
+      }
+    }
+
+    // 向量完全相同时没有能分开它们的 hyperplane: 使用零向量, 查询总是走左子树, 两侧的向量相同, 距离也相同;
+    // 前后两半分到两侧, 保证每个内部节点两侧都非空, 每棵树恰好 n - 1 个内部节点
+    if (mid == 0 || mid == n) {
+      memset(v, 0, f_ * sizeof(float));
+      alpha = 0;
+      mid = n / 2;
     }
 
-    int item = n_nodes_++;  // 不能使用n_nodes_直接当get内的偏移
-    Node* node = get(item);
-    node->alpha = m.alpha;
-    node->left = m.left;
-    node->right = m.right;
-    memcpy(node->v.get(), m.v.get(), f_ * sizeof(float));
-    delete_persistent<float[]>(m.v, f_);  // free
+    Node* node = node_at(base);
+    memcpy(node_vec(base), v, f_ * sizeof(float));
+    node->alpha = alpha;
 
-    return item;
+    const uint32_t left_seed = dist.random().rand() | 1;
+    const uint32_t right_seed = dist.random().rand() | 1;
+    int* left_indices = indices;
+    int* right_indices = indices + mid;
+    const size_t left_n = mid, right_n = n - mid;
+    const int left_base = base + 1;
+    const int right_base = base + (int)left_n;
+    node->left = left_n == 1 ? left_indices[0] : left_base;
+    node->right = right_n == 1 ? right_indices[0] : right_base;
+
+    if (n >= PARALLEL_BUILD_MIN) {
+#pragma omp task firstprivate(left_indices, left_n, left_seed, left_base)
+      make_tree(left_indices, left_n, left_seed, left_base);
+    } else {
+      make_tree(left_indices, left_n, left_seed, left_base);
+    }
+    make_tree(right_indices, right_n, right_seed, right_base);
+    return base;
   }
 };
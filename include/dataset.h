@@ -0,0 +1,345 @@
+#pragma once
+
+// 向量数据文件: .fvecs / .bvecs / .ivecs 以及裸的 fp32 文件
+//
+// fvecs/bvecs/ivecs 中每条记录是 int32 的维度 d 加上 d 个 float / uint8 / int32,
+// 所有记录维度相同, 因此第 i 条记录的偏移是 i * (4 + d * 元素大小)。
+// 裸 fp32 文件没有头部, 维度需要由调用者给出。
+//
+// 文件总是按大块顺序读取(pread), VecFile::stream() 用一个读线程预读下一块,
+// 调用者处理当前块的同时下一块已经在读, 读过的部分用 POSIX_FADV_DONTNEED 从 page cache 中丢掉,
+// 导入远大于内存的数据集时不会挤占 page cache。
+//
+// BruteForceKnn 用于求 ground truth: 按块扫描所有向量, 多线程分担 query, 距离用 simd.h 中的 l2。
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "simd.h"
+
+enum class VecFormat { Auto, Fvecs, Bvecs, Ivecs, Raw };
+
+class VecFile {
+ public:
+  VecFile() = default;
+  VecFile(const VecFile&) = delete;
+  VecFile& operator=(const VecFile&) = delete;
+
+  ~VecFile() {
+    close();
+  }
+
+  // format 为 Auto 时按扩展名判断, 其它扩展名按裸 fp32 处理; raw_dim 只对裸 fp32 文件有效
+  bool open(const std::string& path, VecFormat format = VecFormat::Auto, int raw_dim = 0) {
+    close();
+    if (format == VecFormat::Auto) {
+      format = format_of(path);
+    }
+    format_ = format;
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      fprintf(stderr, "Failed to open %s\n", path.c_str());
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+      close();
+      return false;
+    }
+    const size_t file_size = st.st_size;
+
+    if (format_ == VecFormat::Raw) {
+      dim_ = raw_dim;
+      header_ = 0;
+    } else {
+      int32_t d = 0;
+      if (file_size < sizeof(d) || pread(fd_, &d, sizeof(d), 0) != (ssize_t)sizeof(d)) {
+        fprintf(stderr, "%s is empty\n", path.c_str());
+        close();
+        return false;
+      }
+      dim_ = d;
+      header_ = sizeof(int32_t);
+    }
+    if (dim_ <= 0) {
+      fprintf(stderr, "Bad dimension %d in %s\n", dim_, path.c_str());
+      close();
+      return false;
+    }
+    record_size_ = header_ + (size_t)dim_ * elem_size();
+    if (file_size % record_size_ != 0) {
+      fprintf(stderr, "Size of %s is not a multiple of the record size %zu\n", path.c_str(), record_size_);
+      close();
+      return false;
+    }
+    count_ = file_size / record_size_;
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+  }
+
+  void close() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+    fd_ = -1;
+    dim_ = 0;
+    count_ = 0;
+  }
+
+  int dim() const {
+    return dim_;
+  }
+
+  size_t count() const {
+    return count_;
+  }
+
+  VecFormat format() const {
+    return format_;
+  }
+
+  // 读取 [first, first + n) 条记录转换为 float, 连续存放到 out 中
+  bool read(size_t first, size_t n, float* out) {
+    std::vector<char> raw;
+    if (!read_raw(first, n, raw)) {
+      return false;
+    }
+    convert(raw.data(), n, out);
+    return true;
+  }
+
+  // 读取 ivecs 中 [first, first + n) 条记录, 连续存放到 out 中 (ground truth)
+  bool read_ints(size_t first, size_t n, int32_t* out) {
+    if (format_ != VecFormat::Ivecs) {
+      return false;
+    }
+    std::vector<char> raw;
+    if (!read_raw(first, n, raw)) {
+      return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+      memcpy(out + i * dim_, raw.data() + i * record_size_ + header_, (size_t)dim_ * sizeof(int32_t));
+    }
+    return true;
+  }
+
+  // 把 [first, first + n) 分成每块 chunk 条的若干块依次交给 fn(first_id, count, data),
+  // 读线程提前读取下一块, 与 fn 的处理重叠; fn 返回 false 时停止
+  template <typename Fn>
+  bool stream(size_t first, size_t n, size_t chunk, Fn fn) {
+    if (first + n > count_ || chunk == 0 || format_ == VecFormat::Ivecs) {
+      return false;
+    }
+    std::vector<char> raw[2];
+    std::vector<float> buf[2];
+    bool ok[2] = {false, false};
+    auto load = [&](int b, size_t begin) {
+      const size_t cnt = std::min(chunk, first + n - begin);
+      ok[b] = read_raw(begin, cnt, raw[b]);
+      if (ok[b]) {
+        buf[b].resize(cnt * dim_);
+        convert(raw[b].data(), cnt, buf[b].data());
+      }
+    };
+
+    if (n == 0) {
+      return true;
+    }
+    load(0, first);
+    int cur = 0;
+    for (size_t begin = first; begin < first + n; begin += chunk) {
+      const size_t next = begin + chunk;
+      std::thread reader;
+      if (next < first + n) {
+        reader = std::thread(load, cur ^ 1, next);
+      }
+      bool go = ok[cur] && fn(begin, buf[cur].size() / dim_, buf[cur].data());
+      if (ok[cur]) {
+        // 这一块已经处理完, 不再需要留在 page cache 中
+        posix_fadvise(fd_, begin * record_size_, (next - begin) * record_size_, POSIX_FADV_DONTNEED);
+      }
+      if (reader.joinable()) {
+        reader.join();
+      }
+      if (!go) {
+        return false;
+      }
+      cur ^= 1;
+    }
+    return true;
+  }
+
+  static VecFormat format_of(const std::string& path) {
+    auto ends_with = [&](const char* ext) {
+      const size_t len = strlen(ext);
+      return path.size() >= len && path.compare(path.size() - len, len, ext) == 0;
+    };
+    if (ends_with(".fvecs")) {
+      return VecFormat::Fvecs;
+    }
+    if (ends_with(".bvecs")) {
+      return VecFormat::Bvecs;
+    }
+    if (ends_with(".ivecs")) {
+      return VecFormat::Ivecs;
+    }
+    return VecFormat::Raw;
+  }
+
+ private:
+  size_t elem_size() const {
+    return format_ == VecFormat::Bvecs ? 1 : 4;
+  }
+
+  bool read_raw(size_t first, size_t n, std::vector<char>& raw) {
+    if (fd_ < 0 || first + n > count_) {
+      return false;
+    }
+    const size_t bytes = n * record_size_;
+    raw.resize(bytes);
+    size_t done = 0;
+    while (done < bytes) {
+      ssize_t r = pread(fd_, raw.data() + done, bytes - done, first * record_size_ + done);
+      if (r <= 0) {
+        fprintf(stderr, "Failed to read records [%zu, %zu)\n", first, first + n);
+        return false;
+      }
+      done += r;
+    }
+    return true;
+  }
+
+  // 去掉每条记录的维度头部, 转换为 float
+  void convert(const char* raw, size_t n, float* out) const {
+    if (format_ == VecFormat::Raw) {
+      memcpy(out, raw, n * record_size_);
+      return;
+    }
+    for (size_t i = 0; i < n; i++) {
+      const char* src = raw + i * record_size_ + header_;
+      float* dst = out + i * dim_;
+      if (format_ == VecFormat::Bvecs) {
+        const uint8_t* b = reinterpret_cast<const uint8_t*>(src);
+        for (int z = 0; z < dim_; z++) {
+          dst[z] = b[z];
+        }
+      } else {
+        memcpy(dst, src, (size_t)dim_ * sizeof(float));
+      }
+    }
+  }
+
+  int fd_ = -1;
+  VecFormat format_ = VecFormat::Raw;
+  int dim_ = 0;
+  size_t header_ = 0;
+  size_t record_size_ = 0;
+  size_t count_ = 0;
+};
+
+// 把 file 中的前 n 条向量导入 index, 从 index 已有的 n_items 处继续 (之前中断的导入可以接着做)
+// 每块 chunk 条调用一次 add_items, 读下一块与写入当前块同时进行
+template <typename Index>
+bool load_vectors(Index& index, VecFile& file, size_t n, size_t chunk = 1 << 16) {
+  n = std::min(n, file.count());
+  const size_t first = index.get_n_items();
+  if (first >= n) {
+    return true;
+  }
+  return file.stream(first, n - first, chunk, [&](size_t begin, size_t cnt, const float* data) {
+    return index.add_items(begin, cnt, data);
+  });
+}
+
+// 把 n 条 d 维的 int32 记录写成 ivecs 文件
+inline bool write_ivecs(const std::string& path, const int32_t* data, size_t n, int d) {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr) {
+    fprintf(stderr, "Failed to create %s\n", path.c_str());
+    return false;
+  }
+  bool ok = true;
+  for (size_t i = 0; i < n && ok; i++) {
+    ok = fwrite(&d, sizeof(d), 1, fp) == 1 && fwrite(data + i * d, sizeof(int32_t), d, fp) == (size_t)d;
+  }
+  return fclose(fp) == 0 && ok;
+}
+
+// 精确的 k 近邻 (squared euclidean), 用于求 ground truth
+// 向量可以分多次按 id 顺序交给 scan(), 例如配合 VecFile::stream 扫描放不进内存的数据集
+class BruteForceKnn {
+ public:
+  BruteForceKnn(const float* queries, int n_queries, int f, int k)
+      : queries_(queries), n_queries_(n_queries), f_(f), k_(k),
+        ids_((size_t)n_queries * k, -1), dists_((size_t)n_queries * k, std::numeric_limits<float>::max()) {}
+
+  // 用 id 为 [first_id, first_id + count) 的向量更新每个 query 的近邻, 距离相同时保留 id 小的
+  // query 按 QUERY_BLOCK 个一组分给各线程, 每组依次扫过 BASE_BLOCK 个向量, 这一小块向量留在 cache 中被整组复用
+  void scan(size_t first_id, size_t count, const float* data, int n_threads) {
+    const auto l2 = distance_kernels().l2;
+    const int n_blocks = (n_queries_ + QUERY_BLOCK - 1) / QUERY_BLOCK;
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 1)
+    for (int b = 0; b < n_blocks; b++) {
+      const int q_end = std::min(n_queries_, (b + 1) * QUERY_BLOCK);
+      for (size_t base = 0; base < count; base += BASE_BLOCK) {
+        const size_t base_end = std::min(count, base + BASE_BLOCK);
+        for (int q = b * QUERY_BLOCK; q < q_end; q++) {
+          const float* y = queries_ + (size_t)q * f_;
+          int32_t* ids = &ids_[(size_t)q * k_];
+          float* dists = &dists_[(size_t)q * k_];
+          for (size_t i = base; i < base_end; i++) {
+            const float d = l2(data + i * f_, y, f_);
+            if (d < dists[k_ - 1]) {
+              insert(ids, dists, first_id + i, d);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // 第 q 个 query 的近邻, 按距离升序, 不足 k 个时以 -1 补齐
+  const int32_t* ids(int q) const {
+    return &ids_[(size_t)q * k_];
+  }
+
+  const float* dists(int q) const {
+    return &dists_[(size_t)q * k_];
+  }
+
+  const std::vector<int32_t>& all_ids() const {
+    return ids_;
+  }
+
+ private:
+  static const int QUERY_BLOCK = 16;
+  static const size_t BASE_BLOCK = 256;
+
+  // 插入有序数组, 挤掉最后一个
+  void insert(int32_t* ids, float* dists, int32_t id, float d) {
+    int pos = k_ - 1;
+    while (pos > 0 && dists[pos - 1] > d) {
+      ids[pos] = ids[pos - 1];
+      dists[pos] = dists[pos - 1];
+      pos--;
+    }
+    ids[pos] = id;
+    dists[pos] = d;
+  }
+
+  const float* queries_;
+  int n_queries_;
+  int f_;
+  int k_;
+  std::vector<int32_t> ids_;
+  std::vector<float> dists_;
+};
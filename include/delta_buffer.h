@@ -0,0 +1,80 @@
+#pragma once
+
+// 建树之后插入、尚未合并进树的 item 的 DRAM 副本
+//
+// item id 连续: 第 i 个向量属于 first_item + i。容量在创建时固定, 写满之后由调用者合并进树并换上新的缓冲区。
+// 只有一个写者 append: 先写好向量, 再以 release 增加 size; 查询以 acquire 读取 size 后扫描 [0, size),
+// 与写者互不等待。查询时对全部向量暴力计算距离, 缓冲区越小, 额外的延迟越低。
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#include "distance.h"
+
+class DeltaBuffer {
+ public:
+  DeltaBuffer(int f, int first_item, size_t capacity) :
+      f_(f), stride_((f + 15) / 16 * 16), first_item_(first_item), capacity_(std::max<size_t>(capacity, 1)) {
+    // 每个向量按 cache line 对齐
+    data_ = (float*)aligned_alloc(64, capacity_ * stride_ * sizeof(float));
+  }
+
+  ~DeltaBuffer() {
+    free(data_);
+  }
+
+  DeltaBuffer(const DeltaBuffer&) = delete;
+  DeltaBuffer& operator=(const DeltaBuffer&) = delete;
+
+  int first_item() const {
+    return first_item_;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  size_t size() const {
+    return size_.load(std::memory_order_acquire);
+  }
+
+  bool full() const {
+    return size() == capacity_;
+  }
+
+  const float* vec(size_t i) const {
+    return data_ + i * stride_;
+  }
+
+  // 追加下一个 item 的向量, 调用者保证缓冲区未满且同时只有一个写者
+  void append(const float* v) {
+    const size_t n = size_.load(std::memory_order_relaxed);
+    memcpy(data_ + n * stride_, v, sizeof(float) * f_);
+    size_.store(n + 1, std::memory_order_release);
+  }
+
+  // 缓冲区的 [begin, end) 中与 target 距离严格小于 best_dist 的最近的 item, 找到时更新 best_dist, 否则返回 -1;
+  // end 不超过之前读到的 size()
+  int nearest(const float* target, size_t begin, size_t end, float& best_dist) const {
+    const auto l2 = distance_kernels().l2;
+    int best = -1;
+    for (size_t i = begin; i < end; i++) {
+      const float d = l2(vec(i), target, f_);
+      if (d < best_dist) {
+        best_dist = d;
+        best = first_item_ + (int)i;
+      }
+    }
+    return best;
+  }
+
+ private:
+  int f_;
+  size_t stride_;  // 以 float 计
+  int first_item_;
+  size_t capacity_;
+  float* data_;
+  std::atomic<size_t> size_{0};
+};
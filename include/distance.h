@@ -2,8 +2,11 @@
 
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <limits>
 #include <immintrin.h>
 #include "random.h"
+#include "simd.h"
 
 #include <libpmemobj++/make_persistent.hpp>
 #include <libpmemobj++/make_persistent_array_atomic.hpp>
@@ -36,70 +39,18 @@ inline float serial_dot(const float* x, const float* y, int f) {
   return s;
 }
 
-template<int offsetRegs>
-inline __m256 mul8( const float* p1, const float* p2 )
-{
-    constexpr int lanes = offsetRegs * 8  ;
-    const __m256 a = _mm256_loadu_ps( p1 + lanes );
-    const __m256 b = _mm256_loadu_ps( p2 + lanes );
-    return _mm256_mul_ps( a, b );
+// 启动时按 CPU 选择的 SIMD 实现(见 simd.h), 任意维度都走向量化路径
+inline float dot(const float* x, const float* y, int f) {
+  return distance_kernels().dot(x, y, f);
 }
 
-template<int offsetRegs>
-inline __m256 fma8( __m256 acc, const float* p1, const float* p2 )
-{
-    constexpr int lanes = offsetRegs * 8;
-    const __m256 a = _mm256_loadu_ps( p1 + lanes );
-    const __m256 b = _mm256_loadu_ps( p2 + lanes );
-    return _mm256_fmadd_ps( a, b, acc );
+// ys 中 n 个 query 分别与 x 做点积, 结果与 dot() 逐位相同
+inline void dot_batch(const float* x, const float* const* ys, int n, int f, float* out) {
+  distance_kernels().dot_batch(x, ys, n, f, out);
 }
 
-float dot(const float* x, const float* y, int f) {
-  // 当维度为32的倍数时，使用AVX2做并行计算
-  if (f % 32 != 0) {
-    return serial_dot(x, y, f);
-  }
-
-  const float* p1 = x;
-  const float* const p1End = p1 + f;
-  const float* p2 = y;
-
-  __m256 dot0 = mul8<0>( p1, p2 );
-  __m256 dot1 = mul8<1>( p1, p2 );
-  __m256 dot2 = mul8<2>( p1, p2 );
-  __m256 dot3 = mul8<3>( p1, p2 );
-  p1 += 8 * 4;
-  p2 += 8 * 4;
-
-  while( p1 < p1End )
-  {
-      dot0 = fma8<0>( dot0, p1, p2 );
-      dot1 = fma8<1>( dot1, p1, p2 );
-      dot2 = fma8<2>( dot2, p1, p2 );
-      dot3 = fma8<3>( dot3, p1, p2 );
-      p1 += 8 * 4;
-      p2 += 8 * 4;
-  }
-
-  const __m256 dot01 = _mm256_add_ps( dot0, dot1 );
-  const __m256 dot23 = _mm256_add_ps( dot2, dot3 );
-  const __m256 dot0123 = _mm256_add_ps( dot01, dot23 );
-
-  const __m128 r4 = _mm_add_ps( _mm256_castps256_ps128( dot0123 ), _mm256_extractf128_ps( dot0123, 1 ) );
-  const __m128 r2 = _mm_add_ps( r4, _mm_movehl_ps( r4, r4 ) );
-  const __m128 r1 = _mm_add_ss( r2, _mm_movehdup_ps( r2 ) );
-  return _mm_cvtss_f32( r1 );
-}
-
-float euclidean_distance(const float* x, const float* y, int f) {
-  float d = 0.0;
-  for (int i = 0; i < f; ++i) {
-    const float tmp = x[i] - y[i];
-    d += tmp * tmp;
-    // ++x;
-    // ++y;
-  }
-  return d;
+inline float euclidean_distance(const float* x, const float* y, int f) {
+  return distance_kernels().l2(x, y, f);
 }
 
 inline float get_norm(float* v, int f) {
@@ -114,73 +65,160 @@ void normalize(float* v, int f) {
   }
 }
 
+// 持久化存储中的节点
+// 每个节点是一条定长记录: 开头是 64 字节对齐的向量, 紧随其后是 VNode, 整条记录按 cache line 补齐,
+// 第 i 条记录的地址由 id 直接算出, 下降一层只访问一段连续的内存
+// sizeof(VNode)=16
+struct VNode {
+  int left = -1;
+  int right = -1;
+  float alpha; // need an extra constant term to determine the offset of the plane
+  int pad;
+};
+static_assert(sizeof(VNode) == 16, "VNode must stay 16 bytes");
+
+// f 维向量加上 VNode 的记录长度(字节)
+inline size_t node_record_stride(int f) {
+  return (sizeof(float) * f + sizeof(VNode) + 63) / 64 * 64;
+}
+
+// 内存树节点: 32 字节的头部之后紧跟 hyperplane (fp32, 量化模式下为 int8: v[i] ≈ scale * qv[i])
+// 所有节点按 BFS 顺序存放在一块 64 字节对齐的 slab 中, 每个节点占 mem_node_stride 字节,
+// 下降一层只访问一段连续的内存, 不再需要先读节点再按指针读向量
+struct alignas(32) MemNode {
+  int origin;  // origin pmem_node id
+  int left;
+  int right;
+  float alpha; // need an extra constant term to determine the offset of the plane
+  float scale;  // 量化步长
+  float l1;  // scale * Σ|qv[i]|, 用于估计量化误差
+
+  float* v() { return reinterpret_cast<float*>(this + 1); }
+  const float* v() const { return reinterpret_cast<const float*>(this + 1); }
+  int8_t* qv() { return reinterpret_cast<int8_t*>(this + 1); }
+  const int8_t* qv() const { return reinterpret_cast<const int8_t*>(this + 1); }
+};
+static_assert(sizeof(MemNode) == 32, "MemNode header must stay 32 bytes");
+
+// 头部加上 vec_bytes 字节的向量, 按 cache line 补齐
+inline size_t mem_node_stride(size_t vec_bytes) {
+  return (sizeof(MemNode) + vec_bytes + 63) / 64 * 64;
+}
+
+// 对称量化: q[i] = round(v[i] / scale), scale = max|v| / 127, [f, fq) 补 0
+// 返回 scale, 全零向量返回 0
+inline float quantize(const float* v, int f, int fq, int8_t* q) {
+  float max_abs = 0;
+  for (int z = 0; z < f; z++)
+    max_abs = std::max(max_abs, std::fabs(v[z]));
+  memset(q, 0, fq);
+  if (!(max_abs > 0))
+    return 0;
+  const float scale = max_abs / 127;
+  const float inv = 127 / max_abs;
+  for (int z = 0; z < f; z++)
+    q[z] = (int8_t)std::max(-127.0f, std::min(127.0f, std::nearbyint(v[z] * inv)));
+  return scale;
+}
+
+// 量化后的 query, 每次查询计算一次
+struct QuantQuery {
+  const int8_t* q;
+  float scale;
+  float l1;  // Σ|y[i]|
+};
+
+inline void quantize_query(const float* y, int f, int fq, int8_t* buf, QuantQuery& out) {
+  out.q = buf;
+  out.scale = quantize(y, f, fq, buf);
+  float l1 = 0;
+  for (int z = 0; z < f; z++)
+    l1 += std::fabs(y[z]);
+  out.l1 = l1;
+}
+
+typedef VNode Node;
+
 // a heuristic to find the two means from list of nodes
-template <typename NodePtr, typename Distance>
-void two_means(const std::vector<NodePtr>& nodes, int f, Random& random, float* p, float* q) {
+// vec_of(indices[0..count)) 为参与划分的节点的向量
+template <typename Distance, typename VecOf>
+void two_means(const VecOf& vec_of, const int* indices, size_t count, int f, Random& random, float* p, float* q) {
   static int iteration_steps = 200;
-  size_t count = nodes.size();
 
   size_t i = random.index(count);
   size_t j = random.index(count-1);
   j += (j >= i); // ensure that i != j
 
-  memcpy(p, nodes[i]->v.get(), f * sizeof(float));
-  memcpy(q, nodes[j]->v.get(), f * sizeof(float));
+  memcpy(p, vec_of(indices[i]), f * sizeof(float));
+  memcpy(q, vec_of(indices[j]), f * sizeof(float));
 
   int ic = 1, jc = 1;
   for (int l = 0; l < iteration_steps; l++) {
     size_t k = random.index(count);
-    float di = ic * Distance::distance(p, nodes[k]->v.get(), f);
-    float dj = jc * Distance::distance(q, nodes[k]->v.get(), f);
+    const float* vk = vec_of(indices[k]);
+    float di = ic * Distance::distance(p, vk, f);
+    float dj = jc * Distance::distance(q, vk, f);
     float norm = 1;
     if (!(norm > float(0))) {
       continue;
     }
     if (di < dj) {
       for (int z = 0; z < f; z++)
-        p[z] = (p[z] * ic + nodes[k]->v[z] / norm) / (ic + 1);
+        p[z] = (p[z] * ic + vk[z] / norm) / (ic + 1);
       ic++;
     } else if (dj < di) {
       for (int z = 0; z < f; z++)
-        q[z] = (q[z] * jc + nodes[k]->v[z] / norm) / (jc + 1);
+        q[z] = (q[z] * jc + vk[z] / norm) / (jc + 1);
       jc++;
     }
   }
 }
 
-// DRAM版本的节点定义
-// 选手需要修改成基于持久内存的定义
-// sizeof(VNode)=32
-struct VNode {
-  int left = -1;
-  int right = -1;
-  // float* v;
-  persistent_ptr<float[]> v;
-  float alpha; // need an extra constant term to determine the offset of the plane
-};
-
-struct MemNode {
-  int origin;  // origin pmem_node id
-  int left = -1;
-  int right = -1;
-  float* v;
-  float alpha; // need an extra constant term to determine the offset of the plane
-};
-
-typedef VNode Node;
-
 class Euclidean {
  public:
-  static float margin(const Node* xn, const float* y, int f) {
-    return xn->alpha + dot(xn->v.get(), y, f);
+  Euclidean() = default;
+  explicit Euclidean(uint32_t seed) : random_(seed) {}
+
+  Random& random() {
+    return random_;
+  }
+
+  // xv 为节点 xn 的向量
+  static float margin(const Node* xn, const float* xv, const float* y, int f) {
+    return distance_kernels().margin(xv, xn->alpha, y, f);
   }
 
   static float margin_mem(const MemNode* xn, const float* y, int f) {
-    return xn->alpha + dot(xn->v, y, f);
+    return distance_kernels().margin(xn->v(), xn->alpha, y, f);
+  }
+
+  // 同一个节点对 n 个 query 计算 margin, 结果与 margin_mem 一致
+  static void margin_mem_batch(const MemNode* xn, const float* const* ys, int n, int f, float* out) {
+    dot_batch(xn->v(), ys, n, f, out);
+    for (int i = 0; i < n; i++)
+      out[i] = xn->alpha + out[i];
   }
 
-  bool side(const Node* xn, const float* y, int f) {
-    float dot = margin(xn, y, f);
+  // int8 近似 margin, 并给出误差上界 bound: 若 |approx| > bound, 则 approx 与 margin_mem 同号
+  // 量化误差: |v·y - sv*sy*(qv·qy)| <= (sy * Σ|sv*qv| + sv * Σ|y|) / 2,
+  // 另外加上 fp32 margin 本身的舍入误差, 保证判定与 fp32 的计算结果一致
+  static float margin_mem_quant(const MemNode* xn, const QuantQuery& y, int f, int fq, float& bound) {
+    const int32_t d = distance_kernels().dot_i8(xn->qv(), y.q, fq);
+    const float approx = xn->alpha + xn->scale * y.scale * (float)d;
+    const float quant_err = 0.5f * (y.scale * xn->l1 + xn->scale * y.l1);
+    const float round_err = (std::fabs(xn->alpha) + 127 * xn->scale * y.l1) * (f / 32 + 8) * std::numeric_limits<float>::epsilon();
+    bound = (quant_err + round_err) * 1.01f;
+    return approx;
+  }
+
+  bool side(const Node* xn, const float* xv, const float* y, int f) {
+    float dot = margin(xn, xv, y, f);
+    return (dot > 0);
+  }
+
+  // 以 DRAM 中的 hyperplane (v, alpha) 判断 y 所在的一侧, 与 side(Node*) 结果一致
+  bool side(const float* v, float alpha, const float* y, int f) {
+    float dot = distance_kernels().margin(v, alpha, y, f);
     return (dot > 0);
   }
 
@@ -188,18 +226,35 @@ class Euclidean {
     return euclidean_distance(x, y, f);
   }
 
-  void create_hyperplane(const std::vector<Node*>& nodes, int f, Node* hyperplane) {
+  // 由 vec_of(indices[0..count)) 计算划分的 hyperplane, 结果写入 DRAM 中的 v 和 alpha
+  template <typename VecOf>
+  void create_hyperplane(const VecOf& vec_of, const int* indices, size_t count, int f, float* v, float& alpha) {
     float* p = (float*)alloc_stack(f * sizeof(float));
     float* q = (float*)alloc_stack(f * sizeof(float));
 
-    two_means<Node*, Euclidean>(nodes, f, random_, p, q);
+    two_means<Euclidean>(vec_of, indices, count, f, random_, p, q);
     for (int z = 0; z < f; z++) {
-      hyperplane->v[z] = p[z] - q[z];
+      v[z] = p[z] - q[z];
+    }
+    normalize(v, f);
+    alpha = 0.0;
+    for (int z = 0; z < f; z++)
+      alpha += -v[z] * (p[z] + q[z]) / 2;
+  }
+
+  // a 与 b 的垂直平分面, a 在右侧(margin > 0), b 在左侧; 两者相同时返回 false
+  static bool bisector(const float* a, const float* b, int f, float* v, float& alpha) {
+    for (int z = 0; z < f; z++) {
+      v[z] = a[z] - b[z];
+    }
+    if (!(get_norm(v, f) > 0)) {
+      return false;
     }
-    normalize(hyperplane->v.get(), f);
-    hyperplane->alpha = 0.0;
+    normalize(v, f);
+    alpha = 0.0;
     for (int z = 0; z < f; z++)
-      hyperplane->alpha += -hyperplane->v[z] * (p[z] + q[z]) / 2;
+      alpha += -v[z] * (a[z] + b[z]) / 2;
+    return true;
   }
 
   static float normalized_distance(float distance) {
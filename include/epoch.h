@@ -0,0 +1,171 @@
+#pragma once
+
+// 基于 epoch 的内存回收 (RCU 风格)
+//
+// 读者用 EpochGuard 包住一次读取: 进入时把当前的全局 epoch 写到自己的槽位, 离开时清零,
+// 两者都只是一次原子写, 读者之间互不等待, 也从不等待写者。
+// 写者把旧对象从共享指针上摘下以后调用 retire(): 对象记下当时的 epoch, 全局 epoch 加一,
+// 等到所有仍在读的槽位的 epoch 都比它新(这些读者不可能再拿到旧对象)时才真正释放。
+//
+// 整个进程共用一个 EpochDomain (epoch_domain()), 每个线程第一次读取时占用一个槽位, 线程退出时归还。
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class EpochDomain {
+ public:
+  static const int MAX_READERS = 1024;
+
+  // 当前线程开始读取; 可以嵌套, 只有最外层生效
+  void enter() {
+    Local& local = local_state();
+    if (local.depth++ > 0) {
+      return;
+    }
+    if (local.slot < 0) {
+      local.slot = acquire_slot();
+    }
+    // seq_cst: 写者在这之后读取槽位时一定能看到这次写入, 或者读者一定能看到写者换上的新指针
+    slots_[local.slot].epoch.store(epoch_.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+  }
+
+  void exit() {
+    Local& local = local_state();
+    if (--local.depth > 0) {
+      return;
+    }
+    slots_[local.slot].epoch.store(0, std::memory_order_release);
+  }
+
+  // 旧对象已经从共享指针上摘下, 等所有可能还在读它的读者离开之后调用 deleter
+  void retire(std::function<void()> deleter) {
+    std::vector<std::function<void()>> ready;
+    {
+      std::lock_guard<std::mutex> lock(retired_mutex_);
+      retired_.push_back({epoch_.fetch_add(1, std::memory_order_seq_cst), std::move(deleter)});
+      collect(ready);
+    }
+    for (auto& fn : ready) {
+      fn();
+    }
+  }
+
+  // 等待宽限期: 调用之前已经开始的读取全部结束, 然后执行所有已经可以执行的 deleter
+  void synchronize() {
+    const uint64_t target = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+    for (int i = 0; i < MAX_READERS; i++) {
+      while (true) {
+        const uint64_t e = slots_[i].epoch.load(std::memory_order_acquire);
+        if (e == 0 || e >= target) {
+          break;
+        }
+        std::this_thread::yield();
+      }
+    }
+    std::vector<std::function<void()>> ready;
+    {
+      std::lock_guard<std::mutex> lock(retired_mutex_);
+      collect(ready);
+    }
+    for (auto& fn : ready) {
+      fn();
+    }
+  }
+
+  // 尚未释放的对象数
+  size_t pending() {
+    std::lock_guard<std::mutex> lock(retired_mutex_);
+    return retired_.size();
+  }
+
+ private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{0};  // 0 表示没有在读
+    std::atomic<bool> used{false};
+  };
+
+  struct Retired {
+    uint64_t epoch;
+    std::function<void()> deleter;
+  };
+
+  // 线程退出时归还槽位
+  struct Local {
+    EpochDomain* domain = nullptr;
+    int slot = -1;
+    int depth = 0;
+    ~Local() {
+      if (slot >= 0) {
+        domain->slots_[slot].epoch.store(0, std::memory_order_release);
+        domain->slots_[slot].used.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  Local& local_state() {
+    static thread_local Local local;
+    local.domain = this;
+    return local;
+  }
+
+  int acquire_slot() {
+    while (true) {
+      for (int i = 0; i < MAX_READERS; i++) {
+        bool expected = false;
+        if (!slots_[i].used.load(std::memory_order_relaxed) &&
+            slots_[i].used.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+          return i;
+        }
+      }
+      // 同时读取的线程超过 MAX_READERS 时等待别的线程退出
+      std::this_thread::yield();
+    }
+  }
+
+  // 把所有读者都已经离开的对象移到 ready 中, 调用者持有 retired_mutex_
+  void collect(std::vector<std::function<void()>>& ready) {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < MAX_READERS; i++) {
+      const uint64_t e = slots_[i].epoch.load(std::memory_order_seq_cst);
+      if (e != 0 && e < oldest) {
+        oldest = e;
+      }
+    }
+    size_t kept = 0;
+    for (auto& r : retired_) {
+      if (r.epoch < oldest) {
+        ready.push_back(std::move(r.deleter));
+      } else {
+        retired_[kept++] = std::move(r);
+      }
+    }
+    retired_.resize(kept);
+  }
+
+  std::atomic<uint64_t> epoch_{1};
+  Slot slots_[MAX_READERS];
+  std::mutex retired_mutex_;  // 只有写者使用
+  std::vector<Retired> retired_;
+};
+
+inline EpochDomain& epoch_domain() {
+  static EpochDomain domain;
+  return domain;
+}
+
+// 作用域内的读取受 epoch 保护
+class EpochGuard {
+ public:
+  EpochGuard() {
+    epoch_domain().enter();
+  }
+  ~EpochGuard() {
+    epoch_domain().exit();
+  }
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator=(const EpochGuard&) = delete;
+};
@@ -0,0 +1,243 @@
+#pragma once
+
+// item 向量的 hash -> item id
+//
+// 开放寻址 + 线性探测的扁平表, 所有条目放在一块连续的数组里,
+// 因此可以整块写入 pool, 重新打开时整块读回, 不需要逐条插入。
+// 表按 key 的最高 shard_bits 位分成 2^shard_bits 个等长的 shard, 探测只在 shard 内回绕,
+// 不同 shard 互不相交, build() 可以让多个线程同时各建一部分。
+// 查询时多个线程并发 find 不需要加锁; 建好以后还可以由单个写者 insert_if_absent,
+// 条目先写 value 再以 release 写 key, 同时进行的 find 要么看不到它, 要么看到完整的条目。
+// 扩容会重新分配数组, 不能与 find 同时进行: 写者先用 has_room 检查, 不够时在副本上 reserve 后替换。
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+class ExactTable {
+ public:
+  struct Entry {
+    uint64_t key;  // 0 表示空位
+    int32_t value;
+    int32_t pad;
+  };
+
+  // 单个 shard 的条目数不超过该值时不再细分
+  static const size_t SHARD_TARGET = 1 << 14;
+  static const int MAX_SHARD_BITS = 10;
+
+  // 预留能容纳 n 个条目的空间(负载因子不超过 1/2), 清空已有条目
+  void reset(size_t n) {
+    shard_bits_ = 0;
+    alloc(round_up_pow2(std::max<size_t>(16, 2 * n)));
+    size_ = 0;
+  }
+
+  // 以 keys[i] -> i 建表, key 重复时保留最小的 i
+  // 1. 按 key 的最高位把下标分到各个 shard (并行计数, 前缀和, 再并行散列; 同一 shard 内的下标保持升序)
+  // 2. 按最大的 shard 预先确定容量, 之后各线程并发建不同的 shard, 不会扩容
+  void build(const uint64_t* keys, size_t n, int n_threads) {
+    int bits = 0;
+    while (bits < MAX_SHARD_BITS && (n >> bits) > SHARD_TARGET) {
+      bits++;
+    }
+    shard_bits_ = bits;
+    const size_t n_shards = (size_t)1 << bits;
+
+    // counts[t * n_shards + s]: 第 t 段中落在 shard s 的数量
+    std::vector<size_t> counts((size_t)n_threads * n_shards, 0);
+    std::vector<size_t> offsets(n_shards + 1, 0);
+    std::vector<uint32_t> order(n);
+#pragma omp parallel num_threads(n_threads)
+    {
+      const int t = omp_get_thread_num();
+      const int nt = omp_get_num_threads();
+      const size_t begin = n * t / nt, end = n * (t + 1) / nt;
+      size_t* c = counts.data() + (size_t)t * n_shards;
+      for (size_t i = begin; i < end; i++) {
+        c[shard_of(normalize(keys[i]))]++;
+      }
+#pragma omp barrier
+#pragma omp single
+      {
+        // 依次为 shard 0 的第 0..nt-1 段, shard 1 的第 0..nt-1 段 ... 分配位置
+        size_t pos = 0;
+        for (size_t s = 0; s < n_shards; s++) {
+          offsets[s] = pos;
+          for (int k = 0; k < nt; k++) {
+            size_t cnt = counts[(size_t)k * n_shards + s];
+            counts[(size_t)k * n_shards + s] = pos;
+            pos += cnt;
+          }
+        }
+        offsets[n_shards] = pos;
+      }
+      for (size_t i = begin; i < end; i++) {
+        order[c[shard_of(normalize(keys[i]))]++] = i;
+      }
+    }
+
+    size_t max_count = 0;
+    for (size_t s = 0; s < n_shards; s++) {
+      max_count = std::max(max_count, offsets[s + 1] - offsets[s]);
+    }
+    alloc(round_up_pow2(std::max<size_t>(16, 2 * max_count)) << bits);
+
+    size_t total = 0;
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 1) reduction(+:total)
+    for (long s = 0; s < (long)n_shards; s++) {
+      size_t inserted = 0;
+      for (size_t k = offsets[s]; k < offsets[s + 1]; k++) {
+        const uint32_t i = order[k];
+        inserted += insert_slot(normalize(keys[i]), i);
+      }
+      shard_sizes_[s] = inserted;
+      total += inserted;
+    }
+    size_ = total;
+  }
+
+  // 再插入 n 个条目是否不需要扩容(按最满的 shard 估计)
+  bool has_room(size_t n) const {
+    if (entries_.empty()) {
+      return false;
+    }
+    const size_t fullest = *std::max_element(shard_sizes_.begin(), shard_sizes_.end());
+    return 2 * (fullest + n) <= shard_cap_;
+  }
+
+  // 扩容到 has_room(n) 成立
+  void reserve(size_t n) {
+    while (!has_room(n)) {
+      grow();
+    }
+  }
+
+  // key 不存在时插入并返回 true; 已存在时保留原来的 value, 返回 false
+  // 空间不足时就地扩容, 与并发的 find 同时使用时调用者先保证 has_room
+  bool insert_if_absent(uint64_t key, int value) {
+    key = normalize(key);
+    if (entries_.empty() || 2 * (shard_sizes_[shard_of(key)] + 1) > shard_cap_) {
+      grow();
+    }
+    const bool inserted = insert_slot(key, value);
+    shard_sizes_[shard_of(key)] += inserted;
+    size_ += inserted;
+    return inserted;
+  }
+
+  bool find(uint64_t key, int& value) const {
+    if (entries_.empty()) {
+      return false;
+    }
+    key = normalize(key);
+    const Entry* shard = entries_.data() + shard_of(key) * shard_cap_;
+    for (size_t i = key & shard_mask_;; i = (i + 1) & shard_mask_) {
+      const Entry& e = shard[i];
+      const uint64_t k = __atomic_load_n(&e.key, __ATOMIC_ACQUIRE);
+      if (k == key) {
+        value = e.value;
+        return true;
+      }
+      if (k == 0) {
+        return false;
+      }
+    }
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  size_t capacity() const {
+    return entries_.size();
+  }
+
+  int shard_bits() const {
+    return shard_bits_;
+  }
+
+  const Entry* data() const {
+    return entries_.data();
+  }
+
+  // 从 capacity 个连续的 Entry 恢复, capacity 与 capacity >> shard_bits 都必须是 2 的幂
+  void load(const Entry* entries, size_t capacity, int shard_bits, size_t size) {
+    shard_bits_ = shard_bits;
+    alloc(capacity);
+    memcpy(entries_.data(), entries, capacity * sizeof(Entry));
+    size_ = size;
+    count_shards();
+  }
+
+ private:
+  static uint64_t normalize(uint64_t key) {
+    return key == 0 ? 1 : key;
+  }
+
+  static size_t round_up_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+  size_t shard_of(uint64_t key) const {
+    return shard_bits_ == 0 ? 0 : key >> (64 - shard_bits_);
+  }
+
+  void alloc(size_t capacity) {
+    entries_.assign(capacity, Entry{0, 0, 0});
+    shard_cap_ = capacity >> shard_bits_;
+    shard_mask_ = shard_cap_ - 1;
+    shard_sizes_.assign((size_t)1 << shard_bits_, 0);
+  }
+
+  void count_shards() {
+    for (size_t s = 0; s < shard_sizes_.size(); s++) {
+      size_t n = 0;
+      for (size_t i = 0; i < shard_cap_; i++) {
+        n += entries_[s * shard_cap_ + i].key != 0;
+      }
+      shard_sizes_[s] = n;
+    }
+  }
+
+  // 插入 shard 内, 调用者保证 shard 中还有空位
+  bool insert_slot(uint64_t key, int value) {
+    Entry* shard = entries_.data() + shard_of(key) * shard_cap_;
+    for (size_t i = key & shard_mask_;; i = (i + 1) & shard_mask_) {
+      Entry& e = shard[i];
+      if (e.key == key) {
+        return false;
+      }
+      if (e.key == 0) {
+        e.value = value;
+        __atomic_store_n(&e.key, key, __ATOMIC_RELEASE);
+        return true;
+      }
+    }
+  }
+
+  void grow() {
+    std::vector<Entry> old;
+    old.swap(entries_);
+    alloc(std::max<size_t>(16, 2 * shard_cap_) << shard_bits_);
+    for (const Entry& e : old) {
+      if (e.key != 0) {
+        insert_slot(e.key, e.value);
+      }
+    }
+    count_shards();
+  }
+
+  std::vector<Entry> entries_;
+  int shard_bits_ = 0;
+  size_t shard_cap_ = 0;
+  size_t shard_mask_ = 0;
+  std::vector<size_t> shard_sizes_;  // 每个 shard 的条目数, 逐条插入时据此决定是否扩容
+  size_t size_ = 0;
+};
@@ -0,0 +1,293 @@
+#pragma once
+
+// 查询结果缓存: query 的 hash -> 搜索结果 (item id) 和得到它时可见的 item 数 (watermark)
+//
+// 结果只与 id 小于 watermark 的 item 比较过, 之后插入的 item 由调用者在命中时补充比较。
+// 容量固定的组相联表, 每个 bucket 有 WAYS 个槽位, 满了以后在 bucket 内按 CLOCK 淘汰,
+// 因此无论有多少不同的 query, 占用的内存都不变。
+// 每个 bucket 带一个 seqlock: 写者用 CAS 把序号从偶数改成奇数来独占 bucket, 写完再改回偶数;
+// 读者不加锁, 读取前后序号不变才认为读到的 key/value 是一致的。
+// 不同 bucket 之间互不影响, 读多写少的场景下读者从不阻塞。
+//
+// 缓存可以放在一段外部内存(例如 pmem pool 中的一块区域)中, 见 attach():
+// 区域开头是一个记录 generation 的头部, 重新打开时 generation 一致就直接沿用其中的条目;
+// 写入时依次持久化 奇数序号 -> 条目 -> 偶数序号, 崩溃后序号为奇数的 bucket 会被清空。
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <immintrin.h>
+
+class ResultCache {
+ public:
+  static const int WAYS = 8;
+  static const uint64_t MAGIC = 0x52534c5443414348ULL;  // "RSLTCACH"
+
+  // 持久化外部内存中 [addr, addr + len) 的回调
+  typedef void (*PersistFn)(void* ctx, const void* addr, size_t len);
+
+  // capacity 为缓存的条目数上限(按 WAYS 的倍数向上取到 2 的幂), 0 表示不缓存
+  explicit ResultCache(size_t capacity = 0) {
+    reset(capacity);
+  }
+
+  void reset(size_t capacity) {
+    detach();
+    const size_t n = bucket_count(capacity);
+    if (n == 0) {
+      return;
+    }
+    owned_.reset(new Bucket[n]);
+    buckets_ = owned_.get();
+    n_buckets_ = n;
+  }
+
+  // 存放 capacity 个条目的外部区域需要的字节数(区域起始地址需要 64 字节对齐)
+  static size_t region_size(size_t capacity) {
+    return sizeof(Header) + bucket_count(capacity) * sizeof(Bucket);
+  }
+
+  // 使用外部区域 region (全零或之前 attach 过的内容) 作为存储, 之后的写入通过 persist 持久化
+  // 区域中的 generation 与参数一致时保留已有条目(只清空写到一半的 bucket), 否则清空后以新的 generation 重新开始
+  // 返回是否沿用了已有的条目
+  bool attach(void* region, size_t capacity, uint64_t generation, PersistFn persist, void* ctx) {
+    detach();
+    header_ = reinterpret_cast<Header*>(region);
+    buckets_ = reinterpret_cast<Bucket*>(header_ + 1);
+    persist_ = persist;
+    persist_ctx_ = ctx;
+
+    const size_t n = bucket_count(capacity);
+    if (header_->magic == MAGIC && header_->n_buckets != 0 && n != 0) {
+      // 区域的大小在创建时已经固定, 以区域中记录的为准
+      n_buckets_ = header_->n_buckets;
+      if (header_->generation == generation) {
+        recover();
+        return true;
+      }
+    } else {
+      n_buckets_ = n;
+    }
+    header_->magic = 0;
+    do_persist(header_, sizeof(Header));
+    clear();
+    header_->n_buckets = n_buckets_;
+    header_->generation = generation;
+    do_persist(header_, sizeof(Header));
+    header_->magic = MAGIC;
+    do_persist(header_, sizeof(Header));
+    return false;
+  }
+
+  // 索引重建后调用: 丢弃所有条目, 记录新的 generation
+  void set_generation(uint64_t generation) {
+    clear();
+    if (header_ != nullptr) {
+      header_->generation = generation;
+      do_persist(header_, sizeof(Header));
+    }
+  }
+
+  uint64_t generation() const {
+    return header_ != nullptr ? header_->generation : 0;
+  }
+
+  size_t capacity() const {
+    return n_buckets_ * WAYS;
+  }
+
+  // 命中时写入 value 和 watermark 并返回 true
+  bool find(uint64_t key, int& value, int& watermark) const {
+    if (n_buckets_ == 0) {
+      return false;
+    }
+    key = normalize(key);
+    const Bucket& b = bucket(key);
+    for (int retry = 0; retry < 4; retry++) {
+      const uint32_t s1 = b.seq.load(std::memory_order_acquire);
+      if (s1 & 1) {
+        // 正在被写, 当作未命中, 不等待
+        return false;
+      }
+      int way = -1;
+      int v = 0;
+      int w = 0;
+      for (int i = 0; i < WAYS; i++) {
+        if (b.keys[i].load(std::memory_order_relaxed) == key) {
+          way = i;
+          v = b.values[i].load(std::memory_order_relaxed);
+          w = b.watermarks[i].load(std::memory_order_relaxed);
+          break;
+        }
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (b.seq.load(std::memory_order_relaxed) != s1) {
+        continue;
+      }
+      if (way < 0) {
+        return false;
+      }
+      // CLOCK 的访问位, 已经置位时不再写, 避免热点 bucket 的 cache line 来回失效
+      const uint8_t bit = 1 << way;
+      if (!(b.ref.load(std::memory_order_relaxed) & bit)) {
+        b.ref.fetch_or(bit, std::memory_order_relaxed);
+      }
+      value = v;
+      watermark = w;
+      return true;
+    }
+    return false;
+  }
+
+  void insert(uint64_t key, int value, int watermark) {
+    if (n_buckets_ == 0) {
+      return;
+    }
+    key = normalize(key);
+    Bucket& b = bucket(key);
+    const uint32_t s = lock(b);
+    do_persist(&b.seq, sizeof(b.seq));
+
+    int way = -1;
+    for (int i = 0; i < WAYS; i++) {
+      const uint64_t k = b.keys[i].load(std::memory_order_relaxed);
+      if (k == key || k == 0) {
+        way = i;
+        break;
+      }
+    }
+    if (way < 0) {
+      // CLOCK: 跳过并清除最近访问过的槽位, 淘汰第一个未被访问的
+      uint8_t ref = b.ref.load(std::memory_order_relaxed);
+      while (ref & (1 << b.hand)) {
+        ref &= ~(1 << b.hand);
+        b.hand = (b.hand + 1) % WAYS;
+      }
+      way = b.hand;
+      b.hand = (b.hand + 1) % WAYS;
+      b.ref.store(ref, std::memory_order_relaxed);
+    }
+    b.keys[way].store(key, std::memory_order_relaxed);
+    b.values[way].store(value, std::memory_order_relaxed);
+    b.watermarks[way].store(watermark, std::memory_order_relaxed);
+    b.ref.fetch_and(~(1 << way), std::memory_order_relaxed);
+    do_persist(&b, sizeof(Bucket));
+
+    b.seq.store(s + 2, std::memory_order_release);
+    do_persist(&b.seq, sizeof(b.seq));
+  }
+
+  // 当前缓存的条目数, 只用于统计
+  size_t size() const {
+    size_t n = 0;
+    for (size_t i = 0; i < n_buckets_; i++) {
+      for (int w = 0; w < WAYS; w++) {
+        n += buckets_[i].keys[w].load(std::memory_order_relaxed) != 0;
+      }
+    }
+    return n;
+  }
+
+  void clear() {
+    for (size_t i = 0; i < n_buckets_; i++) {
+      Bucket& b = buckets_[i];
+      const uint32_t s = lock(b);
+      for (int w = 0; w < WAYS; w++) {
+        b.keys[w].store(0, std::memory_order_relaxed);
+      }
+      b.ref.store(0, std::memory_order_relaxed);
+      b.seq.store(s + 2, std::memory_order_release);
+    }
+    do_persist(buckets_, n_buckets_ * sizeof(Bucket));
+  }
+
+ private:
+  struct alignas(64) Header {
+    uint64_t magic;
+    uint64_t generation;
+    uint64_t n_buckets;
+  };
+
+  // key 为 0 表示空槽位
+  struct alignas(64) Bucket {
+    std::atomic<uint32_t> seq{0};
+    mutable std::atomic<uint8_t> ref{0};  // CLOCK 访问位, 查找时也会置位
+    uint8_t hand = 0;  // CLOCK 指针, 只在持有 bucket 时修改
+    std::atomic<uint64_t> keys[WAYS] = {};
+    std::atomic<int32_t> values[WAYS] = {};
+    std::atomic<int32_t> watermarks[WAYS] = {};
+  };
+
+  static size_t bucket_count(size_t capacity) {
+    if (capacity == 0) {
+      return 0;
+    }
+    size_t n = 1;
+    while (n * WAYS < capacity) {
+      n <<= 1;
+    }
+    return n;
+  }
+
+  void detach() {
+    owned_.reset();
+    buckets_ = nullptr;
+    header_ = nullptr;
+    n_buckets_ = 0;
+    persist_ = nullptr;
+    persist_ctx_ = nullptr;
+  }
+
+  void do_persist(const void* addr, size_t len) {
+    if (persist_ != nullptr) {
+      persist_(persist_ctx_, addr, len);
+    }
+  }
+
+  // 重新打开外部区域: 序号为奇数的 bucket 在写入过程中崩溃, 内容不可信, 整个清空
+  void recover() {
+    for (size_t i = 0; i < n_buckets_; i++) {
+      Bucket& b = buckets_[i];
+      const uint32_t s = b.seq.load(std::memory_order_relaxed);
+      if (s & 1) {
+        for (int w = 0; w < WAYS; w++) {
+          b.keys[w].store(0, std::memory_order_relaxed);
+        }
+        b.seq.store(s + 1, std::memory_order_relaxed);
+        do_persist(&b, sizeof(Bucket));
+      }
+      b.ref.store(0, std::memory_order_relaxed);
+      b.hand = 0;
+    }
+  }
+
+  static uint64_t normalize(uint64_t key) {
+    return key == 0 ? 1 : key;
+  }
+
+  // bucket 下标取 key 的高位, 与 hash 表内部使用低位的其他结构错开
+  Bucket& bucket(uint64_t key) const {
+    return buckets_[(key >> 32) & (n_buckets_ - 1)];
+  }
+
+  // 独占 bucket, 返回进入前的(偶数)序号
+  static uint32_t lock(Bucket& b) {
+    uint32_t s = b.seq.load(std::memory_order_relaxed);
+    for (;;) {
+      if (!(s & 1) && b.seq.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+        break;
+      }
+      _mm_pause();
+      s = b.seq.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    return s;
+  }
+
+  size_t n_buckets_ = 0;
+  Bucket* buckets_ = nullptr;
+  std::unique_ptr<Bucket[]> owned_;  // 不使用外部区域时的存储
+  Header* header_ = nullptr;
+  PersistFn persist_ = nullptr;
+  void* persist_ctx_ = nullptr;
+};
@@ -0,0 +1,383 @@
+#pragma once
+
+// dot / squared-L2 / margin 的 SIMD 实现, 启动时通过 CPUID 选择一次, 不依赖 -march=native
+//
+// 所有实现共用同一种累加顺序: 第 i 个分量累加到 32 个部分和中的第 i % 32 个(fma),
+// 最后按固定的树形顺序归约。因此 scalar / AVX2 / AVX-512 的结果逐位相同,
+// 同一个索引在不同的机器上下降路径一致。
+// 维度不是 32 的倍数时, 尾部用 mask 读取, 被 mask 掉的分量不影响部分和。
+//
+// 环境变量 VEC_SEARCH_SIMD=scalar|avx2|avx512 可以强制使用指定的实现(不支持时退回自动选择)
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+
+struct DistanceKernels {
+  const char* name;
+  float (*dot)(const float* x, const float* y, int f);
+  float (*l2)(const float* x, const float* y, int f);  // squared euclidean distance
+  float (*margin)(const float* v, float alpha, const float* y, int f);  // alpha + dot(v, y)
+  // ys 中 n 个向量分别与 x 做点积, x 只读取一次
+  void (*dot_batch)(const float* x, const float* const* ys, int n, int f, float* out);
+  // int8 点积, 分量取值 [-127, 127], f 为 QUANT_ALIGN 的倍数(不足的部分补 0)
+  int32_t (*dot_i8)(const int8_t* x, const int8_t* y, int f);
+  // 把 src 的 n_lines * 64 字节拷贝到 64 字节对齐的 dst; SIMD 版本使用 non-temporal store 绕过 cache,
+  // 调用者在全部写完后执行一次 _mm_sfence 再持久化
+  void (*stream_lines)(void* dst, const void* src, size_t n_lines);
+};
+
+const int QUANT_ALIGN = 64;
+
+/******************************* scalar *******************************/
+
+// 32 个部分和的归约顺序, 与 AVX2 版本的 _mm256 归约一致
+inline float reduce32(const float* acc) {
+  float s8[8];
+  for (int k = 0; k < 8; k++)
+    s8[k] = (acc[k] + acc[8 + k]) + (acc[16 + k] + acc[24 + k]);
+  float r4[4];
+  for (int k = 0; k < 4; k++)
+    r4[k] = s8[k] + s8[4 + k];
+  return (r4[0] + r4[2]) + (r4[1] + r4[3]);
+}
+
+template <bool L2>
+inline float scalar_kernel(const float* x, const float* y, int f) {
+  float acc[32] = {0};
+  for (int i = 0; i < f; i++) {
+    if (L2) {
+      const float d = x[i] - y[i];
+      acc[i & 31] = std::fma(d, d, acc[i & 31]);
+    } else {
+      acc[i & 31] = std::fma(x[i], y[i], acc[i & 31]);
+    }
+  }
+  return reduce32(acc);
+}
+
+inline float scalar_dot(const float* x, const float* y, int f) {
+  return scalar_kernel<false>(x, y, f);
+}
+
+inline float scalar_l2(const float* x, const float* y, int f) {
+  return scalar_kernel<true>(x, y, f);
+}
+
+inline float scalar_margin(const float* v, float alpha, const float* y, int f) {
+  return alpha + scalar_kernel<false>(v, y, f);
+}
+
+inline void scalar_dot_batch(const float* x, const float* const* ys, int n, int f, float* out) {
+  for (int i = 0; i < n; i++)
+    out[i] = scalar_kernel<false>(x, ys[i], f);
+}
+
+inline int32_t scalar_dot_i8(const int8_t* x, const int8_t* y, int f) {
+  int32_t s = 0;
+  for (int i = 0; i < f; i++)
+    s += (int32_t)x[i] * y[i];
+  return s;
+}
+
+inline void scalar_stream_lines(void* dst, const void* src, size_t n_lines) {
+  memcpy(dst, src, n_lines * 64);
+}
+
+/******************************* AVX2 *******************************/
+
+#define VEC_TARGET_AVX2 __attribute__((target("avx2,fma")))
+
+VEC_TARGET_AVX2 inline float avx2_reduce(__m256 d0, __m256 d1, __m256 d2, __m256 d3) {
+  const __m256 dot01 = _mm256_add_ps( d0, d1 );
+  const __m256 dot23 = _mm256_add_ps( d2, d3 );
+  const __m256 dot0123 = _mm256_add_ps( dot01, dot23 );
+
+  const __m128 r4 = _mm_add_ps( _mm256_castps256_ps128( dot0123 ), _mm256_extractf128_ps( dot0123, 1 ) );
+  const __m128 r2 = _mm_add_ps( r4, _mm_movehl_ps( r4, r4 ) );
+  const __m128 r1 = _mm_add_ss( r2, _mm_movehdup_ps( r2 ) );
+  return _mm_cvtss_f32( r1 );
+}
+
+// 前 rem 个 lane 为全1的 mask, rem 超出 [0, 8] 时按边界截断
+VEC_TARGET_AVX2 inline __m256i avx2_tail_mask(int rem) {
+  const __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32(rem), idx);
+}
+
+template <bool L2>
+VEC_TARGET_AVX2 inline __m256 avx2_step(__m256 acc, __m256 a, __m256 b) {
+  if (L2) {
+    const __m256 d = _mm256_sub_ps(a, b);
+    return _mm256_fmadd_ps(d, d, acc);
+  }
+  return _mm256_fmadd_ps(a, b, acc);
+}
+
+template <bool L2>
+VEC_TARGET_AVX2 inline float avx2_kernel(const float* x, const float* y, int f) {
+  __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+  int i = 0;
+  for (; i + 32 <= f; i += 32) {
+    for (int j = 0; j < 4; j++)
+      acc[j] = avx2_step<L2>(acc[j], _mm256_loadu_ps(x + i + 8 * j), _mm256_loadu_ps(y + i + 8 * j));
+  }
+  for (int j = 0; i + 8 * j < f; j++) {
+    const __m256i m = avx2_tail_mask(f - i - 8 * j);
+    acc[j] = avx2_step<L2>(acc[j], _mm256_maskload_ps(x + i + 8 * j, m), _mm256_maskload_ps(y + i + 8 * j, m));
+  }
+  return avx2_reduce(acc[0], acc[1], acc[2], acc[3]);
+}
+
+// 一个 x 同时与 Q 个 y 做点积, 每个 y 的累加顺序与 avx2_kernel 一致
+template <int Q>
+VEC_TARGET_AVX2 inline void avx2_dot_multi(const float* x, const float* const* ys, int f, float* out) {
+  __m256 acc[Q][4];
+  for (int q = 0; q < Q; q++)
+    for (int j = 0; j < 4; j++)
+      acc[q][j] = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 32 <= f; i += 32) {
+    for (int j = 0; j < 4; j++) {
+      const __m256 a = _mm256_loadu_ps(x + i + 8 * j);
+      for (int q = 0; q < Q; q++)
+        acc[q][j] = _mm256_fmadd_ps(a, _mm256_loadu_ps(ys[q] + i + 8 * j), acc[q][j]);
+    }
+  }
+  for (int j = 0; i + 8 * j < f; j++) {
+    const __m256i m = avx2_tail_mask(f - i - 8 * j);
+    const __m256 a = _mm256_maskload_ps(x + i + 8 * j, m);
+    for (int q = 0; q < Q; q++)
+      acc[q][j] = _mm256_fmadd_ps(a, _mm256_maskload_ps(ys[q] + i + 8 * j, m), acc[q][j]);
+  }
+  for (int q = 0; q < Q; q++)
+    out[q] = avx2_reduce(acc[q][0], acc[q][1], acc[q][2], acc[q][3]);
+}
+
+VEC_TARGET_AVX2 inline float avx2_dot(const float* x, const float* y, int f) {
+  return avx2_kernel<false>(x, y, f);
+}
+
+VEC_TARGET_AVX2 inline float avx2_l2(const float* x, const float* y, int f) {
+  return avx2_kernel<true>(x, y, f);
+}
+
+VEC_TARGET_AVX2 inline float avx2_margin(const float* v, float alpha, const float* y, int f) {
+  return alpha + avx2_kernel<false>(v, y, f);
+}
+
+VEC_TARGET_AVX2 inline void avx2_dot_batch(const float* x, const float* const* ys, int n, int f, float* out) {
+  int i = 0;
+  for (; i + 2 <= n; i += 2)
+    avx2_dot_multi<2>(x, ys + i, f, out + i);
+  if (i < n)
+    out[i] = avx2_kernel<false>(x, ys[i], f);
+}
+
+// maddubs 要求第一个操作数为无符号数: |x| * (sign(x) * y), 分量不含 -128 时两两相加不会饱和
+VEC_TARGET_AVX2 inline int32_t avx2_dot_i8(const int8_t* x, const int8_t* y, int f) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc = _mm256_setzero_si256();
+  for (int i = 0; i < f; i += 32) {
+    const __m256i a = _mm256_loadu_si256((const __m256i*)(x + i));
+    const __m256i b = _mm256_loadu_si256((const __m256i*)(y + i));
+    const __m256i p16 = _mm256_maddubs_epi16(_mm256_sign_epi8(a, a), _mm256_sign_epi8(b, a));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p16, ones));
+  }
+  const __m128i r4 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  const __m128i r2 = _mm_add_epi32(r4, _mm_unpackhi_epi64(r4, r4));
+  const __m128i r1 = _mm_add_epi32(r2, _mm_shuffle_epi32(r2, 1));
+  return _mm_cvtsi128_si32(r1);
+}
+
+VEC_TARGET_AVX2 inline void avx2_stream_lines(void* dst, const void* src, size_t n_lines) {
+  __m256i* d = reinterpret_cast<__m256i*>(dst);
+  const __m256i* s = reinterpret_cast<const __m256i*>(src);
+  for (size_t i = 0; i < 2 * n_lines; i += 2) {
+    _mm256_stream_si256(d + i, _mm256_loadu_si256(s + i));
+    _mm256_stream_si256(d + i + 1, _mm256_loadu_si256(s + i + 1));
+  }
+}
+
+/******************************* AVX-512 *******************************/
+
+#define VEC_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+
+// 两个 zmm 部分和依次对应 AVX2 版本的 4 个 ymm 部分和
+VEC_TARGET_AVX512 inline float avx512_reduce(__m512 acc0, __m512 acc1) {
+  const __m256 d0 = _mm512_castps512_ps256(acc0);
+  const __m256 d1 = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(acc0), 1));
+  const __m256 d2 = _mm512_castps512_ps256(acc1);
+  const __m256 d3 = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(acc1), 1));
+  return avx2_reduce(d0, d1, d2, d3);
+}
+
+template <bool L2>
+VEC_TARGET_AVX512 inline __m512 avx512_step(__m512 acc, __m512 a, __m512 b) {
+  if (L2) {
+    const __m512 d = _mm512_sub_ps(a, b);
+    return _mm512_fmadd_ps(d, d, acc);
+  }
+  return _mm512_fmadd_ps(a, b, acc);
+}
+
+// 尾部 rem (0 < rem < 32) 个分量对应的两个 16 lane mask
+inline void avx512_tail_masks(int rem, __mmask16& m0, __mmask16& m1) {
+  m0 = rem >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << rem) - 1);
+  m1 = rem > 16 ? (__mmask16)((1u << (rem - 16)) - 1) : (__mmask16)0;
+}
+
+template <bool L2>
+VEC_TARGET_AVX512 inline float avx512_kernel(const float* x, const float* y, int f) {
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 32 <= f; i += 32) {
+    acc0 = avx512_step<L2>(acc0, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+    acc1 = avx512_step<L2>(acc1, _mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16));
+  }
+  if (i < f) {
+    __mmask16 m0, m1;
+    avx512_tail_masks(f - i, m0, m1);
+    acc0 = avx512_step<L2>(acc0, _mm512_maskz_loadu_ps(m0, x + i), _mm512_maskz_loadu_ps(m0, y + i));
+    acc1 = avx512_step<L2>(acc1, _mm512_maskz_loadu_ps(m1, x + i + 16), _mm512_maskz_loadu_ps(m1, y + i + 16));
+  }
+  return avx512_reduce(acc0, acc1);
+}
+
+template <int Q>
+VEC_TARGET_AVX512 inline void avx512_dot_multi(const float* x, const float* const* ys, int f, float* out) {
+  __m512 acc[Q][2];
+  for (int q = 0; q < Q; q++) {
+    acc[q][0] = _mm512_setzero_ps();
+    acc[q][1] = _mm512_setzero_ps();
+  }
+  int i = 0;
+  for (; i + 32 <= f; i += 32) {
+    const __m512 a0 = _mm512_loadu_ps(x + i);
+    const __m512 a1 = _mm512_loadu_ps(x + i + 16);
+    for (int q = 0; q < Q; q++) {
+      acc[q][0] = _mm512_fmadd_ps(a0, _mm512_loadu_ps(ys[q] + i), acc[q][0]);
+      acc[q][1] = _mm512_fmadd_ps(a1, _mm512_loadu_ps(ys[q] + i + 16), acc[q][1]);
+    }
+  }
+  if (i < f) {
+    __mmask16 m0, m1;
+    avx512_tail_masks(f - i, m0, m1);
+    const __m512 a0 = _mm512_maskz_loadu_ps(m0, x + i);
+    const __m512 a1 = _mm512_maskz_loadu_ps(m1, x + i + 16);
+    for (int q = 0; q < Q; q++) {
+      acc[q][0] = _mm512_fmadd_ps(a0, _mm512_maskz_loadu_ps(m0, ys[q] + i), acc[q][0]);
+      acc[q][1] = _mm512_fmadd_ps(a1, _mm512_maskz_loadu_ps(m1, ys[q] + i + 16), acc[q][1]);
+    }
+  }
+  for (int q = 0; q < Q; q++)
+    out[q] = avx512_reduce(acc[q][0], acc[q][1]);
+}
+
+VEC_TARGET_AVX512 inline float avx512_dot(const float* x, const float* y, int f) {
+  return avx512_kernel<false>(x, y, f);
+}
+
+VEC_TARGET_AVX512 inline float avx512_l2(const float* x, const float* y, int f) {
+  return avx512_kernel<true>(x, y, f);
+}
+
+VEC_TARGET_AVX512 inline float avx512_margin(const float* v, float alpha, const float* y, int f) {
+  return alpha + avx512_kernel<false>(v, y, f);
+}
+
+VEC_TARGET_AVX512 inline void avx512_dot_batch(const float* x, const float* const* ys, int n, int f, float* out) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    avx512_dot_multi<4>(x, ys + i, f, out + i);
+  for (; i + 2 <= n; i += 2)
+    avx512_dot_multi<2>(x, ys + i, f, out + i);
+  if (i < n)
+    out[i] = avx512_kernel<false>(x, ys[i], f);
+}
+
+VEC_TARGET_AVX512 inline void avx512_stream_lines(void* dst, const void* src, size_t n_lines) {
+  char* d = reinterpret_cast<char*>(dst);
+  const char* s = reinterpret_cast<const char*>(src);
+  for (size_t i = 0; i < n_lines; i++) {
+    _mm512_stream_si512(reinterpret_cast<__m512i*>(d + i * 64), _mm512_loadu_si512(s + i * 64));
+  }
+}
+
+#define VEC_TARGET_AVX512_VNNI __attribute__((target("avx512f,avx512bw,avx512vnni")))
+
+// vpdpbusd 同样是 无符号 * 有符号, 做法与 avx2_dot_i8 相同
+VEC_TARGET_AVX512_VNNI inline int32_t avx512_vnni_dot_i8(const int8_t* x, const int8_t* y, int f) {
+  const __m512i zero = _mm512_setzero_si512();
+  __m512i acc = _mm512_setzero_si512();
+  for (int i = 0; i < f; i += 64) {
+    const __m512i a = _mm512_loadu_si512((const void*)(x + i));
+    const __m512i b = _mm512_loadu_si512((const void*)(y + i));
+    const __mmask64 neg = _mm512_movepi8_mask(a);
+    acc = _mm512_dpbusd_epi32(acc, _mm512_abs_epi8(a), _mm512_mask_sub_epi8(b, neg, zero, b));
+  }
+  return _mm512_reduce_add_epi32(acc);
+}
+
+/******************************* dispatch *******************************/
+
+inline const DistanceKernels& scalar_kernels() {
+  static const DistanceKernels k = {"scalar", scalar_dot, scalar_l2, scalar_margin, scalar_dot_batch, scalar_dot_i8,
+                                    scalar_stream_lines};
+  return k;
+}
+
+inline const DistanceKernels& avx2_kernels() {
+  static const DistanceKernels k = {"avx2", avx2_dot, avx2_l2, avx2_margin, avx2_dot_batch, avx2_dot_i8,
+                                    avx2_stream_lines};
+  return k;
+}
+
+inline bool cpu_has_avx512_vnni();
+
+inline const DistanceKernels& avx512_kernels() {
+  static const DistanceKernels k = {"avx512", avx512_dot, avx512_l2, avx512_margin, avx512_dot_batch,
+                                    cpu_has_avx512_vnni() ? avx512_vnni_dot_i8 : avx2_dot_i8,
+                                    avx512_stream_lines};
+  return k;
+}
+
+inline bool cpu_has_avx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+inline bool cpu_has_avx512() {
+  __builtin_cpu_init();
+  return cpu_has_avx2() && __builtin_cpu_supports("avx512f");
+}
+
+inline bool cpu_has_avx512_vnni() {
+  return cpu_has_avx512() && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni");
+}
+
+inline const DistanceKernels& select_distance_kernels() {
+  const char* env = getenv("VEC_SEARCH_SIMD");
+  if (env != nullptr) {
+    if (strcmp(env, "scalar") == 0)
+      return scalar_kernels();
+    if (strcmp(env, "avx2") == 0 && cpu_has_avx2())
+      return avx2_kernels();
+    if (strcmp(env, "avx512") == 0 && cpu_has_avx512())
+      return avx512_kernels();
+  }
+  if (cpu_has_avx512())
+    return avx512_kernels();
+  if (cpu_has_avx2())
+    return avx2_kernels();
+  return scalar_kernels();
+}
+
+// 当前进程使用的实现, 第一次调用时选定
+inline const DistanceKernels& distance_kernels() {
+  static const DistanceKernels& k = select_distance_kernels();
+  return k;
+}
@@ -0,0 +1,497 @@
+#pragma once
+
+// 索引的持久化存储
+//
+// VectorIndex 只通过 IndexStorage 访问持久化的数据:
+// 一块 IndexMeta, 按段分配的节点记录 (第 i 条记录位于 segment(i >> SEGMENT_BITS) 中的第 i & (SEGMENT_NODES - 1) 条,
+// 每条 node_record_stride(f) 字节, 按 id 直接寻址, 不经过指针转换), 以及按需分配的结果缓存区域和内存树镜像。
+// 节点记录随数据量按段增长, 新建的索引只占用一个段。
+//
+// PmemStorage: libpmemobj pool, 元数据的修改放在事务中
+// MmapStorage: 普通文件 mmap, 用于只有 NVMe 等块设备的机器; 各部分位于文件中固定的偏移, 在提交点 fdatasync/msync 落盘
+
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "distance.h"
+
+#define POOLSIZE ((1024LL * 1024 * 1024 * 50))
+const int MAX_TREES = 32;
+const int SEGMENT_BITS = 16;
+const size_t SEGMENT_NODES = (size_t)1 << SEGMENT_BITS;  // 每段的节点数
+const size_t MAX_SEGMENTS = 8192;
+const long long MAX_NODES = (long long)MAX_SEGMENTS * SEGMENT_NODES;  // 节点数的上限
+// libpmemobj pool 的布局名, 打开时必须一致; PmemStorage::root 或 IndexMeta 的格式变化时更换
+const std::string LAYOUT = "vec_search_v1";
+
+// 持久化的索引元数据
+struct IndexMeta {
+  int f;  // 向量维度, 打开时检查
+  int n_items;  // leaf num
+  int node_total;
+  bool built;
+  int n_trees;
+  int roots[MAX_TREES];
+  uint64_t generation;  // 每次建树时加 1, 缓存中记录的 generation 不同时整体作废; 合并不改变它
+  // 建树之后插入的 item 的记录追加在建树时的全部节点之后, 见 VectorIndex::record_of
+  int built_items;  // 建树时的 item 数
+  int built_nodes;  // 建树时的节点数
+  int merged_items;  // 已经合并进树的 item 数, 之后的 item 只在 delta 缓冲区中
+};
+
+enum class StorageBackend {
+  Auto,  // path 以 ".mmap" 结尾时使用普通文件, 否则使用 libpmemobj pool
+  Pmem,
+  Mmap,
+};
+
+class IndexStorage {
+ public:
+  virtual ~IndexStorage() {}
+
+  virtual const char* name() const = 0;
+
+  // 打开的是已有的索引(而不是新建的)
+  bool existed() const {
+    return existed_;
+  }
+
+  IndexMeta* meta() {
+    return meta_;
+  }
+
+  // 已分配的段数
+  size_t n_segments() const {
+    return segments_.size();
+  }
+
+  // 第 s 段的 SEGMENT_NODES 条节点记录, 64 字节对齐, 格式见 VNode
+  char* segment(size_t s) const {
+    return segments_[s];
+  }
+
+  // 保证前 n 条节点记录可用, 不足时按段追加(新段内容全零); 超过 MAX_NODES 时返回 false。
+  // 已有段的地址在存储打开期间不变, 追加段不会移动已有的记录, 其他线程可以同时读写它们
+  bool reserve(size_t n) {
+    if (n > (size_t)MAX_NODES) {
+      return false;
+    }
+    while (segments_.size() * SEGMENT_NODES < n) {
+      segments_.push_back(add_segment());
+    }
+    return true;
+  }
+
+  // 持久化 [addr, addr + len), 用于有先后顺序要求的细粒度写入
+  virtual void persist(const void* addr, size_t len) = 0;
+
+  // 等待之前的 non-temporal store 落盘 (它们不经过 cache, 不需要再 flush)
+  virtual void drain() {}
+
+  // 之前写入节点记录的数据(包括 persist 不做任何事的后端)都已落盘之后才返回,
+  // 用于提交之前就要求先后顺序的写入: 在改写已提交的节点之前, 它引用的新节点必须先落盘
+  virtual void barrier() {
+    drain();
+  }
+
+  // 在 fn 中修改元数据, 修改整体生效; 提交之前写入节点记录的数据都已落盘
+  virtual void commit(const std::function<void(IndexMeta&)>& fn) = 0;
+
+  // 结果缓存的区域: 已经分配过时返回它并把 capacity 改为分配时记录的值;
+  // 否则 capacity 为 0 时返回 nullptr, 不为 0 时分配 bytes 字节(内容全零)并记录 capacity
+  virtual char* cache_region(size_t bytes, uint64_t& capacity) = 0;
+
+  // 当前的内存树镜像, 不存在时返回 nullptr
+  virtual const char* mem_image(size_t& size) = 0;
+
+  // 丢弃旧的镜像, 返回新分配的 size 字节
+  virtual char* reset_mem_image(size_t size) = 0;
+
+  // [addr, addr + len) 已经读完或写完, 近期不会再访问
+  virtual void release(const void* addr, size_t len) {}
+
+  void memcpy_persist(void* dst, const void* src, size_t len) {
+    memcpy(dst, src, len);
+    persist(dst, len);
+  }
+
+ protected:
+  // 分配一个新段, 持久化地记录下来后返回它的地址; 不能改变已有段的地址
+  virtual char* add_segment() = 0;
+
+  bool existed_ = false;
+  IndexMeta* meta_ = nullptr;
+  std::vector<char*> segments_;
+};
+
+class PmemStorage : public IndexStorage {
+ public:
+  struct root {
+    persistent_ptr<IndexMeta> meta;
+    // 节点记录的段, 每段多分配 64 字节, 按 64 字节对齐后使用
+    persistent_ptr<char[]> segments[MAX_SEGMENTS];
+    p<uint64_t> n_segments;
+    // 持久化的结果缓存 (IndexOptions::persist_result_cache)
+    persistent_ptr<char[]> cache_space;
+    p<uint64_t> cache_capacity;
+    // 内存树和 item 表的镜像 (IndexOptions::persist_mem_image)
+    persistent_ptr<char[]> mem_image;
+    p<uint64_t> mem_image_size;
+  };
+
+  // pool_size: 新建 pool (不是 pool.set) 时的大小
+  PmemStorage(const std::string& path, int f, size_t pool_size) : stride_(node_record_stride(f)) {
+    if (path.find("pool.set") != std::string::npos) {
+      std::cout << "进入pool.set" << std::endl;
+      try {
+        pop_ = pool<root>::create(path, LAYOUT, 0, S_IRWXU);
+        init(f);
+      } catch (const pmem::pool_error& e) {
+        open(path, f);
+      }
+    } else {
+      if (access(path.c_str(), F_OK) == 0) {
+        std::cout << "进入else if" << std::endl;
+        open(path, f);
+      } else {
+        std::cout << "进入else else" << std::endl;
+        pop_ = pool<root>::create(path, LAYOUT, pool_size, S_IRWXU);
+        init(f);
+      }
+    }
+  }
+
+  ~PmemStorage() {
+    pop_.close();
+  }
+
+  const char* name() const override {
+    return "pmem";
+  }
+
+  void persist(const void* addr, size_t len) override {
+    pop_.persist(addr, len);
+  }
+
+  void drain() override {
+    pop_.drain();
+  }
+
+  void commit(const std::function<void(IndexMeta&)>& fn) override {
+    transaction::run(pop_, [&] {
+      transaction::snapshot(meta_);
+      fn(*meta_);
+    });
+  }
+
+  char* cache_region(size_t bytes, uint64_t& capacity) override {
+    if (proot_->cache_space == nullptr) {
+      if (capacity == 0) {
+        return nullptr;
+      }
+      transaction::run(pop_, [&] {
+        proot_->cache_space = make_persistent<char[]>(bytes);
+        proot_->cache_capacity = capacity;
+      });
+    }
+    capacity = proot_->cache_capacity;
+    return proot_->cache_space.get();
+  }
+
+  const char* mem_image(size_t& size) override {
+    size = proot_->mem_image_size;
+    return proot_->mem_image.get();
+  }
+
+  char* reset_mem_image(size_t size) override {
+    transaction::run(pop_, [&] {
+      if (proot_->mem_image != nullptr) {
+        delete_persistent<char[]>(proot_->mem_image, proot_->mem_image_size);
+      }
+      proot_->mem_image = make_persistent<char[]>(size);
+      proot_->mem_image_size = size;
+    });
+    return proot_->mem_image.get();
+  }
+
+ protected:
+  char* add_segment() override {
+    const size_t s = proot_->n_segments;
+    transaction::run(pop_, [&] {
+      proot_->segments[s] = make_persistent<char[]>(stride_ * SEGMENT_NODES + 64);
+      proot_->n_segments = s + 1;
+    });
+    return aligned_segment(s);
+  }
+
+ private:
+  // 初始化时只分配元数据, 节点记录在 add_item/build_index 时按需分段分配
+  void init(int f) {
+    proot_ = pop_.root();
+    transaction::run(pop_, [&] {
+      proot_->meta = make_persistent<IndexMeta>();
+      proot_->meta->f = f;
+    });
+    existed_ = false;
+    meta_ = proot_->meta.get();
+  }
+
+  // 打开已有的 pool: 布局名不同(格式不同或不是索引)或维度不同时抛出异常
+  void open(const std::string& path, int f) {
+    try {
+      pop_ = pool<root>::open(path, LAYOUT);
+    } catch (const pmem::pool_error& e) {
+      throw std::runtime_error(path + " is not an index pool of layout " + LAYOUT + ": " + e.what());
+    }
+    proot_ = pop_.root();
+    if (proot_->meta == nullptr || proot_->meta->f != f) {
+      pop_.close();
+      throw std::runtime_error(path + " is not an index file of dimension " + std::to_string(f));
+    }
+    existed_ = true;
+    meta_ = proot_->meta.get();
+    for (size_t s = 0; s < proot_->n_segments; s++) {
+      segments_.push_back(aligned_segment(s));
+    }
+  }
+
+  // 段在 pool 内的偏移不变, 对齐后的地址每次打开都相同
+  char* aligned_segment(size_t s) {
+    return (char*)(((uintptr_t)proot_->segments[s].get() + 63) & ~(uintptr_t)63);
+  }
+
+  size_t stride_;
+  pool<root> pop_;
+  persistent_ptr<root> proot_;
+};
+
+// 文件布局: [0, SECTOR) 为 Header, [SECTOR, HEADER_SIZE) 为各个节点段的偏移,
+// 之后是按需追加的节点段、结果缓存和内存树镜像, 每部分按页对齐, 偏移记录在 Header 中。
+// 整个文件映射在一段预留的地址空间中, 文件变长时不需要重新映射, 已经取得的指针一直有效。
+//
+// 写入只进入页缓存, 进程崩溃不会丢失; 掉电后的一致性由提交点保证:
+// commit() 先 fdatasync 所有数据, 再修改并 msync 元数据所在的页(Header 不超过一个扇区, 落盘是原子的)。
+// 细粒度的 persist() 不做任何事, 因此结果缓存只在上次正常关闭时沿用, 否则清空; 提交之前需要先后顺序的写入用 barrier()。
+class MmapStorage : public IndexStorage {
+ public:
+  static const uint64_t MAGIC = 0x50414d4d58444956ULL;  // "VIDXMMAP"
+  static const uint32_t VERSION = 5;
+  static const size_t SECTOR = 512;
+  static const size_t HEADER_SIZE = (SECTOR + sizeof(uint64_t) * MAX_SEGMENTS + 4095) / 4096 * 4096;
+  static const size_t RESERVE = 1ULL << 40;  // 预留的地址空间, 文件不能超过该大小
+
+  // advice: 对节点段的 madvise, 树的下降是随机访问, 通常为 MADV_RANDOM 以关闭预读
+  MmapStorage(const std::string& path, int f, int advice) : stride_(node_record_stride(f)), advice_(advice) {
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd_ < 0) {
+      throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    fstat(fd_, &st);
+    base_ = (char*)mmap(nullptr, RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd_, 0);
+    if (base_ == MAP_FAILED) {
+      ::close(fd_);
+      throw std::runtime_error("cannot map " + path + ": " + strerror(errno));
+    }
+    header_ = reinterpret_cast<Header*>(base_);
+    segment_offsets_ = reinterpret_cast<uint64_t*>(base_ + SECTOR);
+
+    if (st.st_size == 0) {
+      std::cout << "mmap storage: create " << path << std::endl;
+      create(f);
+    } else {
+      std::cout << "mmap storage: open " << path << std::endl;
+      if ((size_t)st.st_size < HEADER_SIZE || header_->magic != MAGIC || header_->version != VERSION || header_->f != (uint32_t)f) {
+        munmap(base_, RESERVE);
+        ::close(fd_);
+        throw std::runtime_error(path + " is not an index file of dimension " + std::to_string(f));
+      }
+      existed_ = true;
+      if (!header_->clean && header_->cache_offset != 0) {
+        memset(base_ + header_->cache_offset, 0, header_->cache_bytes);
+      }
+    }
+    header_->clean = 0;
+    sync_header();
+
+    meta_ = &header_->meta;
+    for (size_t s = 0; s < header_->n_segments; s++) {
+      segments_.push_back(base_ + segment_offsets_[s]);
+      if (advice_ != MADV_NORMAL) {
+        madvise(segments_.back(), stride_ * SEGMENT_NODES, advice_);
+      }
+    }
+  }
+
+  ~MmapStorage() {
+    fdatasync(fd_);
+    header_->clean = 1;
+    sync_header();
+    munmap(base_, RESERVE);
+    ::close(fd_);
+  }
+
+  const char* name() const override {
+    return "mmap";
+  }
+
+  void persist(const void* addr, size_t len) override {}
+
+  void barrier() override {
+    fdatasync(fd_);
+  }
+
+  void commit(const std::function<void(IndexMeta&)>& fn) override {
+    fdatasync(fd_);
+    fn(*meta_);
+    sync_header();
+  }
+
+  char* cache_region(size_t bytes, uint64_t& capacity) override {
+    if (header_->cache_offset == 0) {
+      if (capacity == 0) {
+        return nullptr;
+      }
+      const uint64_t offset = extend(bytes);
+      header_->cache_bytes = bytes;
+      header_->cache_capacity = capacity;
+      header_->cache_offset = offset;
+      sync_header();
+    }
+    capacity = header_->cache_capacity;
+    return base_ + header_->cache_offset;
+  }
+
+  const char* mem_image(size_t& size) override {
+    size = header_->image_size;
+    if (header_->image_offset == 0) {
+      return nullptr;
+    }
+    // 镜像整块顺序读入 DRAM
+    madvise(base_ + header_->image_offset, size, MADV_SEQUENTIAL);
+    madvise(base_ + header_->image_offset, size, MADV_WILLNEED);
+    return base_ + header_->image_offset;
+  }
+
+  // 新的镜像放得下时沿用原来的空间, 否则在文件末尾追加, 并释放原来占用的磁盘空间
+  char* reset_mem_image(size_t size) override {
+    if (header_->image_offset != 0 && header_->image_capacity >= size) {
+      memset(base_ + header_->image_offset, 0, std::min<size_t>(size, HEADER_SIZE));
+    } else {
+      if (header_->image_offset != 0) {
+        fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, header_->image_offset, header_->image_capacity);
+      }
+      header_->image_offset = extend(size);
+      header_->image_capacity = page_align(size);
+    }
+    header_->image_size = size;
+    sync_header();
+    return base_ + header_->image_offset;
+  }
+
+  void release(const void* addr, size_t len) override {
+    // 共享映射上 MADV_DONTNEED 只解除映射, 脏页仍会写回文件
+    const uintptr_t begin = (uintptr_t)addr & ~(uintptr_t)(page_size() - 1);
+    madvise((void*)begin, (uintptr_t)addr + len - begin, MADV_DONTNEED);
+  }
+
+ private:
+  struct Header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t f;
+    uint32_t clean;  // 上次是否正常关闭
+    uint64_t file_size;
+    uint64_t n_segments;
+    uint64_t cache_offset;  // 0 表示尚未分配
+    uint64_t cache_bytes;
+    uint64_t cache_capacity;
+    uint64_t image_offset;  // 0 表示尚未分配
+    uint64_t image_size;
+    uint64_t image_capacity;
+    IndexMeta meta;
+  };
+  static_assert(sizeof(Header) <= SECTOR, "Header must fit in one sector");
+
+  static size_t page_size() {
+    return sysconf(_SC_PAGESIZE);
+  }
+
+  static uint64_t page_align(uint64_t n) {
+    return (n + page_size() - 1) / page_size() * page_size();
+  }
+
+  void create(int f) {
+    if (ftruncate(fd_, HEADER_SIZE) != 0) {
+      throw std::runtime_error(std::string("cannot size index file: ") + strerror(errno));
+    }
+    memset(header_, 0, sizeof(Header));
+    header_->version = VERSION;
+    header_->f = f;
+    header_->meta.f = f;
+    header_->file_size = HEADER_SIZE;
+    fdatasync(fd_);
+    header_->magic = MAGIC;
+    existed_ = false;
+  }
+
+  // 在文件末尾追加 bytes 字节(按页对齐, 内容全零), 返回其偏移
+  uint64_t extend(size_t bytes) {
+    const uint64_t offset = header_->file_size;
+    const uint64_t end = offset + page_align(bytes);
+    if (end > RESERVE) {
+      throw std::runtime_error("index file exceeds the reserved mapping");
+    }
+    if (ftruncate(fd_, end) != 0) {
+      throw std::runtime_error(std::string("cannot extend index file: ") + strerror(errno));
+    }
+    header_->file_size = end;
+    return offset;
+  }
+
+  void sync_header() {
+    msync(base_, HEADER_SIZE, MS_SYNC);
+  }
+
+  // 先写入并持久化段的偏移, 再增加段数
+  char* add_segment() override {
+    const size_t bytes = stride_ * SEGMENT_NODES;
+    const uint64_t offset = extend(bytes);
+    segment_offsets_[header_->n_segments] = offset;
+    sync_header();
+    header_->n_segments++;
+    sync_header();
+    if (advice_ != MADV_NORMAL) {
+      madvise(base_ + offset, bytes, advice_);
+    }
+    return base_ + offset;
+  }
+
+  size_t stride_;
+  int advice_;
+  uint64_t* segment_offsets_ = nullptr;
+  int fd_ = -1;
+  char* base_ = nullptr;
+  Header* header_ = nullptr;
+};
+
+inline std::unique_ptr<IndexStorage> open_storage(const std::string& path, int f, StorageBackend backend, size_t pool_size, int mmap_advice) {
+  if (backend == StorageBackend::Auto) {
+    const std::string suffix = ".mmap";
+    const bool is_mmap = path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+    backend = is_mmap ? StorageBackend::Mmap : StorageBackend::Pmem;
+  }
+  if (backend == StorageBackend::Mmap) {
+    return std::unique_ptr<IndexStorage>(new MmapStorage(path, f, mmap_advice));
+  }
+  return std::unique_ptr<IndexStorage>(new PmemStorage(path, f, pool_size));
+}
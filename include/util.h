@@ -16,3 +16,15 @@ long long get_file_size(const string& filename) {
   int rc = stat(filename.c_str(), &stat_buf);
   return rc == 0 ? stat_buf.st_size : -1;
 }
+
+// 进程的峰值常驻内存(/proc/self/status 中的 VmHWM), 单位KB, 读取失败返回 -1
+long long get_peak_rss_kb() {
+  std::ifstream f("/proc/self/status");
+  string line;
+  while (std::getline(f, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return atoll(line.c_str() + 6);
+    }
+  }
+  return -1;
+}
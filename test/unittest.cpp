@@ -3,6 +3,7 @@
 #include <chrono>
 #include <algorithm>
 #include <map>
+#include <numeric>
 #include <random>
 #include <fstream>
 #include <stdio.h>
@@ -78,6 +79,22 @@ TEST(VectorIndex, BuildNoItem) {
   EXPECT_FALSE(index.is_built());
 }
 
+TEST(VectorIndex, ReopenChecksDimension) {
+  // 重新打开 pool 时沿用其中的 item, 维度不同时不能打开
+  TmpFile tmp_file;
+  int f = 8;
+  std::vector<float> v(f, 1.0f);
+  {
+    VectorIndex index(tmp_file.path(), f);
+    EXPECT_TRUE(index.add_item(0, v.data()));
+  }
+  {
+    VectorIndex index(tmp_file.path(), f);
+    EXPECT_EQ(index.get_n_items(), 1);
+  }
+  EXPECT_THROW(VectorIndex(tmp_file.path(), f + 1), std::runtime_error);
+}
+
 TEST(VectorIndex, Build) {
   int f = 40;
   std::vector<std::vector<float>> items;
@@ -155,6 +172,38 @@ TEST(VectorIndex, Search2Item) {
   EXPECT_EQ(index.search_top1(vec), 1);
 }
 
+TEST(VectorIndex, DegenerateSplit) {
+  // 大量重复的向量让 two_means 的两个中心重合, 退化的划分仍要让每个不同的向量都能被查到
+  int f = 8;
+  int n_dup = 300;
+  int n_distinct = 6;
+  std::default_random_engine generator(77);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> dup(f, 1.0f);
+  std::vector<float> items;
+  for (int i = 0; i < n_dup; i++) {
+    items.insert(items.end(), dup.begin(), dup.end());
+  }
+  for (int i = 0; i < n_distinct; i++) {
+    for (int z = 0; z < f; z++) {
+      items.push_back(1.0f + distribution(generator));
+    }
+  }
+  IndexOptions options;
+  options.result_cache_capacity = 0;
+  TmpFile tmp_file;
+  VectorIndex index(tmp_file.path(), f, options);
+  EXPECT_TRUE(index.add_items(0, n_dup + n_distinct, items.data()));
+  EXPECT_TRUE(index.build_index());
+  std::vector<float> q(f);
+  for (int item = n_dup; item < n_dup + n_distinct; item++) {
+    for (int z = 0; z < f; z++) {
+      q[z] = items[(size_t)item * f + z] + 0.001f * distribution(generator);
+    }
+    EXPECT_EQ(index.search_top1(q.data()), item);
+  }
+  EXPECT_LT(index.search_top1(dup.data()), n_dup);
+}
 
 TEST(VectorIndex, SearchExistingItem) {
   TmpFile tmp_file;
@@ -303,3 +352,1494 @@ TEST(VectorIndex, MultiThreadSearch) {
     threads[i].join();
   }
 }
+
+TEST(VectorIndex, SearchBatch) {
+  TmpFile tmp_file;
+  string path = tmp_file.path();
+
+  int f = 64;
+  int n_items = 200;
+  std::default_random_engine generator(114514);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+
+  VectorIndex index(path, f);
+  for (int item = 0; item < n_items; item++) {
+    index.add_item(item, items.data() + (size_t)item * f);
+  }
+  EXPECT_TRUE(index.build_index());
+
+  // 一半为已有item, 一半为扰动后的item
+  int n_queries = 2 * n_items;
+  std::vector<float> queries((size_t)n_queries * f);
+  for (int i = 0; i < n_queries; i++) {
+    for (int z = 0; z < f; z++) {
+      queries[(size_t)i * f + z] = items[(size_t)(i % n_items) * f + z] * (i < n_items ? 1.0f : 0.97f);
+    }
+  }
+
+  std::vector<int> expected(n_queries);
+  {
+    TmpFile tmp_file2;
+    VectorIndex index2(tmp_file2.path(), f);
+    for (int item = 0; item < n_items; item++) {
+      index2.add_item(item, items.data() + (size_t)item * f);
+    }
+    EXPECT_TRUE(index2.build_index());
+    for (int i = 0; i < n_queries; i++) {
+      expected[i] = index2.search_top1(queries.data() + (size_t)i * f);
+    }
+  }
+
+  std::vector<int> out(n_queries, -1);
+  index.search_top1_batch(queries.data(), n_queries, out.data());
+  for (int i = 0; i < n_queries; i++) {
+    EXPECT_EQ(out[i], expected[i]);
+  }
+  for (int i = 0; i < n_items; i++) {
+    EXPECT_EQ(out[i], i);
+  }
+}
+
+TEST(VectorIndex, SearchTopk) {
+  TmpFile tmp_file;
+  string path = tmp_file.path();
+
+  int f = 40;
+  int n_items = 300;
+  std::default_random_engine generator(114514);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<std::vector<float>> items(n_items, std::vector<float>(f, 0));
+  for (int i = 0; i < n_items; i++) {
+    for (int j = 0; j < f; j++) {
+      items[i][j] = distribution(generator);
+    }
+  }
+
+  VectorIndex index(path, f);
+  for (int item = 0; item < n_items; item++) {
+    index.add_item(item, items[item].data());
+  }
+  EXPECT_TRUE(index.build_index());
+
+  int k = 10;
+  std::vector<int> ids(k);
+  std::vector<float> dists(k);
+  std::vector<float> query(f);
+  for (int t = 0; t < 20; t++) {
+    for (int j = 0; j < f; j++) {
+      query[j] = distribution(generator);
+    }
+
+    // 暴力求解真实的top-k
+    std::vector<std::pair<float, int>> truth;
+    for (int i = 0; i < n_items; i++) {
+      truth.emplace_back(Distance::distance(items[i].data(), query.data(), f), i);
+    }
+    std::sort(truth.begin(), truth.end());
+
+    // search_k 覆盖所有叶子时, 结果与暴力搜索一致
+    EXPECT_EQ(index.search_topk(query.data(), k, n_items, ids.data(), dists.data()), k);
+    for (int i = 0; i < k; i++) {
+      EXPECT_EQ(ids[i], truth[i].second);
+      EXPECT_FLOAT_EQ(dists[i], truth[i].first);
+    }
+
+    // 较小的 search_k 只访问部分叶子, 结果仍按距离有序
+    int m = index.search_topk(query.data(), k, 3 * k, ids.data(), dists.data());
+    EXPECT_EQ(m, k);
+    for (int i = 1; i < m; i++) {
+      EXPECT_LE(dists[i - 1], dists[i]);
+    }
+  }
+
+  // 已有的item总是排在第一位
+  for (int item = 0; item < n_items; item++) {
+    EXPECT_EQ(index.search_topk(items[item].data(), 1, 1, ids.data(), nullptr), 1);
+    EXPECT_EQ(ids[0], item);
+  }
+}
+
+TEST(VectorIndex, Forest) {
+  int f = 40;
+  int n_items = 500;
+  std::default_random_engine generator(114514);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<std::vector<float>> items(n_items, std::vector<float>(f, 0));
+  for (int i = 0; i < n_items; i++) {
+    for (int j = 0; j < f; j++) {
+      items[i][j] = distribution(generator);
+    }
+  }
+  std::vector<std::vector<float>> queries(n_items, std::vector<float>(f, 0));
+  for (int i = 0; i < n_items; i++) {
+    for (int j = 0; j < f; j++) {
+      queries[i][j] = items[i][j] + 0.3 * distribution(generator);
+    }
+  }
+
+  auto true_neighbor = [&](const std::vector<float>& vec) {
+    float min_dist = std::numeric_limits<float>::max();
+    int neighbor = 0;
+    for (int i = 0; i < n_items; i++) {
+      float d = Distance::distance(items[i].data(), vec.data(), f);
+      if (d < min_dist) {
+        min_dist = d;
+        neighbor = i;
+      }
+    }
+    return neighbor;
+  };
+
+  auto recall = [&](int n_trees) {
+    TmpFile tmp_file;
+    IndexOptions options;
+    options.n_trees = n_trees;
+    VectorIndex index(tmp_file.path(), f, options);
+    for (int item = 0; item < n_items; item++) {
+      index.add_item(item, items[item].data());
+    }
+    EXPECT_TRUE(index.build_index());
+
+    for (int item = 0; item < n_items; item++) {
+      EXPECT_EQ(index.search_top1(items[item].data()), item);
+    }
+
+    std::vector<float> batch;
+    for (auto& q : queries) {
+      batch.insert(batch.end(), q.begin(), q.end());
+    }
+    std::vector<int> batch_out(n_items);
+    index.search_top1_batch(batch.data(), n_items, batch_out.data());
+
+    int hit = 0;
+    for (int i = 0; i < n_items; i++) {
+      int ret = index.search_top1(queries[i].data());
+      EXPECT_EQ(ret, batch_out[i]);
+      hit += ret == true_neighbor(queries[i]);
+    }
+    return hit;
+  };
+
+  int hit_1 = recall(1);
+  int hit_8 = recall(8);
+  EXPECT_GT(hit_8, hit_1);
+}
+
+TEST(VectorIndex, ParallelBuildDeterministic) {
+  int f = 32;
+  int n_items = 6000;
+  std::default_random_engine generator(114514);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> queries((size_t)200 * f);
+  for (auto& x : queries) {
+    x = distribution(generator);
+  }
+
+  // 不同的建树线程数得到完全相同的树, 因此 top-k 结果也完全相同
+  auto run = [&](int build_threads) {
+    TmpFile tmp_file;
+    IndexOptions options;
+    options.n_trees = 2;
+    options.build_threads = build_threads;
+    VectorIndex index(tmp_file.path(), f, options);
+    for (int item = 0; item < n_items; item++) {
+      index.add_item(item, items.data() + (size_t)item * f);
+    }
+    EXPECT_TRUE(index.build_index());
+
+    std::vector<int> result;
+    int ids[10];
+    for (int i = 0; i < 200; i++) {
+      const float* q = queries.data() + (size_t)i * f;
+      result.push_back(index.search_top1(q));
+      int m = index.search_topk(q, 10, 20, ids, nullptr);
+      result.insert(result.end(), ids, ids + m);
+    }
+    for (int item = 0; item < n_items; item += 7) {
+      EXPECT_EQ(index.search_top1(items.data() + (size_t)item * f), item);
+    }
+    return result;
+  };
+
+  auto single = run(1);
+  EXPECT_EQ(run(4), single);
+}
+
+TEST(VectorIndex, QuantizedMemTree) {
+  // f 不是 QUANT_ALIGN 的倍数, 覆盖补 0 的部分
+  int f = 100;
+  int n_items = 3000;
+  std::default_random_engine generator(2333);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> queries((size_t)n_items * f);
+  for (size_t i = 0; i < queries.size(); i++) {
+    queries[i] = items[i] + 0.3f * distribution(generator);
+  }
+
+  auto run = [&](bool quantize) {
+    TmpFile tmp_file;
+    IndexOptions options;
+    options.n_trees = 2;
+    options.quantize_mem_tree = quantize;
+    VectorIndex index(tmp_file.path(), f, options);
+    for (int item = 0; item < n_items; item++) {
+      index.add_item(item, items.data() + (size_t)item * f);
+    }
+    EXPECT_TRUE(index.build_index());
+
+    std::vector<int> result(n_items);
+    index.search_top1_batch(queries.data(), n_items / 2, result.data());
+    for (int i = n_items / 2; i < n_items; i++) {
+      result[i] = index.search_top1(queries.data() + (size_t)i * f);
+    }
+    for (int item = 0; item < n_items; item += 13) {
+      EXPECT_EQ(index.search_top1(items.data() + (size_t)item * f), item);
+    }
+    return result;
+  };
+
+  // 量化只改变计算方式, 不改变下降路径
+  EXPECT_EQ(run(true), run(false));
+}
+
+TEST(VectorIndex, PrefetchShallowMemTree) {
+  int f = 64;
+  int n_items = 2000;
+  std::default_random_engine generator(8848);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> queries((size_t)n_items * f);
+  for (size_t i = 0; i < queries.size(); i++) {
+    queries[i] = items[i] + 0.3f * distribution(generator);
+  }
+
+  auto run = [&](int mem_tree_levels, int prefetch_lines) {
+    TmpFile tmp_file;
+    IndexOptions options;
+    options.mem_tree_levels = mem_tree_levels;
+    options.prefetch_lines = prefetch_lines;
+    VectorIndex index(tmp_file.path(), f, options);
+    for (int item = 0; item < n_items; item++) {
+      index.add_item(item, items.data() + (size_t)item * f);
+    }
+    EXPECT_TRUE(index.build_index());
+
+    std::vector<int> result(n_items);
+    index.search_top1_batch(queries.data(), n_items / 2, result.data());
+    for (int i = n_items / 2; i < n_items; i++) {
+      result[i] = index.search_top1(queries.data() + (size_t)i * f);
+    }
+    for (int item = 0; item < n_items; item += 11) {
+      EXPECT_EQ(index.search_top1(items.data() + (size_t)item * f), item);
+    }
+    return result;
+  };
+
+  // 内存树的层数和预取都不影响结果; 只缓存 3 层时大部分下降发生在 pmem 中
+  auto expected = run(0, 0);
+  EXPECT_EQ(run(3, 0), expected);
+  EXPECT_EQ(run(3, 4), expected);
+  EXPECT_EQ(run(0, 4), expected);
+}
+
+TEST(VectorIndex, SearchInterleaved) {
+  int f = 48;
+  int n_items = 1500;
+  std::default_random_engine generator(10086);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  // 前一半为已有item, 后一半为扰动后的item
+  std::vector<float> queries(items);
+  for (size_t i = queries.size() / 2; i < queries.size(); i++) {
+    queries[i] += 0.3f * distribution(generator);
+  }
+
+  // 内存树只有 5 层, 让一部分下降发生在 pmem 中
+  for (bool quantize : {false, true}) {
+    IndexOptions options;
+    options.n_trees = 2;
+    options.mem_tree_levels = 5;
+    options.quantize_mem_tree = quantize;
+
+    std::vector<int> expected(n_items);
+    {
+      TmpFile tmp_file;
+      VectorIndex index(tmp_file.path(), f, options);
+      for (int item = 0; item < n_items; item++) {
+        index.add_item(item, items.data() + (size_t)item * f);
+      }
+      EXPECT_TRUE(index.build_index());
+      for (int i = 0; i < n_items; i++) {
+        expected[i] = index.search_top1(queries.data() + (size_t)i * f);
+      }
+    }
+
+    for (int group : {1, 3, 16}) {
+      TmpFile tmp_file;
+      VectorIndex index(tmp_file.path(), f, options);
+      for (int item = 0; item < n_items; item++) {
+        index.add_item(item, items.data() + (size_t)item * f);
+      }
+      EXPECT_TRUE(index.build_index());
+      std::vector<int> out(n_items, -1);
+      index.search_top1_interleaved(queries.data(), n_items, out.data(), group);
+      EXPECT_EQ(out, expected) << "group=" << group << " quantize=" << quantize;
+    }
+  }
+}
+
+TEST(VectorIndex, MemImage) {
+  int f = 40;
+  int n_items = 3000;
+  std::default_random_engine generator(31415);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> queries(items);
+  for (auto& x : queries) {
+    x += 0.3f * distribution(generator);
+  }
+
+  for (bool quantize : {false, true}) {
+    TmpFile tmp_file;
+    IndexOptions options;
+    options.n_trees = 3;
+    options.quantize_mem_tree = quantize;
+    options.result_cache_capacity = 0;
+    VectorIndex index(tmp_file.path(), f, options);
+    for (int item = 0; item < n_items; item++) {
+      index.add_item(item, items.data() + (size_t)item * f);
+    }
+    EXPECT_TRUE(index.build_index());
+
+    std::vector<int> expected(n_items), result(n_items);
+    for (int i = 0; i < n_items; i++) {
+      expected[i] = index.search_top1(queries.data() + (size_t)i * f);
+    }
+    // 从建树时写入的镜像恢复内存树和 item 表, 结果不变
+    EXPECT_TRUE(index.load_mem_image());
+    for (int i = 0; i < n_items; i++) {
+      result[i] = index.search_top1(queries.data() + (size_t)i * f);
+    }
+    EXPECT_EQ(result, expected);
+    for (int item = 0; item < n_items; item += 17) {
+      EXPECT_EQ(index.search_top1(items.data() + (size_t)item * f), item);
+    }
+  }
+}
+
+TEST(VectorIndex, MemTreeBudget) {
+  // 内存树只按选出的层分配, 不超过预算; 不同的预算下搜索结果相同
+  int f = 24;
+  int n_items = 5000;
+  std::default_random_engine generator(2718);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> queries(items);
+  for (auto& x : queries) {
+    x += 0.3f * distribution(generator);
+  }
+
+  IndexOptions options;
+  options.n_trees = 2;
+  options.result_cache_capacity = 0;
+  TmpFile tmp_file;
+  const string path = tmp_file.path() + ".mmap";
+  std::vector<int> expected(n_items);
+  size_t full_bytes;
+  {
+    VectorIndex index(path, f, options);
+    EXPECT_TRUE(index.add_items(0, n_items, items.data()));
+    EXPECT_TRUE(index.build_index());
+    // 不限预算时整棵树都在内存中, 两棵树共 2 * (2 * n_items - 1) 个节点
+    full_bytes = index.mem_tree_bytes();
+    EXPECT_EQ(full_bytes % (2 * (2 * n_items - 1)), 0u);
+    EXPECT_LT(index.mem_tree_level(), (int)LEVEL);
+    for (int i = 0; i < n_items; i++) {
+      expected[i] = index.search_top1(queries.data() + (size_t)i * f);
+    }
+  }
+
+  int prev_level = 0;
+  for (size_t budget : {(size_t)1, full_bytes / 64, full_bytes / 4, full_bytes - 1}) {
+    options.mem_tree_budget = budget;
+    VectorIndex index(path, f, options);
+    EXPECT_GE(index.mem_tree_level(), 1);
+    EXPECT_GE(index.mem_tree_level(), prev_level);
+    prev_level = index.mem_tree_level();
+    if (index.mem_tree_level() > 1) {
+      EXPECT_LE(index.mem_tree_bytes(), budget);
+    }
+    EXPECT_LT(index.mem_tree_bytes(), full_bytes);
+    for (int i = 0; i < n_items; i++) {
+      EXPECT_EQ(index.search_top1(queries.data() + (size_t)i * f), expected[i]) << "budget=" << budget;
+    }
+    // 同样的预算重新打开时直接使用镜像
+    EXPECT_TRUE(index.load_mem_image());
+    EXPECT_EQ(index.mem_tree_level(), prev_level);
+  }
+  EXPECT_GT(prev_level, 1);
+  TmpFile::remove_file(path);
+}
+
+TEST(VectorIndex, HotSubtrees) {
+  // 提升热点子树前后, 各种搜索的结果都不变, 缓存不超过上限
+  int f = 24;
+  int n_items = 6000;
+  std::default_random_engine generator(1618);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> queries(items);
+  for (auto& x : queries) {
+    x += 0.3f * distribution(generator);
+  }
+  // 倾斜的负载: 反复查询前 50 个 item 附近的向量
+  const int n_hot = 50;
+
+  for (size_t budget : {(size_t)64 << 20, (size_t)100 << 10}) {
+    IndexOptions options;
+    options.n_trees = 2;
+    options.mem_tree_levels = 4;
+    options.result_cache_capacity = 0;
+    options.hot_cache_budget = budget;
+    options.hot_promote_interval_ms = 0;
+    TmpFile tmp_file;
+    VectorIndex index(tmp_file.path(), f, options);
+    EXPECT_TRUE(index.add_items(0, n_items, items.data()));
+    EXPECT_TRUE(index.build_index());
+
+    std::vector<int> expected(n_items), expected_topk((size_t)n_items * 5);
+    for (int i = 0; i < n_items; i++) {
+      expected[i] = index.search_top1(queries.data() + (size_t)i * f);
+      index.search_topk(queries.data() + (size_t)i * f, 5, 20, expected_topk.data() + (size_t)i * 5, nullptr);
+    }
+    EXPECT_EQ(index.hot_cache_bytes(), 0u);
+    for (int round = 0; round < 200; round++) {
+      for (int i = 0; i < n_hot; i++) {
+        index.search_top1(queries.data() + (size_t)i * f);
+      }
+    }
+    EXPECT_GT(index.promote_hot_subtrees(), 0);
+    EXPECT_GT(index.hot_cache_bytes(), 0u);
+    EXPECT_LE(index.hot_cache_bytes(), budget);
+
+    std::vector<int> result(n_items), topk(5);
+    for (int i = 0; i < n_items; i++) {
+      EXPECT_EQ(index.search_top1(queries.data() + (size_t)i * f), expected[i]);
+      EXPECT_EQ(index.search_topk(queries.data() + (size_t)i * f, 5, 20, topk.data(), nullptr), 5);
+      EXPECT_TRUE(std::equal(topk.begin(), topk.end(), expected_topk.begin() + (size_t)i * 5)) << i;
+    }
+    index.search_top1_batch(queries.data(), n_items, result.data());
+    EXPECT_EQ(result, expected);
+    index.search_top1_interleaved(queries.data(), n_items, result.data(), 4);
+    EXPECT_EQ(result, expected);
+  }
+
+  {
+    // 后台线程一边提升, 多个线程一边查询
+    IndexOptions options;
+    options.mem_tree_levels = 4;
+    options.result_cache_capacity = 0;
+    options.hot_cache_budget = 64 << 20;
+    options.hot_promote_interval_ms = 1;
+    TmpFile tmp_file;
+    VectorIndex index(tmp_file.path(), f, options);
+    EXPECT_TRUE(index.add_items(0, n_items, items.data()));
+    EXPECT_TRUE(index.build_index());
+    std::vector<int> expected(n_items);
+    for (int i = 0; i < n_items; i++) {
+      expected[i] = index.search_top1(queries.data() + (size_t)i * f);
+    }
+    std::atomic<int> mismatches(0);
+#pragma omp parallel num_threads(4)
+    for (int round = 0; round < 50; round++) {
+      for (int i = 0; i < n_items; i += (i < n_hot ? 1 : 97)) {
+        mismatches += index.search_top1(queries.data() + (size_t)i * f) != expected[i];
+      }
+    }
+    EXPECT_EQ(mismatches.load(), 0);
+    EXPECT_GT(index.hot_cache_bytes(), 0u);
+  }
+}
+
+TEST(VectorIndex, SnapshotSwap) {
+  // 查询与建树, 重新加载镜像同时进行: 只会看到没有快照(-1)或完整的快照, 结果不变
+  int f = 24;
+  int n_items = 4000;
+  std::default_random_engine generator(1729);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> queries(items);
+  for (auto& x : queries) {
+    x += 0.3f * distribution(generator);
+  }
+
+  IndexOptions options;
+  options.n_trees = 2;
+  options.mem_tree_levels = 4;
+  options.result_cache_capacity = 0;
+  options.hot_cache_budget = 1 << 20;
+  options.hot_promote_interval_ms = 1;
+  TmpFile tmp_file;
+  VectorIndex index(tmp_file.path(), f, options);
+  EXPECT_TRUE(index.add_items(0, n_items, items.data()));
+  EXPECT_EQ(index.snapshot_version(), 0u);
+  EXPECT_EQ(index.search_top1(queries.data()), -1);
+
+  const int n_readers = 3;
+  std::atomic<bool> stop(false);
+  std::vector<std::vector<std::pair<int, int>>> seen(n_readers);  // (query, 结果)
+  std::vector<std::thread> readers;
+  for (int r = 0; r < n_readers; r++) {
+    readers.emplace_back([&, r] {
+      for (int i = r; !stop.load(); i = (i + 7) % n_items) {
+        seen[r].emplace_back(i, index.search_top1(queries.data() + (size_t)i * f));
+      }
+    });
+  }
+  EXPECT_TRUE(index.build_index());
+  EXPECT_EQ(index.snapshot_version(), 1u);
+  std::vector<int> expected(n_items);
+  for (int i = 0; i < n_items; i++) {
+    expected[i] = index.search_top1(queries.data() + (size_t)i * f);
+  }
+  // 镜像反复替换快照, 旧快照在读者离开后回收
+  for (int round = 0; round < 20; round++) {
+    EXPECT_TRUE(index.load_mem_image());
+  }
+  EXPECT_EQ(index.snapshot_version(), 21u);
+  stop = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+
+  for (int r = 0; r < n_readers; r++) {
+    bool built = false;
+    int mismatches = 0;
+    for (const auto& s : seen[r]) {
+      if (s.second == -1) {
+        EXPECT_FALSE(built) << "reader " << r << " went back to an empty snapshot";
+      } else {
+        built = true;
+        mismatches += s.second != expected[s.first];
+      }
+    }
+    EXPECT_EQ(mismatches, 0) << "reader " << r;
+  }
+  epoch_domain().synchronize();
+  EXPECT_EQ(epoch_domain().pending(), 0u);
+}
+
+TEST(VectorIndex, DeltaInsert) {
+  // 建树之后插入的 item 立即可以查到, 合并进树和重新打开之后仍然可以查到, 查询与插入和后台合并同时进行
+  int f = 16;
+  int n_items = 2000;
+  int n_extra = 900;
+  std::default_random_engine generator(4242);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)(n_items + n_extra) * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> near(items);
+  for (auto& x : near) {
+    x += 0.01f * distribution(generator);
+  }
+  auto vec = [&](int item) { return items.data() + (size_t)item * f; };
+  // 插入的 item 在 [begin, end) 中: 精确查询返回自己, 带少量噪声的查询几乎都返回自己
+  auto check = [&](VectorIndex& index, int begin, int end) {
+    int found = 0;
+    for (int item = begin; item < end; item++) {
+      EXPECT_EQ(index.search_top1(vec(item)), item);
+      int id;
+      EXPECT_EQ(index.search_topk(vec(item), 1, 10, &id, nullptr), 1);
+      EXPECT_EQ(id, item);
+      found += index.search_top1(near.data() + (size_t)item * f) == item;
+    }
+    EXPECT_GE(found, (end - begin) * 9 / 10);
+    // 批量查询的各条下降路径同样经过合并改写的链接
+    std::vector<int> batch(end - begin), interleaved(end - begin), expected(end - begin);
+    std::iota(expected.begin(), expected.end(), begin);
+    index.search_top1_batch(near.data() + (size_t)begin * f, end - begin, batch.data());
+    index.search_top1_interleaved(near.data() + (size_t)begin * f, end - begin, interleaved.data());
+    for (int i = 0; i < end - begin; i++) {
+      EXPECT_EQ(batch[i], index.search_top1(near.data() + (size_t)(begin + i) * f));
+      EXPECT_EQ(interleaved[i], batch[i]);
+    }
+  };
+
+  IndexOptions options;
+  options.n_trees = 2;
+  options.mem_tree_levels = 4;
+  options.hot_cache_budget = 1 << 20;
+  options.hot_promote_interval_ms = 0;
+  options.delta_merge_threshold = 0;
+  options.delta_capacity = 256;
+  TmpFile tmp_file;
+  const string path = tmp_file.path() + ".mmap";
+  {
+    VectorIndex index(path, f, options);
+    EXPECT_TRUE(index.add_items(0, n_items, items.data()));
+    EXPECT_TRUE(index.build_index());
+    // 先提升热点子树, 合并要同时改写副本中的链接
+    for (int round = 0; round < 20; round++) {
+      for (int item = 0; item < n_items; item++) {
+        index.search_top1(near.data() + (size_t)item * f);
+      }
+    }
+    EXPECT_GT(index.promote_hot_subtrees(), 0);
+    const size_t hot_bytes = index.hot_cache_bytes();
+    // 先让结果缓存记下插入之前的结果, 插入之后命中缓存时仍要与 delta 缓冲区比较
+    for (int item = n_items; item < n_items + 100; item++) {
+      EXPECT_LT(index.search_top1(vec(item)), n_items);
+    }
+    EXPECT_FALSE(index.add_item(n_items + 1, vec(n_items + 1)));
+    EXPECT_TRUE(index.add_items(n_items, 100, vec(n_items)));
+    EXPECT_EQ(index.get_n_items(), n_items + 100);
+    check(index, n_items, n_items + 100);
+
+    EXPECT_EQ(index.merge_delta(), 100);
+    EXPECT_EQ(index.merge_delta(), 0);
+    check(index, n_items, n_items + 100);
+    // 合并就地更新内存结构: 热点子树缓存保留, 镜像到显式写出时才更新
+    EXPECT_EQ(index.hot_cache_bytes(), hot_bytes);
+    EXPECT_FALSE(index.load_mem_image());
+    EXPECT_TRUE(index.save_mem_image());
+    EXPECT_TRUE(index.load_mem_image());
+    check(index, n_items, n_items + 100);
+
+    // 缓冲区写满时插入先同步合并
+    for (int item = n_items + 100; item < n_items + 600; item++) {
+      EXPECT_TRUE(index.add_item(item, vec(item)));
+    }
+    EXPECT_EQ(index.get_n_items(), n_items + 600);
+    check(index, n_items, n_items + 600);
+    check(index, 0, 200);
+  }
+  {
+    // 重新打开: 已合并的在树中, 其余的从记录读回缓冲区
+    VectorIndex index(path, f, options);
+    EXPECT_EQ(index.get_n_items(), n_items + 600);
+    std::vector<float> v(f);
+    for (int item = 0; item < n_items + 600; item += 37) {
+      index.get_item(item, v.data());
+      EXPECT_TRUE(std::equal(v.begin(), v.end(), vec(item))) << item;
+    }
+    check(index, n_items, n_items + 600);
+  }
+  {
+    // 后台合并: 查询始终看到已经插入的全部 item
+    options.delta_merge_threshold = 64;
+    VectorIndex index(path, f, options);
+    std::atomic<int> inserted(n_items + 600);
+    std::atomic<bool> stop(false);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 2; r++) {
+      readers.emplace_back([&, r] {
+        for (int i = r; !stop.load(); i++) {
+          const int item = (int)((i * 7919LL) % inserted.load());
+          errors += index.search_top1(vec(item)) != item;
+        }
+      });
+    }
+    for (int item = n_items + 600; item < n_items + n_extra; item += 10) {
+      EXPECT_TRUE(index.add_items(item, 10, vec(item)));
+      inserted = item + 10;
+    }
+    stop = true;
+    for (auto& t : readers) {
+      t.join();
+    }
+    EXPECT_EQ(errors.load(), 0);
+    index.merge_delta();
+    check(index, n_items + 600, n_items + n_extra);
+  }
+  TmpFile::remove_file(path);
+}
+
+TEST(VectorIndex, DeltaMergeInMemTree) {
+  // 合并分裂的叶子在内存树中(整棵树在内存中, 或者叶子恰好是内存树的出口)时, DRAM 中的链接转到 pmem 继续下降,
+  // 各种查询都能找到合并的 item
+  int f = 8;
+  int n_items = 40;
+  int n_extra = 300;
+  std::default_random_engine generator(777);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)(n_items + n_extra) * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  // 带极小噪声的查询不命中 item 表, 走树的下降
+  const int n = n_items + n_extra;
+  std::vector<float> near(items);
+  for (auto& x : near) {
+    x += 1e-4f * distribution(generator);
+  }
+
+  for (int levels : {0, 5}) {
+    IndexOptions options;
+    options.n_trees = 2;
+    options.mem_tree_levels = levels;
+    options.delta_merge_threshold = 0;
+    options.result_cache_capacity = 0;
+    TmpFile tmp_file;
+    VectorIndex index(tmp_file.path() + ".mmap", f, options);
+    EXPECT_TRUE(index.add_items(0, n_items, items.data()));
+    EXPECT_TRUE(index.build_index());
+    EXPECT_TRUE(index.add_items(n_items, n_extra, items.data() + (size_t)n_items * f));
+    EXPECT_EQ(index.merge_delta(), n_extra);
+
+    std::vector<int> batch(n), interleaved(n);
+    index.search_top1_batch(near.data(), n, batch.data());
+    index.search_top1_interleaved(near.data(), n, interleaved.data());
+    int found = 0;
+    for (int item = 0; item < n; item++) {
+      const int top1 = index.search_top1(near.data() + (size_t)item * f);
+      found += top1 == item;
+      EXPECT_EQ(batch[item], top1);
+      EXPECT_EQ(interleaved[item], top1);
+      int id;
+      EXPECT_EQ(index.search_topk(near.data() + (size_t)item * f, 1, 4, &id, nullptr), 1);
+      EXPECT_EQ(id, item);
+    }
+    EXPECT_GE(found, n * 99 / 100) << "levels=" << levels;
+    TmpFile::remove_file(tmp_file.path() + ".mmap");
+  }
+}
+
+TEST(VectorIndex, CachedResultAcrossMerge) {
+  // 合并不清空结果缓存: 命中的条目与它之后插入的 item 比较, 不论它们还在 delta 缓冲区中还是已经合并进树
+  int f = 16;
+  int n_items = 500;
+  std::default_random_engine generator(2718);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  IndexOptions options;
+  options.delta_merge_threshold = 0;
+  options.delta_capacity = 64;
+  TmpFile tmp_file;
+  VectorIndex index(tmp_file.path() + ".mmap", f, options);
+  EXPECT_TRUE(index.add_items(0, n_items, items.data()));
+  EXPECT_TRUE(index.build_index());
+
+  // 远离全部 item 的查询, 第二次命中缓存
+  std::vector<float> q(f, 8.0f);
+  const int first = index.search_top1(q.data());
+  EXPECT_EQ(index.search_top1(q.data()), first);
+  const size_t cached = index.result_cache_size();
+  EXPECT_GT(cached, 0u);
+  auto near_q = [&](float scale) {
+    std::vector<float> v(q);
+    for (auto& x : v) {
+      x += scale * distribution(generator);
+    }
+    return v;
+  };
+
+  // 合并之后条目仍在, 命中时看到刚合并进树的 item
+  std::vector<float> v1 = near_q(0.5f);
+  EXPECT_TRUE(index.add_items(n_items, 1, v1.data()));
+  EXPECT_EQ(index.merge_delta(), 1);
+  EXPECT_EQ(index.generation(), 1);
+  EXPECT_EQ(index.result_cache_size(), cached);
+  EXPECT_EQ(index.search_top1(q.data()), n_items);
+
+  // 还在缓冲区中的更近的 item
+  std::vector<float> v2 = near_q(0.1f);
+  EXPECT_TRUE(index.add_items(n_items + 1, 1, v2.data()));
+  EXPECT_EQ(index.search_top1(q.data()), n_items + 1);
+  std::vector<int> batch(1);
+  index.search_top1_batch(q.data(), 1, batch.data());
+  EXPECT_EQ(batch[0], n_items + 1);
+
+  // 之后插入的 item 超过一个缓冲区时重新搜索, 结果不变
+  std::vector<float> far((size_t)200 * f);
+  for (auto& x : far) {
+    x = distribution(generator);
+  }
+  EXPECT_TRUE(index.add_items(n_items + 2, 200, far.data()));
+  EXPECT_EQ(index.search_top1(q.data()), n_items + 1);
+  TmpFile::remove_file(tmp_file.path() + ".mmap");
+}
+
+TEST(Distance, KernelsAgree) {
+  // 各个 SIMD 实现的累加顺序相同, 结果必须逐位一致
+  std::vector<const DistanceKernels*> kernels = {&scalar_kernels()};
+  if (cpu_has_avx2()) kernels.push_back(&avx2_kernels());
+  if (cpu_has_avx512()) kernels.push_back(&avx512_kernels());
+
+  std::default_random_engine generator(1919810);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  for (int f : {1, 7, 8, 17, 31, 32, 33, 64, 100, 128, 255, 256, 1000}) {
+    const int n = 7;
+    std::vector<float> data((size_t)(n + 1) * f);
+    for (auto& x : data) {
+      x = distribution(generator);
+    }
+    const float* x = data.data();
+    const float* ys[n];
+    for (int i = 0; i < n; i++) {
+      ys[i] = data.data() + (size_t)(i + 1) * f;
+    }
+
+    double ref = 0;
+    for (int z = 0; z < f; z++) {
+      ref += (double)x[z] * ys[0][z];
+    }
+    EXPECT_NEAR(scalar_kernels().dot(x, ys[0], f), ref, 1e-3 * f);
+
+    for (auto k : kernels) {
+      float batch[n];
+      k->dot_batch(x, ys, n, f, batch);
+      for (int i = 0; i < n; i++) {
+        const float expect_dot = scalar_kernels().dot(x, ys[i], f);
+        EXPECT_EQ(k->dot(x, ys[i], f), expect_dot) << k->name << " f=" << f;
+        EXPECT_EQ(batch[i], expect_dot) << k->name << " f=" << f;
+        EXPECT_EQ(k->l2(x, ys[i], f), scalar_kernels().l2(x, ys[i], f)) << k->name << " f=" << f;
+        EXPECT_EQ(k->margin(x, 0.5f, ys[i], f), scalar_kernels().margin(x, 0.5f, ys[i], f)) << k->name << " f=" << f;
+      }
+    }
+  }
+
+  // non-temporal 拷贝: 源地址不对齐, 目的地址 64 字节对齐
+  std::vector<char> src(64 * 9 + 3);
+  for (size_t i = 0; i < src.size(); i++) {
+    src[i] = (char)(i * 7);
+  }
+  for (auto k : kernels) {
+    alignas(64) char dst[64 * 9];
+    memset(dst, 0, sizeof(dst));
+    k->stream_lines(dst, src.data() + 3, 9);
+    _mm_sfence();
+    EXPECT_EQ(memcmp(dst, src.data() + 3, sizeof(dst)), 0) << k->name;
+  }
+}
+
+TEST(Distance, QuantizedMarginBound) {
+  std::default_random_engine generator(4399);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  for (int f : {5, 64, 100, 256}) {
+    const int fq = (f + QUANT_ALIGN - 1) / QUANT_ALIGN * QUANT_ALIGN;
+    std::vector<float> v(f), y(f);
+    std::vector<int8_t> qy(fq);
+    // 与内存树中的布局相同: 头部之后紧跟 int8 向量
+    std::vector<MemNode> slab(mem_node_stride(fq) / sizeof(MemNode));
+    MemNode& node = slab[0];
+    int8_t* qv = node.qv();
+    for (int trial = 0; trial < 200; trial++) {
+      for (int z = 0; z < f; z++) {
+        v[z] = distribution(generator);
+        y[z] = distribution(generator) * 10;
+      }
+      node.alpha = distribution(generator);
+      node.scale = quantize(v.data(), f, fq, qv);
+      int l1 = 0;
+      for (int z = 0; z < f; z++) {
+        EXPECT_GE(qv[z], -127);
+        l1 += std::abs((int)qv[z]);
+      }
+      node.l1 = node.scale * l1;
+      QuantQuery qq;
+      quantize_query(y.data(), f, fq, qy.data(), qq);
+
+      float bound;
+      const float approx = Euclidean::margin_mem_quant(&node, qq, f, fq, bound);
+      const float exact = node.alpha + dot(v.data(), y.data(), f);
+      EXPECT_LE(std::fabs(approx - exact), bound) << "f=" << f;
+      // 各个 int8 实现的结果相同
+      EXPECT_EQ(scalar_kernels().dot_i8(qv, qy.data(), fq), distance_kernels().dot_i8(qv, qy.data(), fq));
+      if (cpu_has_avx2()) {
+        EXPECT_EQ(scalar_kernels().dot_i8(qv, qy.data(), fq), avx2_kernels().dot_i8(qv, qy.data(), fq));
+      }
+    }
+  }
+}
+
+TEST(ResultCache, Bounded) {
+  ResultCache cache(1000);
+  EXPECT_EQ(cache.capacity(), 1024);
+  for (uint64_t i = 0; i < 100000; i++) {
+    uint64_t key = i * 0x9E3779B97F4A7C15ULL;
+    cache.insert(key, (int)i, (int)i + 1);
+    int value = -1, watermark = -1;
+    EXPECT_TRUE(cache.find(key, value, watermark));
+    EXPECT_EQ(value, (int)i);
+    EXPECT_EQ(watermark, (int)i + 1);
+  }
+  EXPECT_LE(cache.size(), cache.capacity());
+
+  // 被反复访问的条目不会被淘汰
+  const uint64_t hot = 0x123456789ULL;
+  cache.insert(hot, 7, 0);
+  for (uint64_t i = 0; i < 100000; i++) {
+    int value, watermark;
+    EXPECT_TRUE(cache.find(hot, value, watermark));
+    cache.insert((i + 1) * 0xC2B2AE3D27D4EB4FULL, 0, 0);
+  }
+
+  cache.clear();
+  EXPECT_EQ(cache.size(), 0);
+  ResultCache disabled(0);
+  disabled.insert(1, 1, 1);
+  int value, watermark;
+  EXPECT_FALSE(disabled.find(1, value, watermark));
+}
+
+TEST(ResultCache, Concurrent) {
+  // 多个线程同时读写同一批 bucket, 读到的 value 和 watermark 必须与 key 对应
+  ResultCache cache(256);
+  std::vector<std::thread> threads;
+  std::atomic<int> wrong{0};
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&cache, &wrong, t]() {
+      for (int i = 0; i < 200000; i++) {
+        const uint64_t id = (uint64_t)((i * 7 + t) % 4096);
+        const uint64_t key = (id + 1) * 0x9E3779B97F4A7C15ULL;
+        int value, watermark;
+        if (cache.find(key, value, watermark)) {
+          if (value != (int)id || watermark != (int)id * 3) wrong++;
+        } else {
+          cache.insert(key, (int)id, (int)id * 3);
+        }
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  EXPECT_EQ(wrong.load(), 0);
+  EXPECT_LE(cache.size(), cache.capacity());
+}
+
+TEST(ResultCache, AttachRegion) {
+  const size_t capacity = 512;
+  std::vector<char> buffer(ResultCache::region_size(capacity) + 64, 0);
+  char* region = (char*)(((uintptr_t)buffer.data() + 63) & ~(uintptr_t)63);
+  int n_persist = 0;
+  auto persist = [](void* ctx, const void*, size_t) { (*(int*)ctx)++; };
+
+  {
+    ResultCache cache;
+    EXPECT_FALSE(cache.attach(region, capacity, 1, persist, &n_persist));
+    EXPECT_EQ(cache.capacity(), capacity);
+    for (int i = 0; i < 100; i++) {
+      cache.insert((uint64_t)(i + 1) << 32 | i, i, i + 1000);
+    }
+    EXPECT_GT(n_persist, 0);
+  }
+
+  // 同一 generation 重新打开: 条目全部保留
+  {
+    ResultCache cache;
+    EXPECT_TRUE(cache.attach(region, capacity, 1, persist, &n_persist));
+    for (int i = 0; i < 100; i++) {
+      int value = -1, watermark = -1;
+      EXPECT_TRUE(cache.find((uint64_t)(i + 1) << 32 | i, value, watermark));
+      EXPECT_EQ(value, i);
+      EXPECT_EQ(watermark, i + 1000);
+    }
+  }
+
+  // 模拟写到一半时崩溃: 第 0 个 bucket (只有 i = 63 的条目) 的序号为奇数, 重新打开时被清空, 其余 bucket 不受影响
+  region[64] = 1;
+  {
+    ResultCache cache;
+    EXPECT_TRUE(cache.attach(region, capacity, 1, persist, &n_persist));
+    int value, watermark;
+    EXPECT_FALSE(cache.find(64ULL << 32 | 63, value, watermark));
+    EXPECT_TRUE(cache.find(2ULL << 32 | 1, value, watermark));
+    EXPECT_EQ(value, 1);
+    EXPECT_EQ(cache.size(), 99);
+  }
+
+  // 索引重建后 generation 变化, 旧条目全部作废
+  {
+    ResultCache cache;
+    EXPECT_FALSE(cache.attach(region, capacity, 2, persist, &n_persist));
+    EXPECT_EQ(cache.size(), 0);
+    EXPECT_EQ(cache.generation(), 2);
+  }
+}
+
+TEST(VectorIndex, PersistResultCache) {
+  TmpFile tmp_file;
+  int f = 32;
+  int n_items = 500;
+  std::default_random_engine generator(5201314);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+
+  IndexOptions options;
+  options.persist_result_cache = true;
+  options.result_cache_capacity = 4096;
+  VectorIndex index(tmp_file.path(), f, options);
+  for (int item = 0; item < n_items; item++) {
+    index.add_item(item, items.data() + (size_t)item * f);
+  }
+  EXPECT_TRUE(index.build_index());
+  EXPECT_EQ(index.generation(), 1);
+
+  // 第二次查询命中缓存, 结果不变
+  std::vector<float> q(f);
+  for (int i = 0; i < 50; i++) {
+    for (int z = 0; z < f; z++) {
+      q[z] = items[(size_t)i * f + z] + 0.1f;
+    }
+    int first = index.search_top1(q.data());
+    EXPECT_EQ(index.search_top1(q.data()), first);
+  }
+}
+
+TEST(VectorIndex, MmapStorage) {
+  int f = 32;
+  int n_items = 2000;
+  std::default_random_engine generator(8086);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> queries(items);
+  for (auto& x : queries) {
+    x += 0.3f * distribution(generator);
+  }
+
+  IndexOptions options;
+  options.n_trees = 2;
+  options.persist_result_cache = true;
+  auto search_all = [&](VectorIndex& index) {
+    std::vector<int> result(n_items);
+    for (int i = 0; i < n_items; i++) {
+      result[i] = index.search_top1(queries.data() + (size_t)i * f);
+    }
+    return result;
+  };
+
+  std::vector<int> expected;
+  {
+    TmpFile tmp_file;
+    VectorIndex index(tmp_file.path(), f, options);
+    for (int item = 0; item < n_items; item++) {
+      index.add_item(item, items.data() + (size_t)item * f);
+    }
+    EXPECT_TRUE(index.build_index());
+    expected = search_all(index);
+  }
+
+  // 以 ".mmap" 结尾的路径使用普通文件, 建树和查询结果与 pmem 相同
+  TmpFile tmp_file;
+  const string path = tmp_file.path() + ".mmap";
+  {
+    VectorIndex index(path, f, options);
+    EXPECT_FALSE(index.is_built());
+    for (int item = 0; item < n_items; item++) {
+      index.add_item(item, items.data() + (size_t)item * f);
+    }
+    EXPECT_TRUE(index.build_index());
+    EXPECT_EQ(search_all(index), expected);
+  }
+  // 重新打开: 从文件恢复元数据、内存树镜像和结果缓存
+  {
+    VectorIndex index(path, f, options);
+    EXPECT_TRUE(index.is_built());
+    EXPECT_EQ(index.get_n_items(), n_items);
+    EXPECT_EQ(index.generation(), 1);
+    EXPECT_EQ(search_all(index), expected);
+    std::vector<float> v(f);
+    index.get_item(n_items - 1, v.data());
+    EXPECT_TRUE(std::equal(v.begin(), v.end(), items.begin() + (size_t)(n_items - 1) * f));
+  }
+  // 维度不同的文件不能打开
+  EXPECT_THROW(VectorIndex(path, f + 1, options), std::runtime_error);
+  TmpFile::remove_file(path);
+}
+
+TEST(VectorIndex, GrowSegments) {
+  // 节点记录按段分配: 新建的索引很小, 建树时跨越多个段, 重新打开后段表不变
+  int f = 8;
+  int n_items = SEGMENT_NODES + 5000;
+  std::default_random_engine generator(4242);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  std::vector<float> queries((size_t)1000 * f);
+  for (size_t i = 0; i < queries.size(); i++) {
+    queries[i] = items[i] + 0.2f * distribution(generator);
+  }
+
+  TmpFile tmp_file;
+  const string path = tmp_file.path() + ".mmap";
+  IndexOptions options;
+  options.result_cache_capacity = 0;
+  std::vector<int> expected(1000);
+  {
+    VectorIndex index(path, f, options);
+    struct stat st;
+    ASSERT_EQ(stat(path.c_str(), &st), 0);
+    EXPECT_LT(st.st_size, 1 << 20);
+
+    EXPECT_FALSE(index.add_item(-1, items.data()));
+    EXPECT_FALSE(index.add_item(MAX_NODES, items.data()));
+    // 不能跳过 id
+    EXPECT_FALSE(index.add_item(1, items.data()));
+    for (int item = 0; item < n_items; item++) {
+      ASSERT_TRUE(index.add_item(item, items.data() + (size_t)item * f));
+    }
+    EXPECT_TRUE(index.build_index());
+    for (int i = 0; i < 1000; i++) {
+      expected[i] = index.search_top1(queries.data() + (size_t)i * f);
+    }
+  }
+  {
+    VectorIndex index(path, f, options);
+    EXPECT_EQ(index.get_n_items(), n_items);
+    for (int i = 0; i < 1000; i++) {
+      EXPECT_EQ(index.search_top1(queries.data() + (size_t)i * f), expected[i]);
+    }
+    for (int item = 0; item < n_items; item += 997) {
+      EXPECT_EQ(index.search_top1(items.data() + (size_t)item * f), item);
+    }
+    std::vector<float> v(f);
+    index.get_item(n_items - 1, v.data());
+    EXPECT_TRUE(std::equal(v.begin(), v.end(), items.begin() + (size_t)(n_items - 1) * f));
+  }
+  TmpFile::remove_file(path);
+}
+
+TEST(VectorIndex, AddItems) {
+  // add_items 与逐个 add_item 得到的数据和索引相同
+  for (int f : {7, 16, 100}) {
+    int n_items = 3000;
+    std::default_random_engine generator(f);
+    std::normal_distribution<float> distribution(0.0, 1.0);
+    std::vector<float> items((size_t)n_items * f);
+    for (auto& x : items) {
+      x = distribution(generator);
+    }
+    std::vector<float> queries(items);
+    for (auto& x : queries) {
+      x += 0.3f * distribution(generator);
+    }
+    IndexOptions options;
+    options.result_cache_capacity = 0;
+
+    std::vector<int> expected(n_items);
+    {
+      TmpFile tmp_file;
+      VectorIndex index(tmp_file.path(), f, options);
+      for (int item = 0; item < n_items; item++) {
+        index.add_item(item, items.data() + (size_t)item * f);
+      }
+      EXPECT_TRUE(index.build_index());
+      for (int i = 0; i < n_items; i++) {
+        expected[i] = index.search_top1(queries.data() + (size_t)i * f);
+      }
+    }
+
+    TmpFile tmp_file;
+    const string path = tmp_file.path() + ".mmap";
+    {
+      VectorIndex index(path, f, options);
+      EXPECT_FALSE(index.add_items(1, 10, items.data()));  // 不能跳过 id
+      EXPECT_TRUE(index.add_items(0, 0, items.data()));
+      EXPECT_TRUE(index.add_items(0, 1000, items.data()));
+      EXPECT_EQ(index.get_n_items(), 1000);
+    }
+    {
+      // 提交过的批次在重新打开后仍然有效, 重叠的部分被覆盖
+      VectorIndex index(path, f, options);
+      EXPECT_EQ(index.get_n_items(), 1000);
+      EXPECT_TRUE(index.add_items(999, 1234, items.data() + (size_t)999 * f));
+      EXPECT_TRUE(index.add_items(2233, n_items - 2233, items.data() + (size_t)2233 * f));
+      EXPECT_EQ(index.get_n_items(), n_items);
+      std::vector<float> v(f);
+      for (int item = 0; item < n_items; item += 111) {
+        index.get_item(item, v.data());
+        EXPECT_TRUE(std::equal(v.begin(), v.end(), items.begin() + (size_t)item * f)) << item;
+      }
+      EXPECT_TRUE(index.build_index());
+      EXPECT_FALSE(index.add_items(n_items + 1, 1, items.data()));  // 建树之后也不能跳过 id
+      for (int i = 0; i < n_items; i++) {
+        EXPECT_EQ(index.search_top1(queries.data() + (size_t)i * f), expected[i]);
+      }
+    }
+    TmpFile::remove_file(path);
+  }
+}
+
+TEST(Dataset, LoadVecFiles) {
+  // 各种格式读出的向量一致, 分块导入的结果与直接 add_items 相同
+  const int f = 20, n_items = 1000;
+  std::default_random_engine generator(7);
+  std::uniform_int_distribution<int> distribution(0, 255);
+  std::vector<float> items((size_t)n_items * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+
+  TmpFile tmp_file;
+  const string fvecs = tmp_file.path() + ".fvecs", bvecs = tmp_file.path() + ".bvecs";
+  const string ivecs = tmp_file.path() + ".ivecs", raw = tmp_file.path() + ".raw";
+  {
+    std::ofstream fo(fvecs, std::ios::binary), bo(bvecs, std::ios::binary);
+    std::ofstream io(ivecs, std::ios::binary), ro(raw, std::ios::binary);
+    for (int i = 0; i < n_items; i++) {
+      const float* v = items.data() + (size_t)i * f;
+      fo.write((const char*)&f, 4).write((const char*)v, f * sizeof(float));
+      ro.write((const char*)v, f * sizeof(float));
+      bo.write((const char*)&f, 4);
+      io.write((const char*)&f, 4);
+      for (int z = 0; z < f; z++) {
+        const uint8_t b = v[z];
+        const int32_t k = v[z];
+        bo.write((const char*)&b, 1);
+        io.write((const char*)&k, 4);
+      }
+    }
+  }
+
+  VecFile file;
+  EXPECT_FALSE(file.open(raw));  // 裸 fp32 文件需要给出维度
+  EXPECT_FALSE(file.open(raw, VecFormat::Raw, 3 * f));  // 大小不是记录的整数倍
+  std::vector<float> v((size_t)10 * f);
+  for (const string& path : {fvecs, bvecs, raw}) {
+    ASSERT_TRUE(file.open(path, VecFormat::Auto, f)) << path;
+    EXPECT_EQ(file.dim(), f);
+    EXPECT_EQ(file.count(), (size_t)n_items);
+    EXPECT_TRUE(file.read(500, 10, v.data()));
+    EXPECT_TRUE(std::equal(v.begin(), v.end(), items.begin() + (size_t)500 * f)) << path;
+    EXPECT_FALSE(file.read(995, 10, v.data()));
+
+    size_t next = 100;
+    EXPECT_TRUE(file.stream(100, 850, 64, [&](size_t begin, size_t cnt, const float* data) {
+      EXPECT_EQ(begin, next);
+      EXPECT_EQ(cnt, std::min<size_t>(64, 950 - begin));
+      EXPECT_TRUE(std::equal(data, data + cnt * f, items.begin() + begin * f));
+      next += cnt;
+      return true;
+    }));
+    EXPECT_EQ(next, 950u);
+    EXPECT_FALSE(file.stream(0, n_items, 64, [&](size_t begin, size_t, const float*) { return begin == 0; }));
+  }
+
+  ASSERT_TRUE(file.open(ivecs));
+  std::vector<int32_t> gt((size_t)2 * f);
+  EXPECT_TRUE(file.read_ints(3, 2, gt.data()));
+  for (int z = 0; z < 2 * f; z++) {
+    EXPECT_EQ(gt[z], (int32_t)items[(size_t)3 * f + z]);
+  }
+
+  IndexOptions options;
+  options.result_cache_capacity = 0;
+  ASSERT_TRUE(file.open(fvecs));
+  {
+    // 先导入一部分, 之后从 get_n_items 处接着导入
+    VectorIndex index(tmp_file.path(), f, options);
+    EXPECT_TRUE(index.add_items(0, 300, items.data()));
+    EXPECT_TRUE(load_vectors(index, file, 700, 128));
+    EXPECT_EQ(index.get_n_items(), 700);
+    EXPECT_TRUE(load_vectors(index, file, n_items * 2, 128));
+    EXPECT_EQ(index.get_n_items(), n_items);
+    std::vector<float> w(f);
+    for (int item = 0; item < n_items; item += 37) {
+      index.get_item(item, w.data());
+      EXPECT_TRUE(std::equal(w.begin(), w.end(), items.begin() + (size_t)item * f)) << item;
+    }
+    EXPECT_TRUE(index.build_index());
+    for (int item = 0; item < n_items; item += 37) {
+      EXPECT_EQ(index.search_top1(items.data() + (size_t)item * f), item);
+    }
+  }
+  for (const string& path : {fvecs, bvecs, ivecs, raw}) {
+    TmpFile::remove_file(path);
+  }
+}
+
+TEST(Dataset, BruteForceKnn) {
+  // 分块、多线程扫描的结果与逐个比较距离排序的结果相同
+  const int f = 33, n_items = 2000, n_queries = 50, k = 7;
+  std::default_random_engine generator(11);
+  std::normal_distribution<float> distribution(0.0, 1.0);
+  std::vector<float> items((size_t)n_items * f), queries((size_t)n_queries * f);
+  for (auto& x : items) {
+    x = distribution(generator);
+  }
+  for (auto& x : queries) {
+    x = distribution(generator);
+  }
+
+  BruteForceKnn knn(queries.data(), n_queries, f, k);
+  for (int first = 0; first < n_items; first += 300) {
+    const int cnt = std::min(300, n_items - first);
+    knn.scan(first, cnt, items.data() + (size_t)first * f, 4);
+  }
+  for (int q = 0; q < n_queries; q++) {
+    std::vector<std::pair<float, int>> all;
+    for (int i = 0; i < n_items; i++) {
+      all.emplace_back(distance_kernels().l2(items.data() + (size_t)i * f, queries.data() + (size_t)q * f, f), i);
+    }
+    std::sort(all.begin(), all.end());
+    for (int j = 0; j < k; j++) {
+      EXPECT_EQ(knn.ids(q)[j], all[j].second);
+      EXPECT_EQ(knn.dists(q)[j], all[j].first);
+    }
+  }
+
+  // 不足 k 个时以 -1 补齐; 写出的 ivecs 可以读回
+  BruteForceKnn few(queries.data(), n_queries, f, k);
+  few.scan(0, 3, items.data(), 1);
+  EXPECT_GE(few.ids(0)[2], 0);
+  EXPECT_EQ(few.ids(0)[3], -1);
+  TmpFile tmp_file;
+  const string ivecs = tmp_file.path() + ".ivecs";
+  ASSERT_TRUE(write_ivecs(ivecs, knn.all_ids().data(), n_queries, k));
+  VecFile file;
+  ASSERT_TRUE(file.open(ivecs));
+  EXPECT_EQ(file.dim(), k);
+  EXPECT_EQ(file.count(), (size_t)n_queries);
+  std::vector<int32_t> gt((size_t)n_queries * k);
+  EXPECT_TRUE(file.read_ints(0, n_queries, gt.data()));
+  EXPECT_EQ(gt, knn.all_ids());
+  TmpFile::remove_file(ivecs);
+}
+
+TEST(ExactTable, InsertFind) {
+  ExactTable table;
+  int value;
+  EXPECT_FALSE(table.find(42, value));
+  for (int i = 0; i < 10000; i++) {
+    EXPECT_TRUE(table.insert_if_absent((uint64_t)i * 0x9E3779B97F4A7C15ULL, i));
+  }
+  // 重复的 key 保留第一次插入的 value
+  EXPECT_FALSE(table.insert_if_absent(7 * 0x9E3779B97F4A7C15ULL, -1));
+  EXPECT_EQ(table.size(), 10000);
+  EXPECT_GE(table.capacity(), 2 * table.size());
+  for (int i = 0; i < 10000; i++) {
+    EXPECT_TRUE(table.find((uint64_t)i * 0x9E3779B97F4A7C15ULL, value));
+    EXPECT_EQ(value, i);
+  }
+
+  ExactTable copy;
+  copy.load(table.data(), table.capacity(), table.shard_bits(), table.size());
+  EXPECT_TRUE(copy.find(7 * 0x9E3779B97F4A7C15ULL, value));
+  EXPECT_EQ(value, 7);
+  EXPECT_FALSE(copy.find(12345, value));
+}
+
+TEST(ExactTable, ConcurrentInsert) {
+  // 单个写者在预留好的空间中插入, 读者同时查找: 已经发布的 key 一定能找到且 value 正确
+  const int n = 50000;
+  ExactTable table;
+  table.reset(1000);
+  table.reserve(n);
+  const size_t capacity = table.capacity();
+  std::atomic<int> published(0);
+  std::atomic<bool> stop(false);
+  std::atomic<int> errors(0);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 3; r++) {
+    readers.emplace_back([&, r] {
+      int value;
+      for (int i = r; !stop.load(); i++) {
+        const int limit = published.load();
+        if (limit == 0) {
+          continue;
+        }
+        const int k = i % limit;
+        errors += !table.find((uint64_t)(k + 1) * 0x9E3779B97F4A7C15ULL, value) || value != k;
+      }
+    });
+  }
+  for (int i = 0; i < n; i++) {
+    ASSERT_TRUE(table.has_room(1));
+    table.insert_if_absent((uint64_t)(i + 1) * 0x9E3779B97F4A7C15ULL, i);
+    published = i + 1;
+  }
+  stop = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+  EXPECT_EQ(errors.load(), 0);
+  EXPECT_EQ(table.capacity(), capacity);
+  EXPECT_FALSE(table.has_room(table.capacity()));
+}
+
+TEST(ExactTable, ParallelBuild) {
+  const size_t n = 200000;
+  std::mt19937_64 generator(7);
+  std::vector<uint64_t> keys(n);
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = generator();
+  }
+  // 重复的 key 以及 0, 应保留最小的下标
+  keys[100] = keys[5];
+  keys[150000] = keys[5];
+  keys[77] = 0;
+
+  ExactTable serial;
+  for (size_t i = 0; i < n; i++) {
+    serial.insert_if_absent(keys[i], i);
+  }
+  for (int n_threads : {1, 3, 8}) {
+    ExactTable table;
+    table.build(keys.data(), n, n_threads);
+    EXPECT_GT(table.shard_bits(), 0);
+    EXPECT_EQ(table.size(), serial.size());
+    EXPECT_GE(table.capacity(), 2 * table.size());
+    int value, expected;
+    for (size_t i = 0; i < n; i++) {
+      ASSERT_TRUE(table.find(keys[i], value));
+      ASSERT_TRUE(serial.find(keys[i], expected));
+      ASSERT_EQ(value, expected);
+    }
+    EXPECT_TRUE(table.find(keys[150000], value));
+    EXPECT_EQ(value, 5);
+
+    // 建好后仍可逐条插入, 从 pool 恢复后结果不变
+    EXPECT_TRUE(table.insert_if_absent(12345, -7));
+    ExactTable copy;
+    copy.load(table.data(), table.capacity(), table.shard_bits(), table.size());
+    EXPECT_TRUE(copy.find(12345, value));
+    EXPECT_EQ(value, -7);
+    EXPECT_TRUE(copy.find(keys[77], value));
+    EXPECT_EQ(value, 77);
+  }
+}